@@ -37,6 +37,7 @@
 
 #include "buffer.h"
 #include "i2c.h"
+#include "config.h"
 #include "leds.h"
 
 
@@ -60,16 +61,17 @@ bool bme280_temp_press_rh(float *temp, float *press, float *rh)
     return true;
 }
 
-static void bme280_read_task(void *pvParameters)
-{
-    /* Delta encoding state. */
-    uint32_t last_index = 0;
-    uint32_t last_bme280_temp = 0;
-    uint32_t last_bme280_pressure = 0;
-    uint32_t last_bme280_humidity = 0;
+/* Delta encoding state. */
+static uint32_t last_index = 0;
+static uint32_t last_bme280_temp = 0;
+static uint32_t last_bme280_pressure = 0;
+static uint32_t last_bme280_humidity = 0;
 
-    xSemaphoreTake(i2c_sem, portMAX_DELAY);
+static bmp280_t bme280_dev;
+static bool bme280p;
 
+static bool bme280_init()
+{
     bmp280_params_t bme280_params;
     bmp280_init_default_params(&bme280_params);
     bme280_params.mode = BMP280_MODE_NORMAL;
@@ -77,81 +79,86 @@ static void bme280_read_task(void *pvParameters)
     bme280_params.oversampling = BMP280_ULTRA_HIGH_RES;
     bme280_params.standby = BMP280_STANDBY_250;
 
-    bmp280_t bme280_dev;
     bme280_dev.i2c_addr = BMP280_I2C_ADDRESS_0;
-    bool available = bmp280_init(&bme280_dev, &bme280_params);
-    xSemaphoreGive(i2c_sem);
+    if (!bmp280_init(&bme280_dev, &bme280_params))
+        return false;
 
-    if (!available)
-        vTaskDelete(NULL);
+    bme280p = bme280_dev.id == BME280_CHIP_ID;
+    return true;
+}
 
-    bool bme280p = bme280_dev.id == BME280_CHIP_ID;
-    
-    for (;;) {
-        vTaskDelay(10000 / portTICK_PERIOD_MS);
+/* The sensor runs in normal mode, converting continuously, so the last
+ * conversion is just read. */
+static int32_t bme280_sample(bool start)
+{
+    int32_t temperature;
+    uint32_t pressure;
+    uint32_t humidity = 0;
+    if (!bmp280_read_fixed(&bme280_dev, &temperature, &pressure,
+                           bme280p ? &humidity : NULL)) {
+        return -1;
+    }
 
-        xSemaphoreTake(i2c_sem, portMAX_DELAY);
+    bme280_available = true;
+    bme280_temperature = temperature;
+    bme280_pressure = pressure;
+    bme280_rh = humidity;
+    return 0;
+}
 
-        int32_t temperature;
-        uint32_t pressure;
-        uint32_t humidity = 0;
-        if (!bmp280_read_fixed(&bme280_dev, &temperature, &pressure,
-                               bme280p ? &humidity : NULL)) {
-            xSemaphoreGive(i2c_sem);
-            blink_red();
-            continue;
+static void bme280_log()
+{
+    int32_t temperature = bme280_temperature;
+    uint32_t pressure = bme280_pressure;
+    uint32_t humidity = bme280_rh;
+
+    while (1) {
+        uint8_t outbuf[15];
+        /* Delta encoding */
+        int32_t temp_delta = (int32_t)temperature - (int32_t)last_bme280_temp;
+        uint32_t len = emit_leb128_signed(outbuf, 0, temp_delta);
+        int32_t pressure_delta = (int32_t)pressure - (int32_t)last_bme280_pressure;
+        len = emit_leb128_signed(outbuf, len, pressure_delta);
+        int32_t code = DBUF_EVENT_BMP280_TEMP_PRESSURE;
+
+        if (bme280p) {
+            int32_t humidity_delta = (int32_t)humidity - (int32_t)last_bme280_humidity;
+            len = emit_leb128_signed(outbuf, len, humidity_delta);
+            code = DBUF_EVENT_BME280_TEMP_PRESSURE_RH;
         }
 
-        bme280_available = true;
-        bme280_temperature = temperature;
-        bme280_pressure = pressure;
-        bme280_rh = humidity;
-
-        xSemaphoreGive(i2c_sem);
-
-        while (1) {
-            uint8_t outbuf[15];
-            /* Delta encoding */
-            int32_t temp_delta = (int32_t)temperature - (int32_t)last_bme280_temp;
-            uint32_t len = emit_leb128_signed(outbuf, 0, temp_delta);
-            int32_t pressure_delta = (int32_t)pressure - (int32_t)last_bme280_pressure;
-            len = emit_leb128_signed(outbuf, len, pressure_delta);
-            int32_t code = DBUF_EVENT_BMP280_TEMP_PRESSURE;
-
-            if (bme280p) {
-                int32_t humidity_delta = (int32_t)humidity - (int32_t)last_bme280_humidity;
-                len = emit_leb128_signed(outbuf, len, humidity_delta);
-                code = DBUF_EVENT_BME280_TEMP_PRESSURE_RH;
-            }
-
-            uint32_t new_index = dbuf_append(last_index, code, outbuf, len, 1, 0);
-            if (new_index == last_index)
-                break;
-
-            /* Moved on to a new buffer. Reset the delta encoding
-             * state and retry. */
-            last_index = new_index;
-            last_bme280_temp = 0;
-            last_bme280_pressure = 0;
-            last_bme280_humidity = 0;
-        };
-
-        blink_green();
-
-        /*
-         * Commit the values logged. Note this is the only task
-         * accessing this state so these updates are synchronized with
-         * the last event of this class append.
-         */
-        last_bme280_temp = temperature;
-        last_bme280_pressure = pressure;
-        last_bme280_humidity = humidity;
-    }
+        uint32_t new_index = dbuf_append(last_index, code, outbuf, len, 1, 0);
+        if (new_index == last_index)
+            break;
+
+        /* Moved on to a new buffer. Reset the delta encoding
+         * state and retry. */
+        last_index = new_index;
+        last_bme280_temp = 0;
+        last_bme280_pressure = 0;
+        last_bme280_humidity = 0;
+    };
+
+    /*
+     * Commit the values logged. Note this is the only task
+     * accessing this state so these updates are synchronized with
+     * the last event of this class append.
+     */
+    last_bme280_temp = temperature;
+    last_bme280_pressure = pressure;
+    last_bme280_humidity = humidity;
 }
 
-
+static i2c_sensor_t bme280_sensor = {
+    .init = bme280_init,
+    .sample = bme280_sample,
+    .log = bme280_log,
+};
 
 void init_bme280()
 {
-    xTaskCreate(&bme280_read_task, "BME280 reader", 272, NULL, 2, NULL);
+    if (param_bme280_period) {
+        bme280_sensor.period = param_bme280_period * 1000;
+        add_i2c_sensor(&bme280_sensor);
+    }
 }
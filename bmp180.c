@@ -37,75 +37,80 @@
 
 #include "buffer.h"
 #include "i2c.h"
+#include "config.h"
 #include "leds.h"
 
 
 
-static void bmp180_read_task(void *pvParameters)
-{
-    /* Delta encoding state. */
-    uint32_t last_index = 0;
-    uint32_t last_bmp180_temp = 0;
-    uint32_t last_bmp180_pressure = 0;
-
-    xSemaphoreTake(i2c_sem, portMAX_DELAY);
-    bmp180_constants_t bmp180_constants;
-    bool bmp180_available = bmp180_is_available() &&
-        bmp180_fillInternalConstants(&bmp180_constants);
-    xSemaphoreGive(i2c_sem);
-
-    if (!bmp180_available)
-        vTaskDelete(NULL);
-
-    for (;;) {
-        vTaskDelay(10000 / portTICK_PERIOD_MS);
+/* Delta encoding state. */
+static uint32_t last_index = 0;
+static uint32_t last_bmp180_temp = 0;
+static uint32_t last_bmp180_pressure = 0;
 
-        xSemaphoreTake(i2c_sem, portMAX_DELAY);
+static bmp180_constants_t bmp180_constants;
+static int32_t bmp180_temperature;
+static uint32_t bmp180_pressure;
 
-        int32_t temperature;
-        uint32_t pressure;
-        if (!bmp180_measure(&bmp180_constants, &temperature, &pressure, 3)) {
-            xSemaphoreGive(i2c_sem);
-            blink_red();
-            continue;
-        }
-            
-        xSemaphoreGive(i2c_sem);
-
-        while (1) {
-            uint8_t outbuf[12];
-            /* Delta encoding */
-            int32_t temp_delta = (int32_t)temperature - (int32_t)last_bmp180_temp;
-            uint32_t len = emit_leb128_signed(outbuf, 0, temp_delta);
-            int32_t pressure_delta = (int32_t)pressure - (int32_t)last_bmp180_pressure;
-            len = emit_leb128_signed(outbuf, len, pressure_delta);
-            int32_t code = DBUF_EVENT_BMP180_TEMP_PRESSURE;
-            uint32_t new_index = dbuf_append(last_index, code, outbuf, len, 1, 0);
-            if (new_index == last_index)
-                break;
-
-            /* Moved on to a new buffer. Reset the delta encoding
-             * state and retry. */
-            last_index = new_index;
-            last_bmp180_temp = 0;
-            last_bmp180_pressure = 0;
-        };
-
-        blink_green();
+static bool bmp180_init()
+{
+    return bmp180_is_available() &&
+        bmp180_fillInternalConstants(&bmp180_constants);
+}
 
-        /*
-         * Commit the values logged. Note this is the only task
-         * accessing this state so these updates are synchronized with
-         * the last event of this class append.
-         */
-        last_bmp180_temp = temperature;
-        last_bmp180_pressure = pressure;
+/* The bmp180 driver waits for the conversions itself, so this is done in one
+ * step. */
+static int32_t bmp180_sample(bool start)
+{
+    if (!bmp180_measure(&bmp180_constants, &bmp180_temperature,
+                        &bmp180_pressure, 3)) {
+        return -1;
     }
+    return 0;
 }
 
-
+static void bmp180_log()
+{
+    int32_t temperature = bmp180_temperature;
+    uint32_t pressure = bmp180_pressure;
+
+    while (1) {
+        uint8_t outbuf[12];
+        /* Delta encoding */
+        int32_t temp_delta = (int32_t)temperature - (int32_t)last_bmp180_temp;
+        uint32_t len = emit_leb128_signed(outbuf, 0, temp_delta);
+        int32_t pressure_delta = (int32_t)pressure - (int32_t)last_bmp180_pressure;
+        len = emit_leb128_signed(outbuf, len, pressure_delta);
+        int32_t code = DBUF_EVENT_BMP180_TEMP_PRESSURE;
+        uint32_t new_index = dbuf_append(last_index, code, outbuf, len, 1, 0);
+        if (new_index == last_index)
+            break;
+
+        /* Moved on to a new buffer. Reset the delta encoding
+         * state and retry. */
+        last_index = new_index;
+        last_bmp180_temp = 0;
+        last_bmp180_pressure = 0;
+    };
+
+    /*
+     * Commit the values logged. Note this is the only task
+     * accessing this state so these updates are synchronized with
+     * the last event of this class append.
+     */
+    last_bmp180_temp = temperature;
+    last_bmp180_pressure = pressure;
+}
+
+static i2c_sensor_t bmp180_sensor = {
+    .init = bmp180_init,
+    .sample = bmp180_sample,
+    .log = bmp180_log,
+};
 
 void init_bmp180()
 {
-    xTaskCreate(&bmp180_read_task, "bmp180_read_task", 256, NULL, 2, NULL);
+    if (param_bmp180_period) {
+        bmp180_sensor.period = param_bmp180_period * 1000;
+        add_i2c_sensor(&bmp180_sensor);
+    }
 }
@@ -65,6 +65,8 @@
 #include "bmp180.h"
 #include "bme280.h"
 #include "ds3231.h"
+#include "stats.h"
+#include "sleep.h"
 
 
 #define DBUF_DATA_SIZE 4096
@@ -87,11 +89,22 @@ typedef struct {
 /*
  * The buffers are managed as a ring-buffer. If the oldest data is not saved in
  * time then it is discarded.
+ *
+ * The number of buffers is a configuration parameter, and they are allocated
+ * from the heap at startup after the network tasks have been created. The
+ * number is limited to keep DBUF_HEAP_RESERVE bytes of the heap free for the
+ * network stack and the web server, and at least MIN_DBUFS are allocated.
  */
 
-#define NUM_DBUFS 2
+#define MIN_DBUFS 2
+#define MAX_DBUFS 32
+#define DBUF_HEAP_RESERVE 16384
+
+static dbuf_t *dbufs;
+static uint32_t num_dbufs;
 
-static dbuf_t dbufs[NUM_DBUFS];
+/* Marks no buffer, for dbuf_lent. */
+#define DBUF_NONE 0xffffffff
 
 /* The current data is written to the dbufs_head buffer. */
 static uint32_t dbufs_head;
@@ -102,6 +115,62 @@ static uint32_t dbufs_tail;
 /* To synchronize access to the data buffers. */
 static SemaphoreHandle_t dbufs_sem;
 
+/* The time the dbufs_sem was last taken, for the hold time statistic. */
+static uint32_t dbufs_sem_taken;
+
+/* Take and give the dbufs_sem, noting the wait and hold times. */
+static void take_dbufs_sem()
+{
+    uint32_t start = sdk_system_get_time();
+    xSemaphoreTake(dbufs_sem, portMAX_DELAY);
+    dbufs_sem_taken = sdk_system_get_time();
+    stat_time_note(&stat_dbufs_sem_wait, start, dbufs_sem_taken);
+}
+
+static void give_dbufs_sem()
+{
+    stat_time_note(&stat_dbufs_sem_hold, dbufs_sem_taken, sdk_system_get_time());
+    xSemaphoreGive(dbufs_sem);
+}
+
+/* The buffer number lent to the flash_data task to be written directly, or
+ * DBUF_NONE if none. A lent buffer is not discarded when the ring wraps. */
+static uint32_t dbuf_lent = DBUF_NONE;
+
+/*
+ * The head buffer is saved once the oldest unsaved content is this old, in RTC
+ * counter units, currently about 120 seconds.
+ */
+#define DBUF_SAVE_DELAY 20000000
+
+/*
+ * Set when an append leaves something for the flash_data task to save, either
+ * a full buffer or a head buffer that is due to be saved. The flash_data task
+ * is only notified then, rather than on every event, as it would just find
+ * nothing to save for most events.
+ */
+static int flash_data_pending;
+
+/* Set by dbuf_flush() to have the head buffer saved without waiting for the
+ * DBUF_SAVE_DELAY. */
+static int dbufs_flush;
+
+/* The task waiting in dbuf_wait(), or NULL if none. */
+static TaskHandle_t dbuf_wait_task;
+
+/* The number of tail buffers discarded, before being saved, since startup. */
+uint32_t dbufs_dropped;
+
+/* The number of events discarded since startup because the ring was full and
+ * the tail buffer was still being written to flash. */
+uint32_t dbuf_events_dropped;
+
+/* The index and size of the head buffer content last copied for the flash_data
+ * task, so that only the new content needs to be copied on the next save. A
+ * zero copied_size means nothing has been copied yet. */
+static uint32_t copied_index;
+static uint32_t copied_size;
+
 /* Return the index for the buffer number. */
 static uint32_t dbuf_index(uint32_t num)
 {
@@ -111,12 +180,67 @@ static uint32_t dbuf_index(uint32_t num)
 }
 
 uint32_t dbuf_head_index() {
-    xSemaphoreTake(dbufs_sem, portMAX_DELAY);
+    take_dbufs_sem();
     uint32_t index = dbuf_index(dbufs_head);
-    xSemaphoreGive(dbufs_sem);
+    give_dbufs_sem();
     return index;
 }
 
+/*
+ * Return the buffer number holding the given index, or DBUF_NONE if it is not
+ * held in memory. Called holding the dbufs_sem.
+ */
+static uint32_t dbuf_find(uint32_t index)
+{
+    uint32_t num = dbufs_tail;
+    while (1) {
+        if (dbuf_index(num) == index)
+            return num;
+        if (num == dbufs_head)
+            return DBUF_NONE;
+        if (++num >= num_dbufs)
+            num = 0;
+    }
+}
+
+/*
+ * Return the current size of the buffer with the given index, or zero if it is
+ * not held in memory.
+ */
+uint32_t dbuf_size(uint32_t index)
+{
+    take_dbufs_sem();
+    uint32_t num = dbuf_find(index);
+    uint32_t size = num == DBUF_NONE ? 0 : dbufs[num].size;
+    give_dbufs_sem();
+    return size;
+}
+
+/*
+ * Copy the range from start to end of the buffer with the given index into buf,
+ * limited to the current size of the buffer. Return the number of bytes
+ * copied, or -1 if the buffer is not held in memory. This allows reading the
+ * content not yet saved to flash, without forcing a save.
+ */
+int32_t dbuf_copy_range(uint32_t index, uint32_t start, uint32_t end,
+                        uint8_t *buf)
+{
+    take_dbufs_sem();
+    uint32_t num = dbuf_find(index);
+    if (num == DBUF_NONE) {
+        give_dbufs_sem();
+        return -1;
+    }
+    uint32_t size = dbufs[num].size;
+    if (end > size)
+        end = size;
+    if (start > end)
+        start = end;
+    memcpy(buf, dbufs[num].data + start, end - start);
+    give_dbufs_sem();
+    return end - start;
+}
+
 static void set_dbuf_index(uint32_t num, uint32_t index)
 {
     uint32_t *words = (uint32_t *)(dbufs[num].data);
@@ -160,6 +284,81 @@ uint32_t emit_leb128_signed(uint8_t *buf, uint32_t start, int64_t v)
     }
 }
 
+/*
+ * A real time summary of the buffers, for finding the buffers covering a range
+ * of real time without downloading and decoding them all.
+ *
+ * The events that log a real time, the server response time, the DS3231 clock
+ * time and the web client time, also note an anchor pairing the RTC counter
+ * with the real time in seconds, see dbuf_note_time(). The anchor carries over
+ * to the following buffers while the RTC counter runs, including across a deep
+ * sleep. When a buffer is sealed the RTC counter times of its first and last
+ * events are converted to real times using the anchor, and noted in a ring of
+ * DBUF_TIMES entries indexed by the buffer index. A zero time is unknown, when
+ * there has been no anchor since startup. This state is accessed holding the
+ * dbufs_sem.
+ */
+#define DBUF_TIMES 128
+
+typedef struct {
+    uint32_t first_sec;
+    uint32_t last_sec;
+} dbuf_time_t;
+
+static dbuf_time_t dbuf_times[DBUF_TIMES];
+/* The index following the last buffer noted, and the number noted. */
+static uint32_t dbuf_times_next;
+static uint32_t dbuf_times_count;
+
+/* The RTC counter time of the first event in the head buffer. */
+static uint32_t head_first_time;
+
+/* The last anchor, or a zero anchor_sec if none. */
+static uint32_t anchor_time;
+static uint32_t anchor_sec;
+
+/* The RTC counter period, in usec Q12 fixed point, set at startup. */
+static uint32_t rtc_cali;
+
+/* Real times before this are rejected, as from an unset clock. */
+#define DBUF_TIME_MIN 1475142680
+
+/*
+ * Convert an RTC counter time to a real time using the anchor. The difference
+ * is signed, so the anchor is moved forward before it is half the counter
+ * range old, see rebase_anchor().
+ */
+static uint32_t dbuf_real_time(uint32_t time)
+{
+    if (anchor_sec == 0)
+        return 0;
+    int64_t usec = ((int64_t)(int32_t)(time - anchor_time) * rtc_cali) >> 12;
+    return anchor_sec + (int32_t)(usec / 1000000);
+}
+
+static void rebase_anchor(uint32_t time)
+{
+    if (anchor_sec == 0 || rtc_cali == 0 || time - anchor_time < 0x40000000)
+        return;
+    /* Move the anchor forward by whole seconds. */
+    uint32_t sec = dbuf_real_time(time) - anchor_sec;
+    anchor_time += ((uint64_t)sec * 1000000 << 12) / rtc_cali;
+    anchor_sec += sec;
+}
+
+static void seal_dbuf_time(uint32_t index, uint32_t first_time,
+                           uint32_t last_time)
+{
+    if (index != dbuf_times_next)
+        dbuf_times_count = 0;
+    dbuf_time_t *t = &dbuf_times[index % DBUF_TIMES];
+    t->first_sec = dbuf_real_time(first_time);
+    t->last_sec = dbuf_real_time(last_time);
+    dbuf_times_next = index + 1;
+    if (dbuf_times_count < DBUF_TIMES)
+        dbuf_times_count++;
+}
+
 /*
  * Append an event to the buffers. This function firstly emits the common event
  * header including the event code, size, and the time stamp using the RTC
@@ -189,21 +388,217 @@ uint32_t emit_leb128_signed(uint8_t *buf, uint32_t start, int64_t v)
  * data. The called needs to know when the buffer has changed to reset the state
  * and to do this the index is passed in an if not the current index then the
  * append abort, the current index is returned.
+ *
+ * The work is done by dbuf_append_locked() which is called holding the
+ * dbufs_sem.
  */
 static int32_t last_code;
 static int32_t last_size;
 static uint32_t last_time;
 
-uint32_t dbuf_append(uint32_t index, uint16_t code, uint8_t *data, uint32_t size,
-                     int low_res_time, int no_repeat)
+static uint32_t dbuf_append_locked(uint32_t index, uint16_t code, uint8_t *data,
+                                   uint32_t size, int low_res_time, int no_repeat);
+
+/*
+ * A run of repeats of the last event of a class, such as the PMS frames when
+ * the values do not change, is held here rather than by the logging task so
+ * that the run can be logged to the buffer holding the event repeated when
+ * that buffer is sealed, which might happen in any task. Room is reserved in
+ * the head buffer for logging each run held, so it always fits.
+ *
+ * The run is logged as a single event with the given code having the leb128
+ * encoded number of repeats, then the leb128 encoded times of the first and
+ * last repeats before the event time, in units of 8192 RTC ticks. This is
+ * followed by a bit list of the low eight bits of the checksum of each repeat,
+ * emitted least significant first: a '1' bit if the same as the prior
+ * checksum, otherwise a '0' bit and the eight bits. The prior checksum of the
+ * first repeat is that of the event repeated. The list is padded with zero
+ * bits to a byte boundary.
+ *
+ * These are accessed holding the dbufs_sem.
+ */
+#define DBUF_REPEAT_MAX 32
+#define DBUF_REPEATS 2
+
+/* Room for the largest run event, the header and the data. */
+#define DBUF_REPEAT_RESERVE 64
+
+typedef struct {
+    uint16_t code;
+    uint32_t count;
+    uint32_t first_time;
+    uint32_t last_time;
+    uint8_t prior;
+    uint8_t checksums[DBUF_REPEAT_MAX];
+} dbuf_repeat_t;
+
+static dbuf_repeat_t dbuf_repeats[DBUF_REPEATS];
+
+/* The room reserved in the head buffer for the runs held. */
+static uint32_t dbuf_repeat_reserve()
 {
-    xSemaphoreTake(dbufs_sem, portMAX_DELAY);
+    uint32_t reserve = 0;
+    uint32_t i;
+    for (i = 0; i < DBUF_REPEATS; i++) {
+        if (dbuf_repeats[i].count)
+            reserve += DBUF_REPEAT_RESERVE;
+    }
+    return reserve;
+}
 
+/*
+ * Log the run held, if any. The run is released first so that the event uses
+ * the room reserved for it. Returns the current buffer index, which is a new
+ * index only if there was no room, in which case the run is discarded.
+ */
+static uint32_t flush_dbuf_repeat(dbuf_repeat_t *repeat)
+{
+    uint32_t index = dbuf_index(dbufs_head);
+
+    if (repeat->count == 0)
+        return index;
+
+    uint8_t data[48];
+    uint32_t time = RTC.COUNTER;
+    uint32_t size = emit_leb128(data, 0, repeat->count);
+    size = emit_leb128(data, size, (time - repeat->first_time) >> 13);
+    size = emit_leb128(data, size, (time - repeat->last_time) >> 13);
+
+    uint8_t prior = repeat->prior;
+    uint32_t bits = 0;
+    uint32_t nbits = 0;
+    uint32_t i;
+    for (i = 0; i < repeat->count; i++) {
+        uint8_t checksum = repeat->checksums[i];
+        if (checksum == prior) {
+            bits |= 1 << nbits;
+            nbits += 1;
+        } else {
+            bits |= (uint32_t)checksum << (nbits + 1);
+            nbits += 9;
+        }
+        prior = checksum;
+        while (nbits >= 8) {
+            data[size++] = bits;
+            bits >>= 8;
+            nbits -= 8;
+        }
+    }
+    if (nbits)
+        data[size++] = bits;
+
+    repeat->count = 0;
+    return dbuf_append_locked(index, repeat->code, data, size, 0, 0);
+}
+
+/* Log all the runs held, before sealing the head buffer. */
+static void flush_dbuf_repeats()
+{
+    uint32_t i;
+    for (i = 0; i < DBUF_REPEATS; i++)
+        flush_dbuf_repeat(&dbuf_repeats[i]);
+}
+
+/*
+ * Hold a repeat of the last event logged by the caller, to be logged as part
+ * of a run with the given code. The checksum is that of the repeat, and the
+ * prior checksum is that of the event repeated or of the prior repeat. The
+ * index is the buffer of the event repeated, and as for dbuf_append() if the
+ * head buffer has moved on then the current index is returned, and the caller
+ * must reset any delta encoding state and log the repeat in full.
+ */
+uint32_t dbuf_hold_repeat(uint32_t index, uint16_t code, uint8_t prior,
+                          uint8_t checksum)
+{
+    take_dbufs_sem();
+    uint32_t current_index = dbuf_index(dbufs_head);
+    if (index != current_index) {
+        give_dbufs_sem();
+        return current_index;
+    }
+
+    dbuf_repeat_t *repeat = NULL;
+    uint32_t i;
+    for (i = 0; i < DBUF_REPEATS; i++) {
+        if (dbuf_repeats[i].count && dbuf_repeats[i].code == code) {
+            repeat = &dbuf_repeats[i];
+            break;
+        }
+    }
+    if (!repeat) {
+        for (i = 0; i < DBUF_REPEATS; i++) {
+            if (dbuf_repeats[i].count == 0) {
+                repeat = &dbuf_repeats[i];
+                break;
+            }
+        }
+    }
+    if (!repeat) {
+        /* All in use, log the first run to make room. */
+        repeat = &dbuf_repeats[0];
+        flush_dbuf_repeat(repeat);
+    }
+
+    uint32_t time = RTC.COUNTER;
+    int room = 1;
+    if (repeat->count == 0) {
+        dbuf_t *head = &dbufs[dbufs_head];
+        room = head->size + dbuf_repeat_reserve() + DBUF_REPEAT_RESERVE <=
+            DBUF_DATA_SIZE;
+        repeat->code = code;
+        repeat->first_time = time;
+        repeat->prior = prior;
+    }
+    repeat->last_time = time;
+    repeat->checksums[repeat->count++] = checksum;
+
+    /* Log the run when full, or at once if there is no room to reserve for
+     * it, which seals the head buffer if it does not fit. */
+    if (repeat->count >= DBUF_REPEAT_MAX || !room)
+        current_index = flush_dbuf_repeat(repeat);
+
+    int notify = flash_data_pending;
+    flash_data_pending = 0;
+    TaskHandle_t waiter = dbuf_wait_task;
+    give_dbufs_sem();
+
+    if (notify)
+        xTaskNotify(flash_data_task, 0, eNoAction);
+    if (waiter)
+        xTaskNotify(waiter, 0, eNoAction);
+    return current_index;
+}
+
+/*
+ * Log the run held with the given code, if any. Called before logging an
+ * event that differs from the event repeated.
+ */
+void dbuf_flush_repeat(uint16_t code)
+{
+    take_dbufs_sem();
+    uint32_t i;
+    for (i = 0; i < DBUF_REPEATS; i++) {
+        if (dbuf_repeats[i].count && dbuf_repeats[i].code == code)
+            flush_dbuf_repeat(&dbuf_repeats[i]);
+    }
+    int notify = flash_data_pending;
+    flash_data_pending = 0;
+    TaskHandle_t waiter = dbuf_wait_task;
+    give_dbufs_sem();
+
+    if (notify)
+        xTaskNotify(flash_data_task, 0, eNoAction);
+    if (waiter)
+        xTaskNotify(waiter, 0, eNoAction);
+}
+
+static uint32_t dbuf_append_locked(uint32_t index, uint16_t code, uint8_t *data,
+                                   uint32_t size, int low_res_time, int no_repeat)
+{
     uint32_t current_index = dbuf_index(dbufs_head);
     if (index != current_index) {
         /* Moved on to the next buffer. The caller must reset any delta encoding
          * state and retry. */
-        xSemaphoreGive(dbufs_sem);
         return current_index;
     }
 
@@ -248,7 +643,6 @@ uint32_t dbuf_append(uint32_t index, uint16_t code, uint8_t *data, uint32_t size
 
     if (code == last_code && size == last_size) {
         if (no_repeat) {
-            xSemaphoreGive(dbufs_sem);
             return index;
         }
         
@@ -278,29 +672,47 @@ uint32_t dbuf_append(uint32_t index, uint16_t code, uint8_t *data, uint32_t size
     /* Check if there is room in the current buffer. */
     dbuf_t *head = &dbufs[dbufs_head];
     if (total_size > DBUF_DATA_SIZE - 8) {
-        xSemaphoreGive(dbufs_sem);
         /* Consume it to clear the error. */
         return index;
     }
-    if (head->size + total_size > DBUF_DATA_SIZE) {
-        /* Full, move to the next buffer. */
-        index++;
-        /* Reuse the head buffer if it is the only active buffer and its data
-         * has been saved. This check prevents a saved buffer being retained
-         * which would break an assumed invariant. */
+    if (head->size + total_size + dbuf_repeat_reserve() > DBUF_DATA_SIZE) {
+        int dropped = 0;
+        uint32_t dropped_index = 0;
+        /* The runs held repeat events in this buffer, so log them to it
+         * first, into the room reserved. */
+        flush_dbuf_repeats();
+        /* Full, move to the next buffer. Reuse the head buffer if it is the
+         * only active buffer and its data has been saved. This check prevents
+         * a saved buffer being retained which would break an assumed
+         * invariant. */
         if (dbufs_head != dbufs_tail || head->size != head->save_size) {
             /* Can not reuse the head buffer. */
-            dbufs_head++;
-            if (dbufs_head >= NUM_DBUFS)
-                dbufs_head = 0;
-            if (dbufs_head == dbufs_tail) {
+            uint32_t next = dbufs_head + 1;
+            if (next >= num_dbufs)
+                next = 0;
+            if (next == dbufs_tail) {
+                if (dbufs_tail == dbuf_lent) {
+                    /* The tail buffer is being written to flash, so it can not
+                     * be discarded. This only happens if the flash write is
+                     * stalled for a long time, and the event is discarded. */
+                    dbuf_events_dropped++;
+                    return index;
+                }
                 /* Wrapped, discard the tail buffer. */
+                dropped_index = dbuf_index(dbufs_tail);
+                dropped = 1;
                 dbufs_tail++;
-                if (dbufs_tail >= NUM_DBUFS)
+                if (dbufs_tail >= num_dbufs)
                     dbufs_tail = 0;
             }
+            dbufs_head = next;
             head = &dbufs[dbufs_head];
+            /* The prior head is now full and ready to save. */
+            flash_data_pending = 1;
         }
+        /* The prior head is sealed. */
+        seal_dbuf_time(index, head_first_time, last_time);
+        index++;
         initialize_dbuf(dbufs_head);
         set_dbuf_index(dbufs_head, index);
         head->size = 8;
@@ -308,7 +720,16 @@ uint32_t dbuf_append(uint32_t index, uint16_t code, uint8_t *data, uint32_t size
         last_code = 0;
         last_size = 0;
         last_time = 0;
-        xSemaphoreGive(dbufs_sem);
+        if (dropped) {
+            /* Log the loss to the new buffer, which has room. This includes
+             * the total number of buffers dropped so that the loss can be
+             * noted even if some of these events are also lost. */
+            uint32_t drop[2];
+            drop[0] = ++dbufs_dropped;
+            drop[1] = dropped_index;
+            dbuf_append_locked(index, DBUF_EVENT_DBUF_DROPPED, (void *)drop,
+                               sizeof(drop), 1, 0);
+        }
         /* Caller must reset any delta encoding state and retry. */
         return index;
     }
@@ -319,6 +740,10 @@ uint32_t dbuf_append(uint32_t index, uint16_t code, uint8_t *data, uint32_t size
     if (head->size <= 8 || head->size == head->save_size)
         head->write_time = time;
 
+    if (head->size <= 8)
+        head_first_time = time;
+    rebase_anchor(time);
+
     /* Emit the event header. */
     uint32_t i;
     for (i = 0; i < header_size; i++)
@@ -329,56 +754,185 @@ uint32_t dbuf_append(uint32_t index, uint16_t code, uint8_t *data, uint32_t size
 
     head->size += total_size;
 
+    if (RTC.COUNTER - head->write_time > DBUF_SAVE_DELAY)
+        flash_data_pending = 1;
+
     last_code = code;
     last_size = size;
     last_time = time;
 
-    xSemaphoreGive(dbufs_sem);
-
-    /* Wakeup the flash_data task. */
-    xTaskNotify(flash_data_task, 0, eNoAction);
     return index;
 }
+
+uint32_t dbuf_append(uint32_t index, uint16_t code, uint8_t *data, uint32_t size,
+                     int low_res_time, int no_repeat)
+{
+    uint32_t start = sdk_system_get_time();
+    take_dbufs_sem();
+    uint32_t new_index = dbuf_append_locked(index, code, data, size,
+                                            low_res_time, no_repeat);
+    int notify = flash_data_pending;
+    flash_data_pending = 0;
+    TaskHandle_t waiter = dbuf_wait_task;
+    give_dbufs_sem();
+    stat_time_note(&stat_dbuf_append, start, sdk_system_get_time());
+
+    /* Wakeup the flash_data task if there is something to save. */
+    if (notify)
+        xTaskNotify(flash_data_task, 0, eNoAction);
+    /* Wakeup a task waiting for new content. */
+    if (waiter)
+        xTaskNotify(waiter, 0, eNoAction);
+    return new_index;
+}
+
+/*
+ * Note a real time anchor, the real time in seconds at the current RTC counter
+ * time. Called after logging an event with the real time.
+ */
+void dbuf_note_time(uint32_t sec)
+{
+    if (sec < DBUF_TIME_MIN)
+        return;
+    take_dbufs_sem();
+    anchor_time = RTC.COUNTER;
+    anchor_sec = sec;
+    give_dbufs_sem();
+}
+
+/*
+ * Find the range of buffers with events within the real time range from to to
+ * inclusive, in seconds, using the summary of the buffers sealed since startup
+ * and the head buffer. The range runs from the first to the last buffer with a
+ * known time that matches, so buffers of unknown time between two matching
+ * buffers are included, but buffers of unknown time outside these are not,
+ * such as those sealed before the first anchor since startup. Sets the *oldest
+ * and *newest indexes covered by the summary, and the *first and *last indexes
+ * of the range found, and returns false if none were found.
+ */
+bool dbuf_time_range(uint32_t from, uint32_t to, uint32_t *oldest,
+                     uint32_t *newest, uint32_t *first, uint32_t *last)
+{
+    bool found = false;
+
+    take_dbufs_sem();
+
+    dbuf_t *head = &dbufs[dbufs_head];
+    uint32_t head_index = dbuf_index(dbufs_head);
+    uint32_t count = dbuf_times_next == head_index ? dbuf_times_count : 0;
+    *oldest = head_index - count;
+    *newest = head_index;
+
+    uint32_t i;
+    for (i = 0; i <= count; i++) {
+        uint32_t index = head_index - count + i;
+        uint32_t first_sec, last_sec;
+        if (i < count) {
+            dbuf_time_t *t = &dbuf_times[index % DBUF_TIMES];
+            first_sec = t->first_sec;
+            last_sec = t->last_sec;
+        } else if (head->size > 8) {
+            first_sec = dbuf_real_time(head_first_time);
+            last_sec = dbuf_real_time(last_time);
+        } else {
+            break;
+        }
+        if (first_sec == 0 || last_sec < from || first_sec > to)
+            continue;
+        if (!found)
+            *first = index;
+        *last = index;
+        found = true;
+    }
+
+    give_dbufs_sem();
+
+    return found;
+}
+
+/*
+ * Wait until the head buffer moves past the given index and size, that is
+ * until there is a newer head buffer or the head buffer has grown past the
+ * size, or until the timeout in msec. Returns the head buffer size and sets
+ * *head_index to its index.
+ *
+ * This supports clients waiting for new data without polling. Only one task
+ * may wait at a time, and the waiting task is notified on each append.
+ */
+uint32_t dbuf_wait(uint32_t index, uint32_t size, uint32_t timeout,
+                   uint32_t *head_index)
+{
+    TickType_t ticks = timeout / portTICK_PERIOD_MS;
+    TickType_t start = xTaskGetTickCount();
+    uint32_t current_index, current_size;
+
+    while (1) {
+        take_dbufs_sem();
+        current_index = dbuf_index(dbufs_head);
+        current_size = dbufs[dbufs_head].size;
+        int moved = current_index > index ||
+            (current_index == index && current_size > size);
+        dbuf_wait_task = moved ? NULL : xTaskGetCurrentTaskHandle();
+        give_dbufs_sem();
+
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (moved || elapsed >= ticks)
+            break;
+        xTaskNotifyWait(0, 0, NULL, ticks - elapsed);
+    }
+
+    take_dbufs_sem();
+    dbuf_wait_task = NULL;
+    give_dbufs_sem();
+
+    *head_index = current_index;
+    return current_size;
+}
     
 /*
- * Search for a buffer to write to flash. Fill the target buffer and return the
- * size currently used if there is something to send, otherwise return zero. If
- * some of the buffer has been successfully posted then the start of the
- * non-written elements is set. The full buffer is always copied, to get the
- * trailing ones, and because the flash write might fail and the entire buffer
- * might need to be re-written to the next flash sector.
+ * Search for a buffer to write to flash. Return the size currently used if
+ * there is something to send, otherwise return zero. If some of the buffer has
+ * been successfully posted then the start of the non-written elements is
+ * set. The full buffer is always returned, to get the trailing ones, and
+ * because the flash write might fail and the entire buffer might need to be
+ * re-written to the next flash sector.
  *
  * The buffers are always returned in the order of their index, so this starts
  * searching at the tail of the buffer FIFO, and if nothing else then see if the
  * current buffer could be usefully saved.
  *
- * A copy of the buffer is made to allow the dbufs_sem to be released quickly.
+ * A buffer that is no longer the head is not written to again, so it is lent
+ * to the caller and *data is set to point to the buffer itself, avoiding a
+ * copy. The head buffer is still being appended to so a copy is made into buf,
+ * to allow the dbufs_sem to be released quickly, and *data is set to buf. The
+ * buf is expected to be retained by the caller between calls, and only the
+ * content added since the last copy of the same buffer is copied.
  *
  * On success note_buffer_written() should be called to allow the buffer to be
- * freed and reused, and the index is at the head of the buffer.
+ * freed and reused, and to return a lent buffer, and the index is at the head
+ * of the buffer.
  *
  * It is assumed that the memory resident buffers are saved well before the RTC
  * time used here can wrap.
  */
 
-uint32_t get_buffer_to_write(uint8_t *buf, uint32_t *start)
+uint32_t get_buffer_to_write(uint8_t *buf, uint8_t **data, uint32_t *start)
 {
     uint32_t size = 0;
 
-    xSemaphoreTake(dbufs_sem, portMAX_DELAY);
+    take_dbufs_sem();
 
     if (dbufs_tail != dbufs_head) {
         dbuf_t *dbuf = &dbufs[dbufs_tail];
         if (dbuf->size > dbuf->save_size) {
-            uint32_t j;
             size = dbuf->size;
-            for (j = 0; j < DBUF_DATA_SIZE; j++)
-                buf[j] = dbuf->data[j];
+            dbuf_lent = dbufs_tail;
+            *data = dbuf->data;
             *start = dbuf->save_size;
-            xSemaphoreGive(dbufs_sem);
+            give_dbufs_sem();
             return size;
         }
-        xSemaphoreGive(dbufs_sem);
+        give_dbufs_sem();
         return 0;
     }
 
@@ -387,19 +941,27 @@ uint32_t get_buffer_to_write(uint8_t *buf, uint32_t *start)
     dbuf_t *head = &dbufs[dbufs_head];
     if (head->size > 8 && head->size > head->save_size) {
         uint32_t delta = RTC.COUNTER - head->write_time;
-        // Currently about 120 seconds.
-        if (delta > 20000000) {
-            uint32_t j;
+        if (delta > DBUF_SAVE_DELAY || dbufs_flush) {
+            uint32_t index = dbuf_index(dbufs_head);
+            uint32_t j = 0;
             size = head->size;
-            for (j = 0; j < DBUF_DATA_SIZE; j++)
-                buf[j] = head->data[j];
+            /* The buffer is only appended to, so if the copy is of the same
+             * buffer then only the new content is needed. */
+            if (copied_size > 0 && index == copied_index && copied_size <= size)
+                j = copied_size;
+            else
+                memcpy(buf + size, head->data + size, DBUF_DATA_SIZE - size);
+            memcpy(buf + j, head->data + j, size - j);
+            copied_index = index;
+            copied_size = size;
+            *data = buf;
             *start = head->save_size;
-            xSemaphoreGive(dbufs_sem);
+            give_dbufs_sem();
             return size;
         }
     }
 
-    xSemaphoreGive(dbufs_sem);
+    give_dbufs_sem();
     return 0;
 }
 
@@ -419,19 +981,16 @@ uint32_t get_buffer_to_write(uint8_t *buf, uint32_t *start)
  */
 void note_buffer_written(uint32_t index, uint32_t size)
 {
-    xSemaphoreTake(dbufs_sem, portMAX_DELAY);
+    take_dbufs_sem();
 
-    uint32_t i = dbufs_tail;
-    while (1) {
-        if (dbuf_index(i) == index)
-            break;
-        if (i == dbufs_head) {
-            /* Did not find the index, possibly wrapped already so give up. */
-            xSemaphoreGive(dbufs_sem);
-            return;
-        }
-        if (++i >= NUM_DBUFS)
-            i = 0;
+    /* The flash_data task is done with any lent buffer. */
+    dbuf_lent = DBUF_NONE;
+
+    uint32_t i = dbuf_find(index);
+    if (i == DBUF_NONE) {
+        /* Did not find the index, possibly wrapped already so give up. */
+        give_dbufs_sem();
+        return;
     }
 
     /* Update the save_size */
@@ -448,43 +1007,160 @@ void note_buffer_written(uint32_t index, uint32_t size)
         dbuf_t *dbuf = &dbufs[dbufs_tail];
         if (dbuf->save_size == dbuf->size) {
             dbufs_tail++;
-            if (dbufs_tail >= NUM_DBUFS)
+            if (dbufs_tail >= num_dbufs)
                 dbufs_tail = 0;
         } else {
             break;
         }
     }
 
-    xSemaphoreGive(dbufs_sem);
+    give_dbufs_sem();
     blink_blue();
 }
 
+/*
+ * Save all the buffers to flash, waiting up to timeout msec. On success the
+ * state needed to resume appending to the head buffer after a restart is
+ * returned in the resume state, and true is returned. Events appended after
+ * the return are not included in this state, so this is only called just
+ * before a deep sleep.
+ */
+bool dbuf_flush(uint32_t timeout, dbuf_resume_t *resume)
+{
+    TickType_t start = xTaskGetTickCount();
+    TickType_t ticks = timeout / portTICK_PERIOD_MS;
+    bool saved = false;
+
+    while (1) {
+        take_dbufs_sem();
+        dbuf_t *head = &dbufs[dbufs_head];
+        if (dbufs_tail == dbufs_head && head->size == head->save_size) {
+            resume->index = dbuf_index(dbufs_head);
+            resume->size = head->size;
+            resume->last_code = last_code;
+            resume->last_size = last_size;
+            resume->last_time = last_time;
+            resume->first_time = head_first_time;
+            resume->anchor_time = anchor_time;
+            resume->anchor_sec = anchor_sec;
+            saved = true;
+        }
+        dbufs_flush = !saved;
+        give_dbufs_sem();
+
+        if (saved || xTaskGetTickCount() - start >= ticks)
+            break;
+        xTaskNotify(flash_data_task, 0, eNoAction);
+        vTaskDelay(100 / portTICK_PERIOD_MS);
+    }
+
+    take_dbufs_sem();
+    dbufs_flush = 0;
+    give_dbufs_sem();
+
+    return saved;
+}
+
 
 
+/*
+ * Allocate the ring of buffers, param_dbufs buffers if there is room within the
+ * heap budget, otherwise fewer but at least MIN_DBUFS. Returns false if even
+ * MIN_DBUFS can not be allocated.
+ */
+static bool init_dbufs()
+{
+    uint32_t num = param_dbufs;
+    if (num < MIN_DBUFS)
+        num = MIN_DBUFS;
+    if (num > MAX_DBUFS)
+        num = MAX_DBUFS;
+
+    size_t free_heap = xPortGetFreeHeapSize();
+    size_t budget = free_heap > DBUF_HEAP_RESERVE ? free_heap - DBUF_HEAP_RESERVE : 0;
+    if (num * sizeof(dbuf_t) > budget)
+        num = budget / sizeof(dbuf_t);
+    if (num < MIN_DBUFS)
+        num = MIN_DBUFS;
+
+    while (1) {
+        dbufs = malloc(num * sizeof(dbuf_t));
+        if (dbufs)
+            break;
+        if (num <= MIN_DBUFS)
+            return false;
+        num--;
+    }
+
+    num_dbufs = num;
+    return true;
+}
+
 void user_init(void)
 {
     uart_set_baud(0, 9600);
     init_params();
 
+    dbuf_resume_t resume;
+    bool resuming = init_sleep_wake(&resume);
+
     init_i2c();
 
+    /* Start the network before allocating the buffers, so that the buffers
+     * use what is left of the heap. In the low-power mode the network is only
+     * started on some wakes. */
+    if (sleep_wifi_wanted()) {
+        init_web();
+        init_post();
+    } else {
+        sdk_wifi_set_opmode_current(NULL_MODE);
+    }
+
+    /* The network tasks use the buffers, so without them restart rather than
+     * continue. This is silent as UART0 is the PMS serial line. */
+    if (!init_dbufs()) {
+        sdk_system_restart();
+        return;
+    }
+
     dbufs_head = 0;
     dbufs_tail = 0;
-    initialize_dbuf(dbufs_head);
+    uint32_t recovery_start = RTC.COUNTER;
     uint32_t last_index = init_flash();
-    set_dbuf_index(dbufs_head, last_index);
-    dbufs[dbufs_head].size = 8;
+    uint32_t recovery_time = RTC.COUNTER - recovery_start;
 
-    last_code = 0;
-    last_size = 0;
-    last_time = 0;
+    /* After a deep sleep, resume appending to the head buffer saved before
+     * the sleep, rather than starting a new buffer on each wake. */
+    if (resuming &&
+        flash_resume(resume.index, dbufs[dbufs_head].data, resume.size)) {
+        last_index = resume.index;
+        dbufs[dbufs_head].size = resume.size;
+        dbufs[dbufs_head].save_size = resume.size;
+        dbufs[dbufs_head].write_time = RTC.COUNTER;
+        last_code = resume.last_code;
+        last_size = resume.last_size;
+        last_time = resume.last_time;
+        head_first_time = resume.first_time;
+        anchor_time = resume.anchor_time;
+        anchor_sec = resume.anchor_sec;
+    } else {
+        initialize_dbuf(dbufs_head);
+        set_dbuf_index(dbufs_head, last_index);
+        dbufs[dbufs_head].size = 8;
+        last_code = 0;
+        last_size = 0;
+        last_time = 0;
+    }
 
     dbufs_sem = xSemaphoreCreateMutex();
 
     xTaskCreate(&flash_data, "OAQ Flash", 196, NULL, 2, &flash_data_task);
 
-    /* Log a startup event. */
-    uint32_t startup[8 + 1];
+    /* Log a startup event. This is logged before any other event after the
+     * restart, so it marks the reset of the delta encoding state of the
+     * other event classes, which start from zero, if resuming partway through
+     * a buffer. */
+    uint32_t startup[8 + 1 + 1];
     /* Include the SDK reset info. */
     struct sdk_rst_info* reset_info = sdk_system_get_rst_info();
     memcpy(startup, reset_info, sizeof(struct sdk_rst_info));
@@ -494,6 +1170,10 @@ void user_init(void)
     for (int i = 0; i < 32; i++)
         startup[8] += sdk_system_rtc_clock_cali_proc();
     startup[8] >>= 5;
+    rtc_cali = startup[8];
+    /* Include the time taken to recover the flash state, in RTC counter
+     * units. */
+    startup[9] = recovery_time;
     while (1) {
         uint32_t new_index = dbuf_append(last_index, DBUF_EVENT_ESP8266_STARTUP,
                                          (void *)startup, sizeof(startup), 1, 0);
@@ -502,9 +1182,6 @@ void user_init(void)
         last_index = new_index;
     }
 
-    init_web();
-    init_post();
-
     init_blink();
     blink_red();
     blink_blue();
@@ -515,4 +1192,7 @@ void user_init(void)
     init_bmp180();
     init_bme280();
     init_ds3231();
+    start_i2c_sensors();
+    init_stats();
+    init_sleep();
 }
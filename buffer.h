@@ -19,11 +19,42 @@
  *
  */
 
-uint32_t get_buffer_to_write(uint8_t *buf, uint32_t *start);
+uint32_t get_buffer_to_write(uint8_t *buf, uint8_t **data, uint32_t *start);
 void note_buffer_written(uint32_t index, uint32_t size);
 uint32_t dbuf_head_index();
+uint32_t dbuf_size(uint32_t index);
+int32_t dbuf_copy_range(uint32_t index, uint32_t start, uint32_t end,
+                        uint8_t *buf);
+uint32_t dbuf_wait(uint32_t index, uint32_t size, uint32_t timeout,
+                   uint32_t *head_index);
+void dbuf_note_time(uint32_t sec);
+bool dbuf_time_range(uint32_t from, uint32_t to, uint32_t *oldest,
+                     uint32_t *newest, uint32_t *first, uint32_t *last);
+extern uint32_t dbufs_dropped;
+extern uint32_t dbuf_events_dropped;
+
+/*
+ * The head buffer state saved across a deep sleep, see dbuf_flush(). The RTC
+ * counter runs during the sleep so the real time anchor remains valid.
+ */
+typedef struct {
+    uint32_t index;
+    uint32_t size;
+    int32_t last_code;
+    int32_t last_size;
+    uint32_t last_time;
+    uint32_t first_time;
+    uint32_t anchor_time;
+    uint32_t anchor_sec;
+} dbuf_resume_t;
+
+bool dbuf_flush(uint32_t timeout, dbuf_resume_t *resume);
+
 uint32_t dbuf_append(uint32_t index, uint16_t code, uint8_t *data, uint32_t size,
                      int low_res_time, int no_repeat);
+uint32_t dbuf_hold_repeat(uint32_t index, uint16_t code, uint8_t prior,
+                          uint8_t checksum);
+void dbuf_flush_repeat(uint16_t code);
 
 uint32_t emit_leb128(uint8_t *buf, uint32_t start, uint64_t v);
 uint32_t emit_leb128_signed(uint8_t *buf, uint32_t start, int64_t v);
@@ -35,8 +66,18 @@ uint32_t emit_leb128_signed(uint8_t *buf, uint32_t start, int64_t v);
 /* Plantower PMS1003 PMS5003 PMS7003 */
 #define DBUF_EVENT_PMS5003 2
 
+/* The server time in a post response: the RTC time posted, the server seconds
+ * and usec, and the RTC time the post was sent. The time posted is that signed
+ * when the request was prepared, which can be a round trip before it was sent
+ * when posting a batch. Earlier firmware omitted the time sent, and the event
+ * was 12 bytes. See read_post_response() in post.c. */
 #define DBUF_EVENT_POST_TIME 3
 
+/* Logged first on each restart, including a wake from a deep sleep which
+ * resumes appending to the head buffer saved before the sleep. This is a reset
+ * point: the delta encoding and repeat state of every other event class starts
+ * again from zero after it, as at the start of a buffer. The event header
+ * time-stamp delta encoding is not reset, and continues within the buffer. */
 #define DBUF_EVENT_ESP8266_STARTUP 4
 
 #define DBUF_EVENT_SHT2X_TEMP_HUM 5
@@ -50,3 +91,33 @@ uint32_t emit_leb128_signed(uint8_t *buf, uint32_t start, int64_t v);
 #define DBUF_EVENT_BME280_TEMP_PRESSURE_RH 10
 
 #define DBUF_EVENT_CLIENT_UTIME 11
+
+/* A tail buffer was discarded before being saved. The total number discarded
+ * since startup and the index of the discarded buffer, as two 32 bit words. */
+#define DBUF_EVENT_DBUF_DROPPED 12
+
+/* The second Plantower sensor when switching between two sensors, with the
+ * same encoding as the PMS3003 and PMS5003 events above. */
+#define DBUF_EVENT_PMS3003_2 13
+#define DBUF_EVENT_PMS5003_2 14
+
+/* The Plantower sensor events using the adaptive Golomb-Rice encoding, see
+ * emit_rice() in pms.c, for the first and second sensor. */
+#define DBUF_EVENT_PMS3003_RICE 15
+#define DBUF_EVENT_PMS5003_RICE 16
+#define DBUF_EVENT_PMS3003_RICE_2 17
+#define DBUF_EVENT_PMS5003_RICE_2 18
+
+/* A run of Plantower sensor frames with the same values as the prior event for
+ * the first, or second, sensor. See dbuf_hold_repeat() in buffer.c. */
+#define DBUF_EVENT_PMS_REPEAT 19
+#define DBUF_EVENT_PMS_REPEAT_2 20
+
+/* Periodic self-telemetry, delta encoded signed leb128 counters. See
+ * stats_task() in stats.c. */
+#define DBUF_EVENT_TELEMETRY 21
+
+/* The minimum, mean, and maximum of the Plantower sensor values over a window,
+ * for the first, or second, sensor. See pms_flush_aggregate() in pms.c. */
+#define DBUF_EVENT_PMS_AGGREGATE 22
+#define DBUF_EVENT_PMS_AGGREGATE_2 23
@@ -33,14 +33,28 @@
  */
 uint8_t param_board;
 uint8_t param_pms_uart;
+uint8_t param_pms_coding;
+uint32_t param_pms_period;
 uint8_t param_i2c_scl;
 uint8_t param_i2c_sda;
+uint32_t param_sht2x_period;
+uint32_t param_bmp180_period;
+uint32_t param_bme280_period;
+uint32_t param_ds3231_period;
+uint8_t param_dbufs;
 char *param_web_server;
+char *param_web_ip;
 char param_web_port[7];
 char *param_web_path;
 uint32_t param_sensor_id;
 uint32_t param_key_size;
 uint8_t *param_sha3_key;
+uint8_t param_live_period;
+uint8_t param_telemetry_period;
+uint32_t param_sleep_period;
+uint32_t param_sleep_burst;
+uint8_t param_sleep_backlog;
+uint8_t param_pms_set_pin;
 
 void init_params()
 {
@@ -48,26 +62,54 @@ void init_params()
 
     param_board = 0;
     param_pms_uart = 1;
+    param_pms_coding = 0;
+    param_pms_period = 0;
     param_i2c_scl = 0;
     param_i2c_sda = 2;
+    param_sht2x_period = 10;
+    param_bmp180_period = 10;
+    param_bme280_period = 10;
+    param_ds3231_period = 180;
+    param_dbufs = 2;
     param_web_server = NULL;
+    param_web_ip = NULL;
     bzero(param_web_port, sizeof(param_web_port));
     param_web_path = NULL;
     param_sensor_id = 0;
     param_key_size = 0;
     param_sha3_key = NULL;
+    param_live_period = 0;
+    param_telemetry_period = 10;
+    param_sleep_period = 0;
+    param_sleep_burst = 60;
+    param_sleep_backlog = 4;
+    param_pms_set_pin = 0xff;
 
     sysparam_get_int8("oaq_board", (int8_t *)&param_board);
     sysparam_get_int8("oaq_pms_uart", (int8_t *)&param_pms_uart);
+    sysparam_get_int8("oaq_pms_coding", (int8_t *)&param_pms_coding);
+    sysparam_get_int32("oaq_pms_period", (int32_t *)&param_pms_period);
     sysparam_get_int8("oaq_i2c_scl", (int8_t *)&param_i2c_scl);
     sysparam_get_int8("oaq_i2c_sda", (int8_t *)&param_i2c_sda);
+    sysparam_get_int32("oaq_sht2x_period", (int32_t *)&param_sht2x_period);
+    sysparam_get_int32("oaq_bmp180_period", (int32_t *)&param_bmp180_period);
+    sysparam_get_int32("oaq_bme280_period", (int32_t *)&param_bme280_period);
+    sysparam_get_int32("oaq_ds3231_period", (int32_t *)&param_ds3231_period);
+    sysparam_get_int8("oaq_dbufs", (int8_t *)&param_dbufs);
+    sysparam_get_int8("oaq_pms_set_pin", (int8_t *)&param_pms_set_pin);
+    sysparam_get_int32("oaq_sleep_period", (int32_t *)&param_sleep_period);
+    sysparam_get_int32("oaq_sleep_burst", (int32_t *)&param_sleep_burst);
+    sysparam_get_int8("oaq_sleep_backlog", (int8_t *)&param_sleep_backlog);
 
     sysparam_get_string("oaq_web_server", &param_web_server);
+    sysparam_get_string("oaq_web_ip", &param_web_ip);
     int32_t port = 80;
     sysparam_get_int32("oaq_web_port", &port);
     snprintf(param_web_port, sizeof(param_web_port), "%u", port);
     sysparam_get_string("oaq_web_path", &param_web_path);
 
+    sysparam_get_int8("oaq_live_period", (int8_t *)&param_live_period);
+    sysparam_get_int8("oaq_telemetry_period", (int8_t *)&param_telemetry_period);
     sysparam_get_int32("oaq_sensor_id", (int32_t *)&param_sensor_id);
     status = sysparam_get_data("oaq_sha3_key", &param_sha3_key, &param_key_size, NULL);
     if (status != SYSPARAM_OK) {
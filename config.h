@@ -33,10 +33,25 @@ extern uint8_t param_board;
  *  0 - None, disabled (default).
  *  1 - UART0 on GPIO3 aka RX (Nodemcu pin D9).
  *  2 - UART0 swapped pins mode, GPIO13 (Nodemcu pin D7).
- *  3 - TODO Flipping between the above for two sensors?
+ *  3 - Two sensors, switching UART0 between the above pins on frame
+ *      boundaries. The second sensor, on GPIO13, is logged with separate
+ *      event codes.
  */
 extern uint8_t param_pms_uart;
 
+/*
+ * PMS event encoding.
+ *  0 - The fixed variable length code, the default.
+ *  1 - Adaptive Golomb-Rice code, logged with separate event codes.
+ */
+extern uint8_t param_pms_coding;
+
+/*
+ * The PMS aggregation window in seconds, or zero (default) to log every frame.
+ * See pms.c.
+ */
+extern uint32_t param_pms_period;
+
 /*
  * I2C bus pin definitions, GPIO numbers.
  *
@@ -46,17 +61,68 @@ extern uint8_t param_pms_uart;
 extern uint8_t param_i2c_scl;
 extern uint8_t param_i2c_sda;
 
+/*
+ * The I2C sensor sampling periods in seconds, or zero to disable the sensor.
+ * These default to 10 seconds, and 180 seconds for the DS3231.
+ */
+extern uint32_t param_sht2x_period;
+extern uint32_t param_bmp180_period;
+extern uint32_t param_bme280_period;
+extern uint32_t param_ds3231_period;
+
+/*
+ * The number of 4096 byte memory resident buffers, at least 2 (default) and up
+ * to 32. More buffers allow more data to be held while the flash storage is
+ * unavailable. The number is reduced if there is not sufficient free heap.
+ */
+extern uint8_t param_dbufs;
+
 /*
  * Network parameters. If not sufficiently initialized to communicate with a
  * server then wifi is disabled and the post-data task is not created.
  */
 
 extern char *param_web_server;
+/* An optional server IP address, in dotted decimal, used instead of resolving
+ * the server name. The server name is still sent in the HTTP Host header. */
+extern char *param_web_ip;
 extern char param_web_port[];
 extern char *param_web_path;
 extern uint32_t param_sensor_id;
 extern uint32_t param_key_size;
 extern uint8_t *param_sha3_key;
+/* The period in seconds to post the content held in memory and not yet saved
+ * to flash, so the server sees new data sooner, or zero (default) to post only
+ * the content saved to flash. */
+extern uint8_t param_live_period;
+
+/*
+ * The period in minutes to log the self-telemetry event, see stats.c, default
+ * 10, or zero to disable.
+ */
+extern uint8_t param_telemetry_period;
+
+/*
+ * Duty-cycled low-power mode, see sleep.c. The node deep sleeps for
+ * param_sleep_period seconds, or zero (default) to stay awake, between bursts
+ * of param_sleep_burst seconds of sampling, default 60. The Wifi is only
+ * brought up on a wake when at least param_sleep_backlog buffers, default 4,
+ * are waiting to be posted. GPIO16 must be connected to the reset pin to wake.
+ * When the PMS SET pin is connected the PMS frames are not logged for the first
+ * 30 seconds of each burst while the sensor settles after waking, see pms.c, so
+ * the burst needs to be longer than this for PMS samples.
+ */
+extern uint32_t param_sleep_period;
+extern uint32_t param_sleep_burst;
+extern uint8_t param_sleep_backlog;
+
+/*
+ * The GPIO connected to the PMS*003 SET pin, which puts the sensor to sleep
+ * when low, or 0xff (default) if not connected. It is driven low while the
+ * node deep sleeps in the low-power mode, which needs a pull-down resistor to
+ * hold it low.
+ */
+extern uint8_t param_pms_set_pin;
 
 void init_params();
 
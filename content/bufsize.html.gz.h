@@ -0,0 +1,43 @@
+0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0x6d, 0x53,
+0xdd, 0x4f, 0xdb, 0x30, 0x10, 0xff, 0x57, 0x3c, 0x4f, 0x9a, 0x40, 0xa2,
+0x4d, 0x41, 0x8c, 0xaa, 0x34, 0xf6, 0xc3, 0xd8, 0xd0, 0xf6, 0xb4, 0x09,
+0x90, 0xa6, 0x3d, 0x4d, 0x8e, 0x7d, 0x49, 0x0e, 0x1c, 0x3b, 0xc4, 0x4e,
+0xda, 0xf2, 0xd7, 0xef, 0x9c, 0xb4, 0x50, 0xa4, 0xbd, 0xc4, 0xba, 0x8f,
+0xdf, 0x87, 0xcf, 0x97, 0xfc, 0xc3, 0xd7, 0x9f, 0x37, 0x0f, 0x7f, 0x7e,
+0x7d, 0x63, 0x75, 0x6c, 0xac, 0xcc, 0xd3, 0x97, 0x59, 0xe5, 0x2a, 0xc1,
+0xc1, 0x71, 0x8a, 0x41, 0x19, 0x99, 0x5b, 0x74, 0x4f, 0xac, 0x03, 0x2b,
+0x78, 0x88, 0x3b, 0x0b, 0xa1, 0x06, 0x88, 0x9c, 0xc5, 0x5d, 0x0b, 0x82,
+0x47, 0xd8, 0xc6, 0x4c, 0x87, 0xc0, 0x59, 0xdd, 0x41, 0x29, 0x78, 0x36,
+0xb6, 0xcc, 0x53, 0x46, 0xe6, 0x41, 0x77, 0xd8, 0x46, 0x16, 0x3a, 0x9d,
+0x0a, 0x63, 0x30, 0x7f, 0x4c, 0x85, 0x7d, 0x20, 0xf3, 0x06, 0xa2, 0x62,
+0x4e, 0x35, 0xc4, 0x34, 0x20, 0x6c, 0x5a, 0xdf, 0x11, 0xb3, 0xf6, 0x2e,
+0x82, 0x8b, 0x82, 0x6f, 0xd0, 0xc4, 0x5a, 0x18, 0x18, 0x50, 0xc3, 0x6c,
+0x0c, 0xce, 0x18, 0x3a, 0x8c, 0xa8, 0xec, 0x2c, 0x68, 0x65, 0x41, 0x9c,
+0xcf, 0x17, 0x89, 0x6e, 0xf2, 0x59, 0x78, 0xb3, 0x93, 0x79, 0x6f, 0x99,
+0xb6, 0x2a, 0x04, 0xf2, 0xe6, 0x5b, 0xa7, 0x06, 0xce, 0xd0, 0x08, 0xde,
+0xec, 0x1e, 0xa6, 0x28, 0x5d, 0x47, 0xe6, 0xea, 0x60, 0x97, 0xcb, 0xef,
+0xbe, 0x81, 0x3c, 0x53, 0xc4, 0x92, 0x0a, 0x16, 0x0f, 0x68, 0xa5, 0x23,
+0x0e, 0xc0, 0x8f, 0x7a, 0xc9, 0x57, 0x89, 0xd5, 0x3c, 0x0d, 0x89, 0xcb,
+0x7b, 0x70, 0xc1, 0x77, 0xec, 0x66, 0xcc, 0x1d, 0xe3, 0x8f, 0x00, 0x1b,
+0x2c, 0x51, 0x97, 0x15, 0x89, 0xfc, 0xc6, 0x5b, 0xfc, 0x4f, 0xef, 0x41,
+0x0b, 0x89, 0xfa, 0x48, 0xe9, 0x51, 0x0d, 0x6a, 0x9a, 0xd0, 0xf5, 0xe0,
+0xd1, 0x9c, 0x2c, 0x4e, 0xd7, 0x9c, 0x79, 0xa7, 0x2d, 0xea, 0xa7, 0x74,
+0x95, 0xdb, 0xde, 0x91, 0x39, 0xef, 0x4e, 0x4e, 0xb9, 0xfc, 0xf4, 0x71,
+0xb5, 0x5c, 0x5e, 0xad, 0xdf, 0x58, 0xb3, 0x9e, 0x1e, 0xb2, 0xf4, 0x5d,
+0xc3, 0xd4, 0xd8, 0x44, 0x3e, 0x8a, 0xbe, 0x0c, 0xf8, 0x02, 0x93, 0x73,
+0x46, 0x33, 0xaf, 0x3d, 0x8d, 0xa4, 0xf5, 0x21, 0x92, 0x68, 0x89, 0x60,
+0x4d, 0x00, 0x7a, 0x0c, 0x0b, 0x15, 0x38, 0x23, 0xbf, 0xf4, 0x65, 0x09,
+0x1d, 0x4b, 0x08, 0x7a, 0xf5, 0xe7, 0x1e, 0x42, 0x24, 0xe6, 0xa9, 0x96,
+0x9b, 0xd7, 0xe9, 0x1a, 0x5b, 0x13, 0xda, 0x24, 0x9c, 0x2a, 0xc0, 0x32,
+0x92, 0xa4, 0x8b, 0x38, 0x03, 0x5b, 0x2e, 0xef, 0x26, 0x18, 0x18, 0xf6,
+0x23, 0x25, 0x08, 0x9e, 0x5a, 0xc8, 0x5b, 0x6a, 0x37, 0x44, 0x83, 0xae,
+0xed, 0xe3, 0xf8, 0x30, 0x13, 0x62, 0xbf, 0x4d, 0xae, 0x6f, 0x0a, 0xe8,
+0xc8, 0x22, 0x92, 0xed, 0x05, 0x9d, 0x6a, 0x2b, 0xf8, 0xe5, 0xc5, 0xea,
+0x72, 0x75, 0xb5, 0xbc, 0x58, 0x7d, 0xe6, 0x8c, 0x38, 0x5b, 0xc1, 0xcf,
+0xf9, 0x7e, 0x67, 0xbc, 0x7a, 0xfe, 0xbb, 0x27, 0x18, 0x94, 0xed, 0x29,
+0x93, 0xb6, 0x21, 0x09, 0x64, 0x26, 0xc9, 0xbd, 0xdd, 0xad, 0x65, 0xe3,
+0x62, 0x4e, 0x0b, 0x3b, 0x53, 0x16, 0x2b, 0x77, 0xad, 0x69, 0xc9, 0x48,
+0xed, 0xe0, 0x66, 0xb2, 0xd0, 0x01, 0xf5, 0xd3, 0x58, 0x5d, 0x11, 0xda,
+0xf5, 0xbb, 0x4a, 0xe8, 0x8b, 0x06, 0xe3, 0xab, 0xd2, 0xbd, 0x1a, 0xb7,
+0x23, 0x6b, 0xdf, 0xe9, 0x64, 0x69, 0xf2, 0x74, 0x4c, 0xbb, 0x98, 0x8d,
+0xbf, 0xd5, 0x3f, 0xc2, 0x5a, 0x24, 0x4d, 0x66, 0x03, 0x00, 0x00,
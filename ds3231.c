@@ -39,6 +39,7 @@
 
 #include "buffer.h"
 #include "i2c.h"
+#include "config.h"
 #include "leds.h"
 
 
@@ -111,85 +112,80 @@ bool ds3231_time_temp(struct tm *time, float *temp)
     return true;
 }
 
-static void ds3231_read_task(void *pvParameters)
-{
-    /* Delta encoding state. */
-    uint32_t last_index = 0;
-    time_t last_clock_time = 0;
-    int16_t last_temperature = 0;
-
-    xSemaphoreTake(i2c_sem, portMAX_DELAY);
+/* Delta encoding state. */
+static uint32_t last_index = 0;
+static time_t last_clock_time = 0;
+static int16_t last_temperature = 0;
 
+static bool ds3231_init()
+{
     bzero(&ds3231_time, sizeof(ds3231_time));
 
     struct tm time;
-    bool available = ds3231_getTime(&time);
-
-    xSemaphoreGive(i2c_sem);
-    
-    if (!available)
-        vTaskDelete(NULL);
-
-    for (;;) {
-        vTaskDelay(180000 / portTICK_PERIOD_MS);
-
-        xSemaphoreTake(i2c_sem, portMAX_DELAY);
-
-        if (!ds3231_getTime(&time)) {
-            xSemaphoreGive(i2c_sem);
-            blink_red();
-            continue;
-        }
+    return ds3231_getTime(&time);
+}
 
-        time_t clock_time = mktime(&time);
-        int16_t temperature;
-        if (!ds3231_getRawTemp(&temperature)) {
-            xSemaphoreGive(i2c_sem);
-            blink_red();
-            continue;
-        }
+static int32_t ds3231_sample(bool start)
+{
+    struct tm time;
+    if (!ds3231_getTime(&time))
+        return -1;
 
-        ds3231_available = true;
-        ds3231_time = time;
-        ds3231_temperature = temperature;
-
-        xSemaphoreGive(i2c_sem);
-
-        while (1) {
-            uint8_t outbuf[12];
-            /* Delta encoding */
-            uint32_t time_delta = clock_time - last_clock_time;
-            uint32_t len = emit_leb128(outbuf, 0, time_delta);
-            int32_t temp_delta = (int32_t)temperature - (int32_t)last_temperature;
-            len = emit_leb128_signed(outbuf, len, temp_delta);
-            int32_t code = DBUF_EVENT_DS3231_TIME_TEMP;
-            uint32_t new_index = dbuf_append(last_index, code, outbuf, len, 1, 0);
-            if (new_index == last_index)
-                break;
-
-            /* Moved on to a new buffer. Reset the delta encoding
-             * state and retry. */
-            last_index = new_index;
-            last_clock_time = 0;
-            last_temperature = 0;
-        };
-
-        blink_green();
+    int16_t temperature;
+    if (!ds3231_getRawTemp(&temperature))
+        return -1;
 
-        /*
-         * Commit the values logged. Note this is the only task
-         * accessing this state so these updates are synchronized
-         * with the last event of this class append.
-         */
-        last_clock_time = clock_time;
-        last_temperature = temperature;
-    }
+    ds3231_available = true;
+    ds3231_time = time;
+    ds3231_temperature = temperature;
+    return 0;
 }
 
+static void ds3231_log()
+{
+    struct tm time = ds3231_time;
+    time_t clock_time = mktime(&time);
+    int16_t temperature = ds3231_temperature;
+
+    while (1) {
+        uint8_t outbuf[12];
+        /* Delta encoding */
+        uint32_t time_delta = clock_time - last_clock_time;
+        uint32_t len = emit_leb128(outbuf, 0, time_delta);
+        int32_t temp_delta = (int32_t)temperature - (int32_t)last_temperature;
+        len = emit_leb128_signed(outbuf, len, temp_delta);
+        int32_t code = DBUF_EVENT_DS3231_TIME_TEMP;
+        uint32_t new_index = dbuf_append(last_index, code, outbuf, len, 1, 0);
+        if (new_index == last_index)
+            break;
+
+        /* Moved on to a new buffer. Reset the delta encoding
+         * state and retry. */
+        last_index = new_index;
+        last_clock_time = 0;
+        last_temperature = 0;
+    };
+    dbuf_note_time(clock_time);
+
+    /*
+     * Commit the values logged. Note this is the only task
+     * accessing this state so these updates are synchronized
+     * with the last event of this class append.
+     */
+    last_clock_time = clock_time;
+    last_temperature = temperature;
+}
 
-
+static i2c_sensor_t ds3231_sensor = {
+    .init = ds3231_init,
+    .sample = ds3231_sample,
+    .log = ds3231_log,
+};
 
 void init_ds3231()
 {
-    xTaskCreate(&ds3231_read_task, "DS3231 reader", 240, NULL, 2, NULL);
+    if (param_ds3231_period) {
+        ds3231_sensor.period = param_ds3231_period * 1000;
+        add_i2c_sensor(&ds3231_sensor);
+    }
 }
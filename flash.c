@@ -61,6 +61,9 @@
 #include "buffer.h"
 #include "leds.h"
 #include "post.h"
+#include "flash.h"
+#include "config.h"
+#include "stats.h"
 
 /*
  * For a 32Mbit flash, or 4MB, there are 1024 flash sectors. The first 256 are
@@ -93,6 +96,20 @@ static uint32_t decode_flash_sector_index(uint16_t sector, uint32_t *index)
     return 1;
 }
 
+static inline uint16_t prev_sector(uint16_t sector)
+{
+    if (sector <= BUFFER_FLASH_FIRST_SECTOR)
+        return BUFFER_FLASH_FIRST_SECTOR + BUFFER_FLASH_NUM_SECTORS - 1;
+    return sector - 1;
+}
+
+static inline uint16_t next_sector(uint16_t sector)
+{
+    if (sector >= BUFFER_FLASH_FIRST_SECTOR + BUFFER_FLASH_NUM_SECTORS - 1)
+        return BUFFER_FLASH_FIRST_SECTOR;
+    return sector + 1;
+}
+
 /*
  * Find the sector with the largest valid index, returning 1 on success or 0 on
  * failure, and filling the sector and index on success.
@@ -139,77 +156,570 @@ static int find_most_recent_sector(uint16_t *most_recent_sector,
     return 1;
 }
 
+/*
+ * A failed write is retried at the next sector with the same index, up to 32
+ * times, so bad sectors and duplicate indexes are expected to be found within
+ * this many sectors of each other.
+ */
+#define FLASH_RECOVERY_WINDOW 34
+
+/*
+ * Search for the first sector with a valid index at or after the ring position
+ * pos, being relative to BUFFER_FLASH_FIRST_SECTOR, and before the position
+ * end and within the recovery window. Returns the position, or end if none
+ * found.
+ */
+static uint32_t probe_valid_position(uint32_t pos, uint32_t end, uint32_t *index)
+{
+    uint32_t limit = pos + FLASH_RECOVERY_WINDOW;
+    if (limit > end)
+        limit = end;
+    for (; pos < limit; pos++) {
+        if (decode_flash_sector_index(BUFFER_FLASH_FIRST_SECTOR + pos, index))
+            return pos;
+    }
+    return end;
+}
+
+/*
+ * Find the sector with the largest valid index using a binary search, as for
+ * finding the rotation of a rotated sorted array. The indexes increase from the
+ * first sector to the most recent sector, and then either wrap to the oldest
+ * indexes or there are erased sectors. So the first sector's index is the
+ * smallest index up to the most recent sector and larger than any index after
+ * it. Sectors without a valid index are skipped when probing.
+ *
+ * This reads a few dozen sector indexes rather than all of them, and is
+ * followed by local checks around the sector found. Returns 1 on success, or 0
+ * if no valid sector was found or the ring does not look consistent and the
+ * caller must fall back to the full linear search.
+ */
+static int search_most_recent_sector(uint16_t *most_recent_sector,
+                                     uint32_t *largest_index)
+{
+    uint32_t first_index;
+    uint32_t lo = probe_valid_position(0, BUFFER_FLASH_NUM_SECTORS, &first_index);
+    if (lo >= BUFFER_FLASH_NUM_SECTORS)
+        return 0;
+
+    /* Invariant: the position lo has a valid index >= first_index, and the
+     * positions from hi do not. */
+    uint32_t lo_index = first_index;
+    uint32_t hi = BUFFER_FLASH_NUM_SECTORS;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        uint32_t index;
+        uint32_t pos = probe_valid_position(mid, hi, &index);
+        if (pos < hi && index >= first_index) {
+            lo = pos;
+            lo_index = index;
+        } else {
+            hi = mid;
+        }
+    }
+
+    uint16_t sector = BUFFER_FLASH_FIRST_SECTOR + lo;
+
+    /* Check the sector before, which should have a smaller or equal index. */
+    uint16_t s = sector;
+    int32_t i;
+    for (i = 0; i < FLASH_RECOVERY_WINDOW; i++) {
+        s = prev_sector(s);
+        uint32_t index;
+        if (decode_flash_sector_index(s, &index)) {
+            if (index > lo_index)
+                return 0;
+            break;
+        }
+    }
+
+    /* Scan forward for the sectors following a failed write, which might have
+     * the same index, and use the most recent. A larger index means the search
+     * went wrong, perhaps misled by a bad sector that could not be erased. */
+    s = sector;
+    for (i = 0; i < FLASH_RECOVERY_WINDOW; i++) {
+        s++;
+        if (s >= BUFFER_FLASH_FIRST_SECTOR + BUFFER_FLASH_NUM_SECTORS)
+            s = BUFFER_FLASH_FIRST_SECTOR;
+        uint32_t index;
+        if (decode_flash_sector_index(s, &index)) {
+            if (index > lo_index)
+                return 0;
+            if (index == lo_index)
+                sector = s;
+        }
+    }
+
+    *most_recent_sector = sector;
+    *largest_index = lo_index;
+    return 1;
+}
+
 /* The head of the flash sector ring buffer. */
 static uint16_t flash_sector;
 /* Flag to support lazy initialization of the current sector. */
 static uint8_t flash_sector_initialized;
 
+/*
+ * Memory resident index of the flash sectors, to map a sector index to a
+ * sector without searching the flash.
+ *
+ * The usable sectors are the run of sectors with consecutive indexes ending at
+ * the most recent sector, the same run that get_buffer_to_post() always
+ * assumed. A bit is set in flash_sector_valid for each sector holding an index
+ * in this run. Bad sectors, erased sectors, and the older copy of a duplicated
+ * index have their bit clear. The index of a sector is then the most recent
+ * index less the number of valid sectors back to that sector, which can be
+ * counted from the bitmap a word at a time without reading the flash.
+ *
+ * Must be accessed holding the flash_state_sem, except at initialization.
+ */
+static uint32_t flash_sector_valid[(BUFFER_FLASH_NUM_SECTORS + 31) / 32];
+/* The number of set bits in flash_sector_valid. */
+static uint32_t num_valid_sectors;
+/* The most recent valid sector and its index, when num_valid_sectors > 0. */
+static uint16_t newest_valid_sector;
+static uint32_t newest_valid_index;
+
+static inline uint32_t sector_valid_p(uint16_t sector)
+{
+    uint32_t bit = sector - BUFFER_FLASH_FIRST_SECTOR;
+    return flash_sector_valid[bit >> 5] & (1U << (bit & 0x1f));
+}
+
+static inline void set_sector_valid(uint16_t sector, uint32_t valid)
+{
+    uint32_t bit = sector - BUFFER_FLASH_FIRST_SECTOR;
+    if (valid)
+        flash_sector_valid[bit >> 5] |= 1U << (bit & 0x1f);
+    else
+        flash_sector_valid[bit >> 5] &= ~(1U << (bit & 0x1f));
+}
+
+
+/*
+ * Return the sector num_skip valid sectors back from the first valid sector at
+ * or before the sector start. Whole bitmap words below a sector are skipped
+ * using a population count. The caller must check that there are that many
+ * valid sectors.
+ */
+static uint16_t skip_valid_sectors(uint16_t start, uint32_t num_skip)
+{
+    uint32_t bit = start - BUFFER_FLASH_FIRST_SECTOR;
+
+    while (1) {
+        if ((bit & 0x1f) == 0x1f) {
+            uint32_t n = __builtin_popcount(flash_sector_valid[bit >> 5]);
+            if (n <= num_skip) {
+                num_skip -= n;
+                bit = bit > 0x1f ? bit - 0x20 : BUFFER_FLASH_NUM_SECTORS - 1;
+                continue;
+            }
+        }
+        if (flash_sector_valid[bit >> 5] & (1U << (bit & 0x1f))) {
+            if (num_skip == 0)
+                return BUFFER_FLASH_FIRST_SECTOR + bit;
+            num_skip--;
+        }
+        bit = bit > 0 ? bit - 1 : BUFFER_FLASH_NUM_SECTORS - 1;
+    }
+}
+
+/* The oldest index available, only meaningful if num_valid_sectors > 0. */
+static inline uint32_t oldest_valid_index()
+{
+    return newest_valid_index - num_valid_sectors + 1;
+}
+
+/*
+ * Return the sector holding the given index, or zero if it is not available. A
+ * sector was never written with an index less than the oldest_valid_index().
+ */
+static uint16_t index_sector(uint32_t index)
+{
+    if (num_valid_sectors == 0 || index > newest_valid_index)
+        return 0;
+    uint32_t num_skip = newest_valid_index - index;
+    if (num_skip >= num_valid_sectors)
+        return 0;
+    return skip_valid_sectors(newest_valid_sector, num_skip);
+}
+
+/*
+ * Note a sector successfully written with the given index. This is expected to
+ * be the next index.  If not then the index run has been broken, which should
+ * only happen if a buffer could not be saved at all, and the older sectors are
+ * no longer considered usable.
+ */
+static void note_sector_valid(uint16_t sector, uint32_t index)
+{
+    if (num_valid_sectors > 0 && index != newest_valid_index + 1) {
+        memset(flash_sector_valid, 0, sizeof(flash_sector_valid));
+        num_valid_sectors = 0;
+    }
+    set_sector_valid(sector, 1);
+    num_valid_sectors++;
+    newest_valid_sector = sector;
+    newest_valid_index = index;
+}
+
+/*
+ * Note that a sector no longer holds a usable index, because it is about to be
+ * erased or the write failed. Normally this is either the oldest sector, being
+ * overwritten, or the most recent sector after a failed write. If it were
+ * within the run then the older sectors could no longer be mapped so they are
+ * dropped too.
+ */
+static void note_sector_invalid(uint16_t sector)
+{
+    if (!sector_valid_p(sector))
+        return;
+
+    if (sector == newest_valid_sector) {
+        set_sector_valid(sector, 0);
+        num_valid_sectors--;
+        newest_valid_index--;
+        if (num_valid_sectors > 0)
+            newest_valid_sector = skip_valid_sectors(prev_sector(sector), 0);
+        return;
+    }
+
+    /* Count the valid sectors more recent than this sector. */
+    uint32_t newer = 0;
+    uint16_t s;
+    for (s = newest_valid_sector; s != sector; s = prev_sector(s)) {
+        if (sector_valid_p(s))
+            newer++;
+    }
+    /* Drop this sector and any older sectors. */
+    uint32_t older = num_valid_sectors - newer;
+    for (; older > 0; s = prev_sector(s)) {
+        if (sector_valid_p(s)) {
+            set_sector_valid(s, 0);
+            older--;
+        }
+    }
+    num_valid_sectors = newer;
+}
+
+/*
+ * The failure history of the flash sectors, persisted in the sysparam database
+ * as a binary blob so that it survives a restart. Each entry is a sector and
+ * the number of failed writes or erases of that sector. A sector that has
+ * failed FLASH_BAD_SECTOR_FAILURES times is considered bad and is skipped
+ * without attempting a write, rather than burning through the write retries
+ * each time the ring wraps around to it. The table is small, and once full
+ * further sectors are not tracked but are still handled by the write
+ * retries. Failures are rare so the sysparam update on each is not a wear
+ * concern.
+ *
+ * Only accessed holding the flash_state_sem, except at initialization.
+ */
+#define FLASH_MAX_FAILURE_SECTORS 32
+#define FLASH_BAD_SECTOR_FAILURES 3
+
+typedef struct {
+    uint16_t sector;
+    uint16_t failures;
+} flash_failure_t;
+
+static flash_failure_t flash_failures[FLASH_MAX_FAILURE_SECTORS];
+static uint32_t num_flash_failures;
+
+static bool flash_sector_bad(uint16_t sector)
+{
+    uint32_t i;
+    for (i = 0; i < num_flash_failures; i++) {
+        if (flash_failures[i].sector == sector)
+            return flash_failures[i].failures >= FLASH_BAD_SECTOR_FAILURES;
+    }
+    return false;
+}
+
+static void note_flash_sector_failure(uint16_t sector)
+{
+    uint32_t i;
+    for (i = 0; i < num_flash_failures; i++) {
+        if (flash_failures[i].sector == sector)
+            break;
+    }
+    if (i == num_flash_failures) {
+        if (num_flash_failures >= FLASH_MAX_FAILURE_SECTORS)
+            return;
+        flash_failures[i].sector = sector;
+        flash_failures[i].failures = 0;
+        num_flash_failures++;
+    }
+    if (flash_failures[i].failures < 0xffff)
+        flash_failures[i].failures++;
+    sysparam_set_data("oaq_flash_failures", (uint8_t *)flash_failures,
+                      num_flash_failures * sizeof(flash_failure_t), true);
+}
+
+static void init_flash_failures()
+{
+    size_t actual_length;
+    bool is_binary;
+    sysparam_status_t status;
+    status = sysparam_get_data_static("oaq_flash_failures",
+                                      (uint8_t *)flash_failures,
+                                      sizeof(flash_failures),
+                                      &actual_length, &is_binary);
+    if (status == SYSPARAM_OK && is_binary &&
+        actual_length <= sizeof(flash_failures)) {
+        num_flash_failures = actual_length / sizeof(flash_failure_t);
+        /* Discard any entries out of range, perhaps from a different flash
+         * layout. */
+        uint32_t i, j;
+        for (i = 0, j = 0; i < num_flash_failures; i++) {
+            uint16_t sector = flash_failures[i].sector;
+            if (sector >= BUFFER_FLASH_FIRST_SECTOR &&
+                sector < BUFFER_FLASH_FIRST_SECTOR + BUFFER_FLASH_NUM_SECTORS)
+                flash_failures[j++] = flash_failures[i];
+        }
+        num_flash_failures = j;
+    } else {
+        num_flash_failures = 0;
+    }
+}
+
+/*
+ * Build the sector index by reading back from the most recent sector, which is
+ * expected to have been found already. The older copy of a duplicated index is
+ * skipped, and the search stops at the first break in the index run.
+ *
+ * This reads every sector index so is deferred until after start-up, see
+ * check_sector_index().
+ */
+static void init_sector_index(uint16_t most_recent_sector, uint32_t largest_index)
+{
+    memset(flash_sector_valid, 0, sizeof(flash_sector_valid));
+    num_valid_sectors = 0;
+
+    if (!most_recent_sector)
+        return;
+
+    set_sector_valid(most_recent_sector, 1);
+    num_valid_sectors = 1;
+    newest_valid_sector = most_recent_sector;
+    newest_valid_index = largest_index;
+
+    uint32_t expected = largest_index - 1;
+    uint16_t sector;
+    for (sector = prev_sector(most_recent_sector);
+         sector != most_recent_sector && expected != 0xffffffff;
+         sector = prev_sector(sector)) {
+        uint32_t index;
+        /* A bad sector might hold a stale index that could not be erased. */
+        if (flash_sector_bad(sector) || !decode_flash_sector_index(sector, &index))
+            continue;
+        if (index == expected) {
+            set_sector_valid(sector, 1);
+            num_valid_sectors++;
+            expected--;
+        } else if (index < expected || index > largest_index) {
+            /* A break in the run. */
+            break;
+        }
+        /* Otherwise an older copy of an index already noted. */
+    }
+}
+
+/* The most recent sector found at start-up, or zero if none, and its index. */
+static uint16_t recovered_sector;
+static uint32_t recovered_index;
+static uint8_t sector_index_initialized;
+
+/*
+ * Build the sector index on first use, to keep this out of the start-up
+ * path. The caller must hold the flash_state_sem.
+ */
+static void check_sector_index()
+{
+    if (!sector_index_initialized) {
+        init_sector_index(recovered_sector, recovered_index);
+        sector_index_initialized = 1;
+    }
+}
+
 /* For signaling and waiting for data to store to flash */
 TaskHandle_t flash_data_task = NULL;
 
 /* For protecting access to the flash state. */
 SemaphoreHandle_t flash_state_sem = NULL;
+
+/* The time the flash_state_sem was last taken, for the hold time statistic. */
+static uint32_t flash_state_sem_taken;
+
+/* Take and give the flash_state_sem, noting the wait and hold times. */
+static void take_flash_state_sem()
+{
+    uint32_t start = sdk_system_get_time();
+    xSemaphoreTake(flash_state_sem, portMAX_DELAY);
+    flash_state_sem_taken = sdk_system_get_time();
+    stat_time_note(&stat_flash_sem_wait, start, flash_state_sem_taken);
+}
+
+static void give_flash_state_sem()
+{
+    stat_time_note(&stat_flash_sem_hold, flash_state_sem_taken, sdk_system_get_time());
+    xSemaphoreGive(flash_state_sem);
+}
+
+/*
+ * The flash_data task's copy of the head buffer. This is only written by
+ * get_buffer_to_write() which updates just the content added since the last
+ * copy, so it must not be used for anything else. Buffers that are no longer
+ * the head are lent to the flash_data task and written directly.
+ */
 static uint8_t flash_buf[4096];
 
 
-/* Check if a flash sector is erased, returning 1 if erased and 0 if
- * not. */
-static int flash_sector_erased(uint16_t sector)
+/*
+ * Scratch buffer for reading the flash in chunks, for verifying writes and for
+ * reading ranges of sectors. The flash is read in large chunks as each read
+ * has a significant overhead. Only used holding the flash_state_sem.
+ */
+#define FLASH_CHUNK_SIZE 512
+static uint32_t flash_chunk_buf[FLASH_CHUNK_SIZE / 4];
+
+/* Check if a word aligned range of a flash sector is erased, returning 1 if
+ * erased and 0 if not. */
+static int flash_range_erased(uint16_t sector, uint32_t start, uint32_t end)
 {
     uint32_t addr = sector * 4096;
-    int i;
 
-    for (i = 0; i < 4096; i += 4) {
-        uint32_t data[1];
+    while (start < end) {
+        uint32_t size = end - start;
+        if (size > FLASH_CHUNK_SIZE)
+            size = FLASH_CHUNK_SIZE;
         sdk_SpiFlashOpResult res;
-        res = sdk_spi_flash_read(addr + i, data, 4);
+        res = sdk_spi_flash_read(addr + start, flash_chunk_buf, size);
         if (res != SPI_FLASH_RESULT_OK) {
             return 0;
         }
-        if (data[0] != 0xffffffff) {
-            return 0;
+        uint32_t i;
+        for (i = 0; i < size / 4; i++) {
+            if (flash_chunk_buf[i] != 0xffffffff) {
+                return 0;
+            }
         }
+        start += size;
     }
 
     return 1;
 }
 
-/* Compare a flash sector to the contents of a buffer, returning 1 if
- * equal and 0 if not. */
-static int check_flash_sector(uint16_t sector, uint32_t *buf)
+/* Check if a flash sector is erased, returning 1 if erased and 0 if
+ * not. */
+static int flash_sector_erased(uint16_t sector)
+{
+    return flash_range_erased(sector, 0, 4096);
+}
+
+/* Compare a word aligned range of a flash sector to the same range of a
+ * buffer, returning 1 if equal and 0 if not. */
+static int compare_flash_range(uint16_t sector, uint32_t *buf,
+                               uint32_t start, uint32_t end)
 {
     uint32_t addr = sector * 4096;
-    int i;
 
-    for (i = 0; i < 4096; i += 4, buf++) {
-        uint32_t data[1];
+    while (start < end) {
+        uint32_t size = end - start;
+        if (size > FLASH_CHUNK_SIZE)
+            size = FLASH_CHUNK_SIZE;
         sdk_SpiFlashOpResult res;
-        res = sdk_spi_flash_read(addr + i, data, 4);
+        res = sdk_spi_flash_read(addr + start, flash_chunk_buf, size);
         if (res != SPI_FLASH_RESULT_OK) {
             return 0;
         }
-        if (data[0] != buf[0]) {
+        if (memcmp(flash_chunk_buf, buf + start / 4, size) != 0) {
             return 0;
         }
+        start += size;
     }
 
     return 1;
 }
 
+/* Verify a write, as for compare_flash_range(), noting the duration. */
+static int check_flash_range(uint16_t sector, uint32_t *buf,
+                             uint32_t start, uint32_t end)
+{
+    uint32_t time = sdk_system_get_time();
+    int equal = compare_flash_range(sector, buf, start, end);
+    stat_time_note(&stat_flash_verify, time, sdk_system_get_time());
+    return equal;
+}
+
+/* Compare a flash sector to the contents of a buffer, returning 1 if
+ * equal and 0 if not. */
+static int check_flash_sector(uint16_t sector, uint32_t *buf)
+{
+    return check_flash_range(sector, buf, 0, 4096);
+}
+
 /* Log failures. Perhaps log an event for these. */
-static uint32_t flash_write_failures = 0;
-static uint32_t flash_index_invalidate_failures = 0;
+uint32_t flash_write_failures = 0;
+uint32_t flash_index_invalidate_failures = 0;
+/* The number of sector erases, including those done ahead. */
+uint32_t flash_erases = 0;
+
+/* Erase a sector, noting the count and duration. */
+static sdk_SpiFlashOpResult flash_erase_sector(uint16_t sector)
+{
+    uint32_t start = sdk_system_get_time();
+    sdk_SpiFlashOpResult res = sdk_spi_flash_erase_sector(sector);
+    stat_time_note(&stat_flash_erase, start, sdk_system_get_time());
+    flash_erases++;
+    return res;
+}
+
+/* Write to the flash, noting the duration. */
+static sdk_SpiFlashOpResult flash_write(uint32_t dest_addr, uint32_t *src, uint32_t size)
+{
+    uint32_t start = sdk_system_get_time();
+    sdk_SpiFlashOpResult res = sdk_spi_flash_write(dest_addr, src, size);
+    stat_time_note(&stat_flash_write, start, sdk_system_get_time());
+    return res;
+}
+
+/*
+ * The sectors known to be erased, set after an erase ahead of the head of the
+ * ring has been verified and cleared when the sector is written, so that the
+ * write path need not read the sector back to check. Only accessed holding the
+ * flash_state_sem. This is not persisted, at start-up nothing is known.
+ */
+static uint32_t flash_sector_erased_map[(BUFFER_FLASH_NUM_SECTORS + 31) / 32];
+
+static inline uint32_t sector_known_erased_p(uint16_t sector)
+{
+    uint32_t bit = sector - BUFFER_FLASH_FIRST_SECTOR;
+    return flash_sector_erased_map[bit >> 5] & (1U << (bit & 0x1f));
+}
+
+static inline void set_sector_known_erased(uint16_t sector, uint32_t erased)
+{
+    uint32_t bit = sector - BUFFER_FLASH_FIRST_SECTOR;
+    if (erased)
+        flash_sector_erased_map[bit >> 5] |= 1U << (bit & 0x1f);
+    else
+        flash_sector_erased_map[bit >> 5] &= ~(1U << (bit & 0x1f));
+}
 
 /* Handle a failure to erase or write to the current flash_sector. */
 static void handle_flash_write_failure()
 {
     flash_write_failures++;
+    note_flash_sector_failure(flash_sector);
+    note_sector_invalid(flash_sector);
+    set_sector_known_erased(flash_sector, 0);
     /* If the index is invalid then just move on. */
     uint32_t flash_index;
     if (decode_flash_sector_index(flash_sector, &flash_index)) {
         /* If the index decodes as valid then attempt to erase the sector to at
          * least invalidate the index. */
-        sdk_spi_flash_erase_sector(flash_sector);
+        flash_erase_sector(flash_sector);
         taskYIELD();
         if (decode_flash_sector_index(flash_sector, &flash_index)) {
             /* Log the failure. */
@@ -227,27 +737,92 @@ static void handle_flash_write_failure()
  * found. */
 static uint32_t maybe_flash_to_post = 1;
 
+/*
+ * The number of sectors to keep erased ahead of the head of the ring. Erasing
+ * a sector takes tens of msec, and the write path would otherwise read the
+ * sector back to check if erased and then erase it while the new buffer waits,
+ * so this work is done ahead when the flash_data task is idle. When the ring
+ * is full these sectors hold the oldest data, which is lost this much earlier
+ * than when overwritten.
+ */
+#define FLASH_ERASE_AHEAD 2
+
+/*
+ * Erase the next FLASH_ERASE_AHEAD good sectors after the head of the ring that
+ * are not already known to be erased. The flash_state_sem is taken for each
+ * sector, so readers are held off for at most one erase.
+ */
+static void flash_erase_ahead()
+{
+    uint32_t num_ahead = 0;
+    uint32_t num_checked;
+
+    take_flash_state_sem();
+    /* The current sector may still be rewritten if initialized. */
+    uint16_t sector = flash_sector_initialized ? next_sector(flash_sector) : flash_sector;
+    give_flash_state_sem();
+
+    /* Bad sectors are bounded in number, but limit the search anyway. */
+    for (num_checked = 0;
+         num_ahead < FLASH_ERASE_AHEAD && num_checked < BUFFER_FLASH_NUM_SECTORS;
+         num_checked++, sector = next_sector(sector)) {
+        take_flash_state_sem();
+        if (flash_sector_bad(sector)) {
+            give_flash_state_sem();
+            continue;
+        }
+        num_ahead++;
+        if (!sector_known_erased_p(sector)) {
+            note_sector_invalid(sector);
+            if (flash_sector_erased(sector)) {
+                set_sector_known_erased(sector, 1);
+            } else {
+                sdk_SpiFlashOpResult res;
+                res = flash_erase_sector(sector);
+                taskYIELD();
+                if (res == SPI_FLASH_RESULT_OK && flash_sector_erased(sector)) {
+                    set_sector_known_erased(sector, 1);
+                } else {
+                    /* Left to the write path to handle. */
+                    flash_write_failures++;
+                    note_flash_sector_failure(sector);
+                }
+            }
+        }
+        give_flash_state_sem();
+    }
+}
+
 void flash_data(void *pvParameters)
 {
+    take_flash_state_sem();
+    check_sector_index();
+    give_flash_state_sem();
+
     while (1) {
         xTaskNotifyWait(0, 0, NULL, 120000 / portTICK_PERIOD_MS);
 
         /* Try to flush all the pending buffers before waiting again. */
         while (1) {
             uint32_t start;
-            uint32_t size = get_buffer_to_write(flash_buf, &start);
-            uint32_t index = flash_buf[0] | flash_buf[1] << 8 | flash_buf[2] << 16 | flash_buf[3] << 24 ;
+            uint8_t *data;
+            uint32_t size = get_buffer_to_write(flash_buf, &data, &start);
 
-            if (size == 0)
+            if (size == 0) {
+                /* Idle, so prepare the sectors ahead. */
+                flash_erase_ahead();
                 break;
+            }
+
+            uint32_t index = data[0] | data[1] << 8 | data[2] << 16 | data[3] << 24 ;
 
-            xSemaphoreTake(flash_state_sem, portMAX_DELAY);
+            take_flash_state_sem();
 
             if (flash_sector_initialized) {
                 /* Rewrite to the current flash_sector? */
-                uint32_t flash_index;
-                if (decode_flash_sector_index(flash_sector, &flash_index) &&
-                    flash_index == index) {
+                if (num_valid_sectors > 0 &&
+                    newest_valid_sector == flash_sector &&
+                    newest_valid_index == index) {
                     /* Rewrite to the current flash_sector. Firstly try just
                      * writing from the start position. */
 
@@ -258,12 +833,15 @@ void flash_data(void *pvParameters)
 
                     sdk_SpiFlashOpResult res;
                     uint32_t dest_addr = (uint32_t)flash_sector * 4096 + aligned_start;
-                    res = sdk_spi_flash_write(dest_addr, (uint32_t *)(flash_buf + aligned_start), aligned_size);
+                    res = flash_write(dest_addr, (uint32_t *)(data + aligned_start), aligned_size);
                     taskYIELD();
+                    /* Only the range written needs to be checked, the rest
+                     * was checked when written. */
                     if (res == SPI_FLASH_RESULT_OK &&
-                        check_flash_sector(flash_sector, (uint32_t *)flash_buf)) {
+                        check_flash_range(flash_sector, (uint32_t *)data,
+                                          aligned_start, aligned_end)) {
                         maybe_flash_to_post = 1;
-                        xSemaphoreGive(flash_state_sem);
+                        give_flash_state_sem();
                         note_buffer_written(index, size);
                         continue;
                     }
@@ -283,12 +861,25 @@ void flash_data(void *pvParameters)
 
             /* Retry a limited number of times on write failures. */
             int retries = 0;
+            uint32_t num_skipped = 0;
             while (1) {
-                /* Firstly check if it is erased. */
-                if (!flash_sector_erased(flash_sector)) {
+                /* Skip sectors known to be bad without a write attempt. This
+                 * is bounded by the size of the failure table, but limit it
+                 * anyway. */
+                if (flash_sector_bad(flash_sector) &&
+                    num_skipped++ < BUFFER_FLASH_NUM_SECTORS) {
+                    note_sector_invalid(flash_sector);
+                    flash_sector = next_sector(flash_sector);
+                    continue;
+                }
+                /* The prior content is lost from here. */
+                note_sector_invalid(flash_sector);
+                /* Firstly check if it is erased, unless known to be. */
+                if (!sector_known_erased_p(flash_sector) &&
+                    !flash_sector_erased(flash_sector)) {
                     /* Erase the flash_sector. */
                     sdk_SpiFlashOpResult res;
-                    res = sdk_spi_flash_erase_sector(flash_sector);
+                    res = flash_erase_sector(flash_sector);
                     taskYIELD();
                     if (res != SPI_FLASH_RESULT_OK ||
                         !flash_sector_erased(flash_sector)) {
@@ -297,12 +888,13 @@ void flash_data(void *pvParameters)
                     }
                 }
                 /* Write the sector. */
+                set_sector_known_erased(flash_sector, 0);
                 sdk_SpiFlashOpResult res;
                 uint32_t dest_addr = (uint32_t)flash_sector * 4096;
-                res = sdk_spi_flash_write(dest_addr, (uint32_t *)flash_buf, size);
+                res = flash_write(dest_addr, (uint32_t *)data, size);
                 taskYIELD();
                 if (res != SPI_FLASH_RESULT_OK ||
-                    !check_flash_sector(flash_sector, (uint32_t *)flash_buf)) {
+                    !check_flash_sector(flash_sector, (uint32_t *)data)) {
                     handle_flash_write_failure();
                     if (++retries > 32) {
                         /* Give up, consider it written. */
@@ -312,10 +904,11 @@ void flash_data(void *pvParameters)
                 }
                 /* Success. */
                 flash_sector_initialized = 1;
+                note_sector_valid(flash_sector, index);
                 break;
             }
             maybe_flash_to_post = 1;
-            xSemaphoreGive(flash_state_sem);
+            give_flash_state_sem();
             note_buffer_written(index, size);
             /* Signal the HTTP-Post thread to re-check. */
             if (post_data_task)
@@ -327,171 +920,316 @@ void flash_data(void *pvParameters)
 static uint32_t last_index_posted = 0;
 static uint32_t last_index_size_posted = 0;
 
-uint32_t get_buffer_to_post(uint32_t *index, uint32_t *start, uint8_t *buf)
+/*
+ * Read a sector into buf from the start offset, which must be word aligned, to
+ * the end of the sector. Returns the size read excluding any trailing ones
+ * bytes, or -1 on failure.
+ */
+static int32_t read_flash_sector_trimmed(uint16_t sector, uint32_t start, uint8_t *buf)
 {
-    xSemaphoreTake(flash_state_sem, portMAX_DELAY);
+    sdk_SpiFlashOpResult res;
+    res = sdk_spi_flash_read(sector * 4096 + start, (uint32_t *)buf, 4096 - start);
+    if (res != SPI_FLASH_RESULT_OK)
+        return -1;
+
+    /* Skip trailing ones bits. */
+    int32_t size;
+    for (size = 4096 - start; size > 0; size--) {
+        if (buf[size - 1] != 0xff)
+            break;
+    }
+    return size;
+}
 
-    /* Initialize, can use sector zero here to represent 'none'. */
-    uint16_t sector_to_post = 0;
-    uint32_t index_to_post = 0xffffffff;
+/*
+ * Return the size of a sector excluding any trailing ones bytes, or -1 on
+ * failure. The sector is read backwards in chunks, so usually only the last
+ * chunk or two need to be read.
+ */
+static int32_t flash_sector_trimmed_size(uint16_t sector)
+{
+    uint32_t end = 4096;
 
-    if (flash_sector_initialized) {
-        if (decode_flash_sector_index(flash_sector, index)) {
-            if (last_index_posted > *index) {
-                /* Bad last_index_posted reset. */
-                last_index_posted = *index;
-                last_index_size_posted = 0;
-            }
-            if (*index == last_index_posted) {
-                if (last_index_size_posted < 4096) {
-                    /* Check the size to post.  Limit and align the start. */
-                    *start = last_index_size_posted & 0xffc;
-                    sdk_SpiFlashOpResult res;
-                    res = sdk_spi_flash_read(flash_sector * 4096 + *start, (uint32_t *)buf, 4096 - *start);
-                    if (res == SPI_FLASH_RESULT_OK) {
-                        /* Skip sending trailing ones bits. */
-                        uint32_t size;
-                        for (size = 4096 - *start; size > 0; size--) {
-                            if (buf[size - 1] != 0xff)
-                                break;
-                        }
-                        /* Take account of the alignment above to avoid posting
-                         * data already completely posted. */
-                        if (*start + size <= last_index_size_posted)
-                            size = 0;
-                        maybe_flash_to_post = size;
-                        xSemaphoreGive(flash_state_sem);
-                        return size;
-                    }
-                }
-                /* Here the current flash sector has been posted, so done. */
-                maybe_flash_to_post = 0;
-                xSemaphoreGive(flash_state_sem);
-                return 0;
-            } else {
-                /* Not the last posted but still a candidate to post. */
-                sector_to_post = flash_sector;
-                index_to_post = *index;
-            }
+    while (end > 0) {
+        uint32_t start = end - FLASH_CHUNK_SIZE;
+        sdk_SpiFlashOpResult res;
+        res = sdk_spi_flash_read(sector * 4096 + start, flash_chunk_buf, FLASH_CHUNK_SIZE);
+        if (res != SPI_FLASH_RESULT_OK)
+            return -1;
+        uint8_t *chunk = (uint8_t *)flash_chunk_buf;
+        uint32_t size;
+        for (size = FLASH_CHUNK_SIZE; size > 0; size--) {
+            if (chunk[size - 1] != 0xff)
+                return start + size;
         }
+        end = start;
     }
 
-    /* Search backwards from the current head flash_sector looking for the first
-     * index not posted. */
-    uint32_t sector = flash_sector - 1;
-    if (sector < BUFFER_FLASH_FIRST_SECTOR) {
-        sector = BUFFER_FLASH_FIRST_SECTOR + BUFFER_FLASH_NUM_SECTORS - 1;
+    return 0;
+}
+
+/*
+ * Search for the next content saved to flash to post, following the posted
+ * position given by *posted_index and *posted_size, which are reset if not
+ * usable. Called with the last position acknowledged by the server, or with a
+ * copy of an assumed position when prefetching.
+ */
+static uint32_t get_flash_buffer_to_post(uint32_t *posted_index, uint32_t *posted_size,
+                                         uint32_t *index, uint32_t *start, uint8_t *buf)
+{
+    take_flash_state_sem();
+    check_sector_index();
+
+    if (num_valid_sectors == 0) {
+        maybe_flash_to_post = 0;
+        give_flash_state_sem();
+        return 0;
     }
 
-    while (1) {
-        if (decode_flash_sector_index(sector, index)) {
-            /*
-             * The index should decrease monotonically so stop searching here if
-             * not because the data is corrupt.
-             */
-            if (index_to_post != 0xffffffff && *index != index_to_post - 1) {
-                break;
-            }
-            if (last_index_posted > *index) {
-                /* Bad last_index_posted reset. */
-                last_index_posted = *index;
-                last_index_size_posted = 0;
-            }
-            if (*index == last_index_posted) {
-                /* Either re-sending this sector or the prior. Need to check the
-                 * size that needs to be sent. */
-                if (last_index_size_posted < 4096) {
-                    /* Limit and align the start. */
-                    *start = last_index_size_posted & 0xffc;
-                    sdk_SpiFlashOpResult res;
-                    res = sdk_spi_flash_read(sector * 4096 + *start, (uint32_t *)buf, 4096 - *start);
-                    if (res == SPI_FLASH_RESULT_OK) {
-                        /* Skip sending trailing ones bits. */
-                        uint32_t size;
-                        for (size = 4096 - *start; size > 0; size--) {
-                            if (buf[size - 1] != 0xff)
-                                break;
-                        }
-                        /* Take account of the alignment above to avoid posting
-                         * data already completely posted. */
-                        if (*start + size > last_index_size_posted) {
-                            /* Resend. It's already read and in the buffer and
-                             * the 'start' is set, so done. */
-                            maybe_flash_to_post = size;
-                            xSemaphoreGive(flash_state_sem);
-                            return size;
-                        }
-                    } else {
-                        /* Just ignore the index/sector, send the next. */
-                    }
-                }
-            }
+    uint32_t oldest_index = oldest_valid_index();
 
-            if (*index <= last_index_posted) {
-                /* Done searching, send the last valid index found which should
-                 * be the index after the last posted. */
-                break;
-            }
+    /* When posting from memory the buffers posted might not have been saved
+     * yet, but are not newer than the head buffer. */
+    uint32_t newest_index = param_live_period ? dbuf_head_index() : newest_valid_index;
+    if (newest_index < newest_valid_index)
+        newest_index = newest_valid_index;
 
-            if (*index < index_to_post) {
-                /* Note the sector each time the index decreases, to note the
-                 * latest sector with a given index. */
-                index_to_post = *index;
-                sector_to_post = sector;
-            }
-        }
-        sector--;
-        if (sector < BUFFER_FLASH_FIRST_SECTOR) {
-            sector = BUFFER_FLASH_FIRST_SECTOR + BUFFER_FLASH_NUM_SECTORS - 1;
-        }
-        if (sector == flash_sector) {
-            /* Wrapped. */
-            break;
+    if (*posted_index > newest_index) {
+        /* Bad posted position, reset. */
+        *posted_index = newest_valid_index;
+        *posted_size = 0;
+    }
+
+    if (*posted_index >= oldest_index && *posted_index <= newest_valid_index &&
+        *posted_size < 4096) {
+        /* Either re-sending this sector or the head sector has grown. Need to
+         * check the size that needs to be sent. Limit and align the start. */
+        uint16_t sector = index_sector(*posted_index);
+        *index = *posted_index;
+        *start = *posted_size & 0xffc;
+        int32_t size = read_flash_sector_trimmed(sector, *start, buf);
+        /* Take account of the alignment above to avoid posting data already
+         * completely posted. On a read failure just ignore the sector, and
+         * send the next. */
+        if (size > 0 && *start + size > *posted_size) {
+            /* It's already read and in the buffer and the 'start' is set, so
+             * done. */
+            maybe_flash_to_post = size;
+            give_flash_state_sem();
+            return size;
         }
     }
 
+    /* Send the index after the last posted, or the oldest if the last posted
+     * is no longer in the flash. */
+    uint32_t index_to_post = *posted_index + 1;
+    if (*posted_index < oldest_index)
+        index_to_post = oldest_index;
+
+    if (index_to_post > newest_valid_index) {
+        /* Here the most recent sector has been posted, so done. */
+        maybe_flash_to_post = 0;
+        give_flash_state_sem();
+        return 0;
+    }
+
     *index = index_to_post;
+    /* Always sends from the start of the sector in this path. */
+    *start = 0;
 
-    uint32_t size = 0;
-    if (sector_to_post) {
-        /* Always sends from the start of the sector in this path. */
-        *start = 0;
-        /* Read the entire sector. */
-        sdk_SpiFlashOpResult res;
-        res = sdk_spi_flash_read(sector_to_post * 4096, (uint32_t *)buf, 4096);
-        if (res == SPI_FLASH_RESULT_OK) {
-            /* Skip sending trailing ones bits. */
-            for (size = 4096; size > 0; size--) {
-                if (buf[size - 1] != 0xff)
-                    break;
-            }
-        } else {
-            /* Fill the buffer with an invalid index value, and a short invalid
-             * length to communicate the failure to the server. */
-            buf[0] = index_to_post;
-            buf[1] = index_to_post >> 8;
-            buf[2] = index_to_post >> 16;
-            buf[3] = index_to_post >> 24;
-            size = 4;
-            /* Move on to next index. */
-            last_index_posted = index_to_post;
-            last_index_size_posted = 4096;
-        }
+    uint32_t size;
+    int32_t trimmed = read_flash_sector_trimmed(index_sector(index_to_post), 0, buf);
+    if (trimmed >= 0) {
+        size = trimmed;
+    } else {
+        /* Fill the buffer with an invalid index value, and a short invalid
+         * length to communicate the failure to the server. */
+        buf[0] = index_to_post;
+        buf[1] = index_to_post >> 8;
+        buf[2] = index_to_post >> 16;
+        buf[3] = index_to_post >> 24;
+        size = 4;
+        /* Move on to next index. */
+        *posted_index = index_to_post;
+        *posted_size = 4096;
     }
     maybe_flash_to_post = size;
-    xSemaphoreGive(flash_state_sem);
+    give_flash_state_sem();
+    return size;
+}
+
+/*
+ * Search for content to post that is held in memory and not yet saved to
+ * flash. Firstly the remainder of the last buffer posted, and then the next
+ * buffer. This is only used after all the content saved to flash has been
+ * posted, so the buffers are still posted in the order of their index.
+ */
+static uint32_t get_memory_buffer_to_post(uint32_t posted_index, uint32_t posted_size,
+                                          uint32_t *index, uint32_t *start, uint8_t *buf)
+{
+    if (posted_size < 4096) {
+        uint32_t aligned_start = posted_size & 0xffc;
+        int32_t size = dbuf_copy_range(posted_index, aligned_start, 4096, buf);
+        if (size > 0 && aligned_start + size > posted_size) {
+            *index = posted_index;
+            *start = aligned_start;
+            return size;
+        }
+    }
+
+    int32_t size = dbuf_copy_range(posted_index + 1, 0, 4096, buf);
+    if (size > 8) {
+        *index = posted_index + 1;
+        *start = 0;
+        return size;
+    }
+
+    return 0;
+}
+
+/*
+ * Search for the next content to post. If param_live_period is set then the
+ * content held in memory is also posted, so the server sees the data before
+ * it is saved to flash, without forcing a flash write.
+ */
+uint32_t get_buffer_to_post(uint32_t *index, uint32_t *start, uint8_t *buf)
+{
+    uint32_t size = get_flash_buffer_to_post(&last_index_posted, &last_index_size_posted,
+                                             index, start, buf);
+    if (size == 0 && param_live_period) {
+        take_flash_state_sem();
+        uint32_t posted_index = last_index_posted;
+        uint32_t posted_size = last_index_size_posted;
+        give_flash_state_sem();
+        size = get_memory_buffer_to_post(posted_index, posted_size, index, start, buf);
+    }
+    return size;
+}
+
+/*
+ * As get_buffer_to_post(), but for the content following the given position
+ * as if the server had acknowledged it. Used to prefetch the next buffer to
+ * post while the response to the current post is pending. The last position
+ * acknowledged by the server is not changed.
+ */
+uint32_t get_buffer_to_post_after(uint32_t posted_index, uint32_t posted_size,
+                                  uint32_t *index, uint32_t *start, uint8_t *buf)
+{
+    uint32_t size = get_flash_buffer_to_post(&posted_index, &posted_size,
+                                             index, start, buf);
+    if (size == 0 && param_live_period)
+        size = get_memory_buffer_to_post(posted_index, posted_size, index, start, buf);
     return size;
 }
 
 void note_buffer_posted(uint32_t index, uint32_t size)
 {
-    xSemaphoreTake(flash_state_sem, portMAX_DELAY);
+    take_flash_state_sem();
     last_index_posted = index;
     last_index_size_posted = size;
-    xSemaphoreGive(flash_state_sem);
+    give_flash_state_sem();
     blink_white();
 }
 
+/*
+ * The set of buffers the server has requested be re-sent, as a bitmap of
+ * indexes from resend_base. Each server response replaces this set, see
+ * note_buffer_resend(), and the bit for a buffer is cleared when it is read to
+ * post. Must be accessed holding the flash_state_sem.
+ */
+static uint32_t resend_base;
+static uint8_t resend_bitmap[BUFFER_RESEND_BITMAP_SIZE];
+
+/*
+ * Replace the set of buffers to re-send, with the bitmap of size bytes of
+ * indexes from the base index. A zero size clears the set.
+ */
+void note_buffer_resend(uint32_t base, uint8_t *bitmap, uint32_t size)
+{
+    if (size > BUFFER_RESEND_BITMAP_SIZE)
+        size = BUFFER_RESEND_BITMAP_SIZE;
+    take_flash_state_sem();
+    resend_base = base;
+    memset(resend_bitmap, 0, sizeof(resend_bitmap));
+    memcpy(resend_bitmap, bitmap, size);
+    give_flash_state_sem();
+}
+
+/*
+ * If the index is in the set of buffers to re-send then remove it and return
+ * true. Used when a buffer read to re-send before a server response that
+ * replaced the set is still to be sent.
+ */
+bool claim_buffer_resend(uint32_t index)
+{
+    bool claimed = false;
+    take_flash_state_sem();
+    uint32_t bit = index - resend_base;
+    if (index >= resend_base && bit < BUFFER_RESEND_BITMAP_SIZE * 8 &&
+        resend_bitmap[bit >> 3] & (1 << (bit & 7))) {
+        resend_bitmap[bit >> 3] &= ~(1 << (bit & 7));
+        claimed = true;
+    }
+    give_flash_state_sem();
+    return claimed;
+}
+
+/*
+ * Read the next buffer the server requested be re-sent into buf, the oldest
+ * first, and remove it from the set. The sector is found using the sector
+ * index so this does not search the flash. Indexes no longer in the flash are
+ * dropped. Returns the size read and sets the index, or returns zero if there
+ * is nothing to re-send. The entire buffer is re-sent.
+ */
+uint32_t get_buffer_to_resend(uint32_t *index, uint8_t *buf)
+{
+    take_flash_state_sem();
+    check_sector_index();
+
+    uint32_t bit;
+    for (bit = 0; bit < BUFFER_RESEND_BITMAP_SIZE * 8; bit++) {
+        if (!(resend_bitmap[bit >> 3] & (1 << (bit & 7))))
+            continue;
+        resend_bitmap[bit >> 3] &= ~(1 << (bit & 7));
+        uint16_t sector = index_sector(resend_base + bit);
+        if (!sector)
+            continue;
+        int32_t size = read_flash_sector_trimmed(sector, 0, buf);
+        if (size <= 0)
+            continue;
+        *index = resend_base + bit;
+        give_flash_state_sem();
+        return size;
+    }
+
+    give_flash_state_sem();
+    return 0;
+}
+
+/* The last buffer index and size acknowledged by the server, to be restored
+ * by note_buffer_posted() after a deep sleep. */
+void get_buffer_posted(uint32_t *index, uint32_t *size)
+{
+    take_flash_state_sem();
+    *index = last_index_posted;
+    *size = last_index_size_posted;
+    give_flash_state_sem();
+}
+
+/*
+ * Return the number of buffers newer than the last buffer acknowledged by the
+ * server, including the head buffer, as a measure of the backlog to post.
+ */
+uint32_t buffers_to_post()
+{
+    take_flash_state_sem();
+    uint32_t posted_index = last_index_posted;
+    give_flash_state_sem();
+
+    uint32_t head_index = dbuf_head_index();
+    return head_index > posted_index ? head_index - posted_index : 0;
+}
+
 /*
  * Return 0 if there is no data to post otherwise non-zero. The caller is the
  * only task that is expected to reset this, and the flash_data_task the only
@@ -501,9 +1239,23 @@ void note_buffer_posted(uint32_t index, uint32_t size)
  */
 uint32_t maybe_buffer_to_post()
 {
-    xSemaphoreTake(flash_state_sem, portMAX_DELAY);
+    take_flash_state_sem();
     uint32_t maybe = maybe_flash_to_post;
-    xSemaphoreGive(flash_state_sem);
+    uint32_t posted_index = last_index_posted;
+    uint32_t posted_size = last_index_size_posted;
+    /* Buffers the server requested be re-sent. */
+    uint32_t i;
+    for (i = 0; !maybe && i < BUFFER_RESEND_BITMAP_SIZE; i++)
+        maybe = resend_bitmap[i];
+    give_flash_state_sem();
+
+    /* Content held in memory that has not been posted. */
+    if (!maybe && param_live_period) {
+        uint32_t size = dbuf_size(posted_index);
+        maybe = (posted_size < 4096 && size > posted_size) ||
+            dbuf_size(posted_index + 1) > 8;
+    }
+
     return maybe;
 }
 
@@ -521,144 +1273,185 @@ uint32_t maybe_buffer_to_post()
  */
 uint32_t get_buffer_size(uint32_t requested_index, uint32_t *index)
 {
-    xSemaphoreTake(flash_state_sem, portMAX_DELAY);
-
-    uint32_t last_sector = 0;
-
-    if (flash_sector_initialized) {
-        if (decode_flash_sector_index(flash_sector, index)) {
-            last_sector = flash_sector;
-            if (*index <= requested_index) {
-                sdk_SpiFlashOpResult res;
-                res = sdk_spi_flash_read(flash_sector * 4096, (uint32_t *)flash_buf, 4096);
-                if (res == SPI_FLASH_RESULT_OK) {
-                    uint32_t size = 0;
-                    for (size = 4096; size > 0; size--) {
-                        if (flash_buf[size - 1] != 0xff)
-                            break;
-                    }
-                    xSemaphoreGive(flash_state_sem);
-                    return size;
-                }
-            }
-        }
+    /* The buffers held in memory might have content not yet saved. */
+    uint32_t head_index = dbuf_head_index();
+    if (requested_index >= head_index) {
+        *index = head_index;
+        return dbuf_size(head_index);
     }
-
-    /* Search backwards from the current head flash_sector looking for the first
-     * index not posted. */
-    uint32_t sector = flash_sector - 1;
-    if (sector < BUFFER_FLASH_FIRST_SECTOR) {
-        sector = BUFFER_FLASH_FIRST_SECTOR + BUFFER_FLASH_NUM_SECTORS - 1;
-    }
-
-    while (1) {
-        if (decode_flash_sector_index(sector, index)) {
-            last_sector = sector;
-            if (*index <= requested_index) {
-                sdk_SpiFlashOpResult res;
-                memset(flash_buf, 0xa5, 4096);
-                res = sdk_spi_flash_read(sector * 4096, (uint32_t *)flash_buf, 4096);
-                if (res == SPI_FLASH_RESULT_OK) {
-                    uint32_t size;
-                    for (size = 4096; size > 0; size--) {
-                        if (flash_buf[size - 1] != 0xff)
-                            break;
-                    }
-                    xSemaphoreGive(flash_state_sem);
-                    return size;
-                }
-            }
-        }
-        sector--;
-        if (sector < BUFFER_FLASH_FIRST_SECTOR) {
-            sector = BUFFER_FLASH_FIRST_SECTOR + BUFFER_FLASH_NUM_SECTORS - 1;
-        }
-        if (sector == flash_sector) {
-            /* Wrapped. */
-            break;
-        }
+    uint32_t size = dbuf_size(requested_index);
+    if (size > 0) {
+        *index = requested_index;
+        return size;
     }
 
-    if (last_sector != 0) {
-        // Found something, so return it and it's size.
-        if (decode_flash_sector_index(last_sector, index)) {
-            sdk_SpiFlashOpResult res;
-            res = sdk_spi_flash_read(last_sector * 4096, (uint32_t *)flash_buf, 4096);
-            if (res == SPI_FLASH_RESULT_OK) {
-                uint32_t size = 0;
-                for (size = 4096; size > 0; size--) {
-                    if (flash_buf[size - 1] != 0xff)
-                        break;
-                }
-                xSemaphoreGive(flash_state_sem);
-                return size;
-            }
+    take_flash_state_sem();
+    check_sector_index();
+
+    if (num_valid_sectors > 0) {
+        uint32_t i = requested_index;
+        if (i > newest_valid_index)
+            i = newest_valid_index;
+        if (i < oldest_valid_index())
+            i = oldest_valid_index();
+        int32_t size = flash_sector_trimmed_size(index_sector(i));
+        if (size >= 0) {
+            *index = i;
+            give_flash_state_sem();
+            return size;
         }
     }
 
-    xSemaphoreGive(flash_state_sem);
+    give_flash_state_sem();
 
     *index = 0;
     return 0;
 }
 
 /*
- * Return a range of the buffer with the given index. If the buffer
- * index is no longer available then return false, otherwise success,
- * which can happen if reading from the tail of the FIFO. The http
- * response will be truncated on such a failure and less than the
- * length probe at the start of the response, the http response will
- * send a response with a content-length and the client can detect
- * the truncated response.
+ * Note the oldest and newest buffer indexes saved to flash. Return false if
+ * there are none.
  */
-bool get_buffer_range(uint32_t index, uint32_t start, uint32_t end, uint8_t *buf)
+bool get_buffer_index_range(uint32_t *oldest, uint32_t *newest)
 {
-    xSemaphoreTake(flash_state_sem, portMAX_DELAY);
+    take_flash_state_sem();
+    check_sector_index();
 
-    if (flash_sector_initialized) {
-        uint32_t i;
-        if (decode_flash_sector_index(flash_sector, &i) && i == index) {
-            sdk_SpiFlashOpResult res;
-            res = sdk_spi_flash_read(flash_sector * 4096, (uint32_t *)flash_buf, 4096);
-            if (res == SPI_FLASH_RESULT_OK) {
-                for (i = 0; i < end - start; i++)
-                    buf[i] = flash_buf[start + i];
-                xSemaphoreGive(flash_state_sem);
-                return true;
-            }
+    bool valid = num_valid_sectors > 0;
+    if (valid) {
+        *oldest = oldest_valid_index();
+        *newest = newest_valid_index;
+    }
+
+    give_flash_state_sem();
+    return valid;
+}
+
+/*
+ * Open a cursor for reading the range from start to end of the buffer with the
+ * given index. The range is limited to the current size of the buffer. Return
+ * false if the buffer index is not available.
+ *
+ * The sector holding the buffer is found once here, so that each read from the
+ * cursor needs only to check that the sector still holds the buffer and read
+ * the requested window. A buffer still held in memory is read from there, and
+ * includes the content not yet saved to flash.
+ */
+bool open_buffer_cursor(buffer_cursor_t *cursor, uint32_t index, uint32_t start,
+                        uint32_t end)
+{
+    /* Read from memory if the buffer is still there, as it has the content
+     * not yet saved. This is noted by a zero sector. */
+    uint16_t sector = 0;
+    int32_t size = dbuf_size(index);
+
+    if (size == 0) {
+        take_flash_state_sem();
+        check_sector_index();
+
+        sector = index_sector(index);
+        size = sector ? flash_sector_trimmed_size(sector) : -1;
+
+        give_flash_state_sem();
+    }
+
+    if (size < 0)
+        return false;
+
+    if (end > size)
+        end = size;
+    if (start > end)
+        start = end;
+
+    cursor->index = index;
+    cursor->sector = sector;
+    cursor->offset = start;
+    cursor->end = end;
+    return true;
+}
+
+/*
+ * Read up to size bytes from the cursor into buf, advancing the cursor. Return
+ * the number of bytes read, which is zero at the end of the range, or -1 if
+ * the buffer is no longer available, which can happen if reading from the
+ * tail of the FIFO. The http response will be truncated on such a failure and
+ * less than the length probe at the start of the response, the http response
+ * will send a response with a content-length and the client can detect the
+ * truncated response.
+ */
+int32_t read_buffer_cursor(buffer_cursor_t *cursor, uint8_t *buf, uint32_t size)
+{
+    if (size > cursor->end - cursor->offset)
+        size = cursor->end - cursor->offset;
+
+    if (cursor->sector == 0) {
+        int32_t n = dbuf_copy_range(cursor->index, cursor->offset,
+                                    cursor->offset + size, buf);
+        if (n == size) {
+            cursor->offset += size;
+            return size;
         }
+
+        /* No longer in memory, so it has been saved to flash, or lost. */
+        take_flash_state_sem();
+        check_sector_index();
+        cursor->sector = index_sector(cursor->index);
+        give_flash_state_sem();
+        if (cursor->sector == 0)
+            return -1;
     }
 
-    /* Search backwards from the current head flash_sector looking for the first
-     * index not posted. */
-    uint32_t sector = flash_sector - 1;
-    if (sector < BUFFER_FLASH_FIRST_SECTOR) {
-        sector = BUFFER_FLASH_FIRST_SECTOR + BUFFER_FLASH_NUM_SECTORS - 1;
+    take_flash_state_sem();
+
+    /* A sector that has been erased and reused has a newer index, and the
+     * buffer index is then older than the oldest valid index. */
+    if (num_valid_sectors == 0 || cursor->index < oldest_valid_index() ||
+        cursor->index > newest_valid_index || !sector_valid_p(cursor->sector)) {
+        give_flash_state_sem();
+        return -1;
     }
 
-    while (1) {
-        uint32_t i;
-        if (decode_flash_sector_index(sector, &i) && i == index) {
-            sdk_SpiFlashOpResult res;
-            res = sdk_spi_flash_read(sector * 4096, (uint32_t *)flash_buf, 4096);
-            if (res == SPI_FLASH_RESULT_OK) {
-                for (i = 0; i < end - start; i++)
-                    buf[i] = flash_buf[start + i];
-                xSemaphoreGive(flash_state_sem);
-                return true;
+    uint32_t start = cursor->offset;
+    uint32_t end = start + size;
+    uint32_t base = cursor->sector * 4096;
+
+    while (start < end) {
+        sdk_SpiFlashOpResult res;
+        if ((start & 3) == 0 && ((uintptr_t)buf & 3) == 0 && end - start >= 4) {
+            /* Word aligned, so read directly into the buffer. */
+            uint32_t read_size = (end - start) & 0xfffffffc;
+            res = sdk_spi_flash_read(base + start, (uint32_t *)buf, read_size);
+            if (res != SPI_FLASH_RESULT_OK) {
+                give_flash_state_sem();
+                return -1;
             }
+            buf += read_size;
+            start += read_size;
+            continue;
         }
-        sector--;
-        if (sector < BUFFER_FLASH_FIRST_SECTOR) {
-            sector = BUFFER_FLASH_FIRST_SECTOR + BUFFER_FLASH_NUM_SECTORS - 1;
-        }
-        if (sector == flash_sector) {
-            /* Wrapped. */
-            break;
+        /* The flash reads must be word aligned, so read aligned chunks into
+         * the scratch buffer and copy out the requested range. */
+        uint32_t aligned_start = start & 0xfffffffc;
+        uint32_t chunk_size = end - aligned_start;
+        if (chunk_size > FLASH_CHUNK_SIZE)
+            chunk_size = FLASH_CHUNK_SIZE;
+        uint32_t read_size = (chunk_size + 3) & 0xfffffffc;
+        res = sdk_spi_flash_read(base + aligned_start, flash_chunk_buf, read_size);
+        if (res != SPI_FLASH_RESULT_OK) {
+            give_flash_state_sem();
+            return -1;
         }
+        uint8_t *chunk = (uint8_t *)flash_chunk_buf;
+        uint32_t i;
+        for (i = start - aligned_start; i < chunk_size; i++)
+            *buf++ = chunk[i];
+        start = aligned_start + chunk_size;
     }
 
-    return false;
+    give_flash_state_sem();
+
+    cursor->offset = end;
+    return size;
 }
 
 
@@ -666,21 +1459,59 @@ uint32_t init_flash()
 {
     uint32_t flash_index;
 
-    /* Recover the head sector and index. */
-    if (find_most_recent_sector(&flash_sector, &flash_index)) {
+    /* Recover the head sector and index. Firstly try the fast search, and if
+     * that fails then fallback to a search of all the sectors. */
+    if (search_most_recent_sector(&flash_sector, &flash_index) ||
+        find_most_recent_sector(&flash_sector, &flash_index)) {
+        recovered_sector = flash_sector;
+        recovered_index = flash_index;
         /* Start the head at the next sector. */
         flash_sector++;
-        if (flash_sector > BUFFER_FLASH_FIRST_SECTOR + BUFFER_FLASH_NUM_SECTORS)
+        if (flash_sector >= BUFFER_FLASH_FIRST_SECTOR + BUFFER_FLASH_NUM_SECTORS)
             flash_sector = BUFFER_FLASH_FIRST_SECTOR;
         flash_index++;
     } else {
         /* No valid sectors, start at the first sector. */
+        recovered_sector = 0;
+        recovered_index = 0;
         flash_sector = BUFFER_FLASH_FIRST_SECTOR;
         flash_index = 0;
     }
     flash_sector_initialized = 0;
+    sector_index_initialized = 0;
+
+    init_flash_failures();
 
     flash_state_sem = xSemaphoreCreateMutex();
 
     return flash_index;
 }
+
+/*
+ * Resume writing to the most recent sector found at start-up, rather than
+ * starting a new sector, after a deep sleep. The sector must hold the given
+ * index, and the size is the size of the buffer saved before the sleep which
+ * can not be less than the content found in the sector. The sector is read
+ * into buf, which must be word aligned. Returns true on success, otherwise
+ * buf needs to be re-initialized.
+ */
+bool flash_resume(uint32_t index, uint8_t *buf, uint32_t size)
+{
+    if (!recovered_sector || recovered_index != index || size <= 8 || size > 4096)
+        return false;
+
+    if (flash_sector_bad(recovered_sector))
+        return false;
+
+    int32_t trimmed = read_flash_sector_trimmed(recovered_sector, 0, buf);
+    if (trimmed < 8 || trimmed > size)
+        return false;
+
+    uint32_t *words = (uint32_t *)buf;
+    if (words[0] != index || words[1] != (index ^ 0xffffffff))
+        return false;
+
+    flash_sector = recovered_sector;
+    flash_sector_initialized = 1;
+    return true;
+}
@@ -20,13 +20,45 @@
  */
 
 uint32_t get_buffer_to_post(uint32_t *index, uint32_t *start, uint8_t *buf);
+uint32_t get_buffer_to_post_after(uint32_t posted_index, uint32_t posted_size,
+                                  uint32_t *index, uint32_t *start, uint8_t *buf);
 void note_buffer_posted(uint32_t index, uint32_t size);
 uint32_t maybe_buffer_to_post();
+void get_buffer_posted(uint32_t *index, uint32_t *size);
+
+/* The size of the largest set of buffers the server can request be re-sent in
+ * a response, in bytes of a bitmap. */
+#define BUFFER_RESEND_BITMAP_SIZE 32
+
+void note_buffer_resend(uint32_t base, uint8_t *bitmap, uint32_t size);
+bool claim_buffer_resend(uint32_t index);
+uint32_t get_buffer_to_resend(uint32_t *index, uint8_t *buf);
+uint32_t buffers_to_post();
 
 uint32_t init_flash();
+bool flash_resume(uint32_t index, uint8_t *buf, uint32_t size);
 void flash_data(void *pvParameters);
 
 extern TaskHandle_t flash_data_task;
 
+extern uint32_t flash_write_failures;
+extern uint32_t flash_index_invalidate_failures;
+extern uint32_t flash_erases;
+
 uint32_t get_buffer_size(uint32_t requested_index, uint32_t *index);
-bool get_buffer_range(uint32_t index, uint32_t start, uint32_t end, uint8_t *buf);
+bool get_buffer_index_range(uint32_t *oldest, uint32_t *newest);
+
+/*
+ * A cursor for streaming reads of a range of a buffer, from memory if it is
+ * still held there, noted by a zero sector, otherwise from flash.
+ */
+typedef struct {
+    uint32_t index;
+    uint16_t sector;
+    uint32_t offset;
+    uint32_t end;
+} buffer_cursor_t;
+
+bool open_buffer_cursor(buffer_cursor_t *cursor, uint32_t index, uint32_t start,
+                        uint32_t end);
+int32_t read_buffer_cursor(buffer_cursor_t *cursor, uint8_t *buf, uint32_t size);
@@ -31,10 +31,125 @@
 #include "i2c/i2c.h"
 #include "i2c.h"
 #include "config.h"
+#include "leds.h"
 
 /* To synchronize access to the I2C interface. */
 SemaphoreHandle_t i2c_sem;
 
+/*
+ * The I2C sensors are run by a single scheduler task rather than a task per
+ * sensor. The sensors due at the same time are sampled in one session: each
+ * starts its conversion, the bus is released while the conversions run, and
+ * then each is read out, so the samples are aligned in time. The due times are
+ * kept on multiples of each sensor's period so that sensors with the same, or
+ * multiple, periods stay aligned. With only a few sensors a scan for the
+ * earliest due time is used.
+ */
+#define I2C_MAX_SENSORS 8
+
+static i2c_sensor_t *i2c_sensors[I2C_MAX_SENSORS];
+static uint32_t num_i2c_sensors;
+
+/* Add a sensor, before start_i2c_sensors(). */
+void add_i2c_sensor(i2c_sensor_t *sensor)
+{
+    if (num_i2c_sensors < I2C_MAX_SENSORS)
+        i2c_sensors[num_i2c_sensors++] = sensor;
+}
+
+static void i2c_sensor_task(void *pvParameters)
+{
+    TickType_t next[I2C_MAX_SENSORS];
+    uint32_t available = 0;
+    uint32_t i;
+
+    xSemaphoreTake(i2c_sem, portMAX_DELAY);
+    for (i = 0; i < num_i2c_sensors; i++) {
+        if (i2c_sensors[i]->init())
+            available |= 1 << i;
+    }
+    xSemaphoreGive(i2c_sem);
+
+    if (!available)
+        vTaskDelete(NULL);
+
+    TickType_t now = xTaskGetTickCount();
+    for (i = 0; i < num_i2c_sensors; i++) {
+        TickType_t period = i2c_sensors[i]->period / portTICK_PERIOD_MS;
+        next[i] = (now / period + 1) * period;
+    }
+
+    for (;;) {
+        /* Wait until the earliest due time. */
+        now = xTaskGetTickCount();
+        TickType_t delay = portMAX_DELAY;
+        for (i = 0; i < num_i2c_sensors; i++) {
+            if (available & (1 << i)) {
+                int32_t wait = next[i] - now;
+                if (wait < 0)
+                    wait = 0;
+                if (wait < delay)
+                    delay = wait;
+            }
+        }
+        if (delay > 0)
+            vTaskDelay(delay);
+        now = xTaskGetTickCount();
+
+        uint32_t pending = 0;
+        for (i = 0; i < num_i2c_sensors; i++) {
+            if ((available & (1 << i)) && (int32_t)(now - next[i]) >= 0) {
+                pending |= 1 << i;
+                TickType_t period = i2c_sensors[i]->period / portTICK_PERIOD_MS;
+                next[i] += period;
+                /* If delayed by more than a period then skip ahead. */
+                if ((int32_t)(now - next[i]) >= 0)
+                    next[i] = (now / period + 1) * period;
+            }
+        }
+
+        /* Step all the due sensors, in one bus session per step. */
+        uint32_t sampled = 0;
+        bool start = true;
+        while (pending) {
+            int32_t wait = 0;
+            xSemaphoreTake(i2c_sem, portMAX_DELAY);
+            for (i = 0; i < num_i2c_sensors; i++) {
+                if (pending & (1 << i)) {
+                    int32_t res = i2c_sensors[i]->sample(start);
+                    if (res <= 0) {
+                        pending &= ~(1 << i);
+                        if (res == 0)
+                            sampled |= 1 << i;
+                        else
+                            blink_red();
+                    } else if (res > wait) {
+                        wait = res;
+                    }
+                }
+            }
+            xSemaphoreGive(i2c_sem);
+            start = false;
+            if (pending)
+                vTaskDelay((wait + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS);
+        }
+
+        for (i = 0; i < num_i2c_sensors; i++) {
+            if (sampled & (1 << i))
+                i2c_sensors[i]->log();
+        }
+        if (sampled)
+            blink_green();
+    }
+}
+
+/* Start the scheduler task, after the sensors have been added. */
+void start_i2c_sensors()
+{
+    if (num_i2c_sensors > 0)
+        xTaskCreate(&i2c_sensor_task, "I2C sensors", 288, NULL, 2, NULL);
+}
+
 void init_i2c()
 {
     i2c_init(param_i2c_scl, param_i2c_sda);
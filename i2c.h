@@ -22,3 +22,25 @@
 extern SemaphoreHandle_t i2c_sem;
 
 void init_i2c();
+
+/*
+ * An I2C sensor run by the I2C scheduler task, see i2c.c. The init, and
+ * sample functions are called holding the i2c_sem, and the log function is
+ * called without it.
+ */
+typedef struct {
+    /* Detect and initialize the sensor, returning false if not available. */
+    bool (*init)();
+    /* Take a sample, in steps. Start is true for the first step. Returns the
+     * msec to wait before the next step, zero when the sample is complete, or
+     * -1 on failure. The bus is released during the wait so a step should start
+     * a conversion rather than busy-wait for it. */
+    int32_t (*sample)(bool start);
+    /* Log the last sample taken. */
+    void (*log)();
+    /* The sampling period in msec. */
+    uint32_t period;
+} i2c_sensor_t;
+
+void add_i2c_sensor(i2c_sensor_t *sensor);
+void start_i2c_sensors();
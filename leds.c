@@ -28,7 +28,10 @@ void init_blink()
 {
     switch (param_board) {
       case 0:
-          // Nodemcu
+          // Nodemcu. GPIO16 is connected to the reset pin to wake from a deep
+          // sleep in the low-power mode, so the LED is not usable then.
+          if (param_sleep_period)
+              break;
           gpio_enable(16, GPIO_OUTPUT);
           gpio_write(16, 1);
           break;
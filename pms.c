@@ -22,46 +22,155 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <esp/uart.h>
 #include <stdio.h>
+#include <espressif/esp_common.h>
 #include <espressif/esp_system.h>
 #include "FreeRTOS.h"
 #include "task.h"
+#include "semphr.h"
+#include "esp/gpio.h"
+#include "stdin_uart_interrupt/stdin_uart_interrupt.h"
 
 #include "buffer.h"
 #include "leds.h"
 #include "config.h"
+#include "stats.h"
 
 
 
-static uint8_t mygetc()
+/*
+ * The UART is read a whole frame at a time into the frame buffer. The
+ * stdin_uart_interrupt driver blocks the read until the requested number of
+ * bytes have been received, draining the UART FIFO on each interrupt, so the
+ * task only wakes when a complete frame is available rather than for every
+ * byte. The frame buffer holds the bytes read that have not yet been consumed
+ * and always starts at a possible "BM" header.
+ */
+#define PMS_FRAME_MAX (4 + 0x1c)
+
+/*
+ * When switching between two sensors, the period in msec to poll for
+ * received bytes, and the time in msec to wait for a frame before switching
+ * to the other sensor anyway. The sensors send a frame about every 0.8
+ * seconds, so the timeout allows for a missing frame or a missing sensor. */
+#define PMS_POLL_PERIOD 20
+#define PMS_SWITCH_TIMEOUT 2000
+
+/*
+ * The time in seconds after the SET pin wakes the sensors for the fan and laser
+ * to settle. Frames received within this time are read but not logged, as the
+ * readings are not yet stable. Nothing is skipped if the SET pin is not
+ * connected. */
+#define PMS_WAKE_SETTLE 30
+
+static bool pms_settling = false;
+static TickType_t pms_wake_time;
+
+static uint8_t frame[PMS_FRAME_MAX];
+static uint32_t frame_len = 0;
+
+/* Discard the first byte and then everything up to the next possible header. */
+static void pms_resync()
+{
+    uint32_t i;
+    for (i = 1; i < frame_len && frame[i] != 'B'; i++)
+        ;
+    memmove(frame, frame + i, frame_len - i);
+    frame_len -= i;
+}
+
+/* Discard a frame of the given size that has been processed. */
+static void pms_consume_frame(uint32_t size)
+{
+    memmove(frame, frame + size, frame_len - size);
+    frame_len -= size;
+}
+
+/*
+ * Read until the frame buffer starts with a frame with a "BM" header and a
+ * valid length, returning the size of the frame including the header. The
+ * checksum is not checked here.
+ *
+ * If timeout is non-zero then give up and return zero if there is no frame
+ * within timeout ticks. The read blocks until all the requested bytes are
+ * available, so in this case the bytes available are polled and only these
+ * are read.
+ */
+static uint32_t pms_read_frame(TickType_t timeout)
 {
-    uint8_t ch;
+    TickType_t start = xTaskGetTickCount();
+
     while (1) {
-        if (read(0, (void*)&ch, 1)) {
-            return ch;
+        uint32_t want = 4;
+
+        if ((frame_len >= 1 && frame[0] != 'B') ||
+            (frame_len >= 2 && frame[1] != 'M')) {
+            pms_resync();
+            continue;
+        }
+
+        if (frame_len >= 4) {
+            uint16_t length = frame[2] << 8 | frame[3];
+            if (length != 0x14 && length != 0x1c) {
+                pms_resync();
+                continue;
+            }
+            want = 4 + length;
+            if (frame_len >= want)
+                return want;
+        }
+
+        want -= frame_len;
+        if (timeout) {
+            uint32_t available = uart0_num_char();
+            if (available == 0) {
+                if (xTaskGetTickCount() - start >= timeout)
+                    return 0;
+                vTaskDelay(PMS_POLL_PERIOD / portTICK_PERIOD_MS);
+                continue;
+            }
+            if (want > available)
+                want = available;
         }
+
+        int n = read(0, (void *)(frame + frame_len), want);
+        if (n > 0)
+            frame_len += n;
     }
 }
 
+/* Return the 16 bit big endian value at offset i in the frame. */
+static int32_t frame_word(uint32_t i)
+{
+    return frame[i] << 8 | frame[i + 1];
+}
+
 
 /*
- * Variable bit length encoding support.
+ * Variable bit length encoding support. The bits are accumulated in a 64 bit
+ * word and written out 32 bits at a time, and finish_outbuf() writes the
+ * remaining whole bytes, discarding any final partial byte.
  */
 static uint8_t outbuf[256];
 static int noutbits;
-static uint32_t outbits;
+static uint64_t outbits;
 static int outlen;
 
+/* Emit up to 32 bits. */
 static void emitbits(uint32_t bits, uint8_t nbits)
 {
-    outbits |= bits << noutbits;
+    outbits |= (uint64_t)bits << noutbits;
     noutbits += nbits;
-    while (noutbits >= 8) {
-        outbuf[outlen++] = (unsigned char) (outbits & 0xFF);
-        outbits >>= 8;
-        noutbits -= 8;
+    if (noutbits >= 32) {
+        outbuf[outlen++] = outbits;
+        outbuf[outlen++] = outbits >> 8;
+        outbuf[outlen++] = outbits >> 16;
+        outbuf[outlen++] = outbits >> 24;
+        outbits >>= 32;
+        noutbits -= 32;
     }
 }
 
@@ -72,54 +181,119 @@ static void init_outbuf()
     outbits = 0;
 }
 
+static void finish_outbuf()
+{
+    while (noutbits >= 8) {
+        outbuf[outlen++] = outbits;
+        outbits >>= 8;
+        noutbits -= 8;
+    }
+}
+
 /*
- * Variable length encoded value for the PMS*003 events.
+ * Variable length encoded value for the PMS*003 events. The bits are emitted
+ * least significant first:
+ *
+ *   0 -> '1'
+ *  +1 -> '001'
+ *  -1 -> '011'
+ *  +2 to +32 -> '000 xxxxx'
+ *  -2 to -32 -> '010 xxxxx'
+ *  +33 to 65568 : '000 11111 xxxx xxxx xxxx xxxx'
+ *  -33 to 65568 : '010 11111 xxxx xxxx xxxx xxxx'
+ *
+ * The code words for -32 to +32 are in the var_int_codes table, indexed by
+ * the value plus 32, with the number of bits in the high byte and the bits in
+ * the low byte.
  */
 
+static const uint16_t var_int_codes[65] = {
+    0x08f2, 0x08ea, 0x08e2, 0x08da, 0x08d2, 0x08ca, 0x08c2, 0x08ba,
+    0x08b2, 0x08aa, 0x08a2, 0x089a, 0x0892, 0x088a, 0x0882, 0x087a,
+    0x0872, 0x086a, 0x0862, 0x085a, 0x0852, 0x084a, 0x0842, 0x083a,
+    0x0832, 0x082a, 0x0822, 0x081a, 0x0812, 0x080a, 0x0802, 0x0306,
+    0x0101, 0x0304, 0x0800, 0x0808, 0x0810, 0x0818, 0x0820, 0x0828,
+    0x0830, 0x0838, 0x0840, 0x0848, 0x0850, 0x0858, 0x0860, 0x0868,
+    0x0870, 0x0878, 0x0880, 0x0888, 0x0890, 0x0898, 0x08a0, 0x08a8,
+    0x08b0, 0x08b8, 0x08c0, 0x08c8, 0x08d0, 0x08d8, 0x08e0, 0x08e8,
+    0x08f0
+};
+
 static void emit_var_int(int32_t v)
 {
-    if (v == 0) {
-        /* 0 -> '1' */
-        emitbits(1, 1);
+    if (v >= -32 && v <= 32) {
+        uint16_t code = var_int_codes[v + 32];
+        emitbits(code & 0xff, code >> 8);
         return;
     }
 
-    emitbits(0, 1);
-
-    /* The sign bit. */
+    uint32_t sign = 0;
     if (v < 0) {
-        emitbits(1, 1);
+        sign = 1;
         v = -v;
-    } else {
-        emitbits(0, 1);
     }
 
-    if (v == 1) {
-        /* +1 -> '001'
-         * -1 -> '011'
-         */
-        emitbits(1, 1);
-        return;
-    }
+    /* The 16 bit unsigned value. */
+    emitbits(sign << 1 | 0x1f << 3 | ((v - 33) & 0xffff) << 8, 24);
+}
 
-    emitbits(0, 1);
+/*
+ * Adaptive Golomb-Rice encoding for the PMS*003 events, selected by
+ * param_pms_coding 1. Each field has its own model that tracks the mean
+ * magnitude of its recent deltas and chooses the Rice parameter k from this,
+ * so the code adapts to quiet and noisy periods and to the different ranges of
+ * each field. The models are reset along with the delta encoding state at the
+ * start of each new data buffer, so each buffer can still be decoded on its
+ * own.
+ *
+ * The delta v is first zigzag mapped to u, 0, -1, 1, -2, 2 ... to 0, 1, 2, 3,
+ * 4 ... and the quotient q = u >> k is emitted in unary as q '1' bits followed
+ * by a '0' bit, and then the low k bits of u. If q is RICE_ESCAPE or more then
+ * RICE_ESCAPE '1' bits are emitted followed by u in 18 bits. All bits are
+ * emitted least significant first.
+ *
+ * For a model with a sum a and count n, initially both zero, k is the smallest
+ * value for which (n + 1) << k >= a + 1, limited to RICE_MAX_K. After coding u
+ * the sum is increased by u and the count by one, and when the count reaches
+ * RICE_RESET both are halved so the model follows recent values.
+ */
+#define PMS_FIELDS 13
+#define RICE_ESCAPE 16
+#define RICE_MAX_K 15
+#define RICE_RESET 32
 
-    if (v < 33) {
-        /* +2 to +32 -> '000 xxxxx'
-         * -2 to -32 -> '010 xxxxx'
-         */
-        emitbits(v - 2, 5);
-        return;
+typedef struct {
+    uint32_t a[PMS_FIELDS];
+    uint8_t n[PMS_FIELDS];
+} pms_rice_t;
+
+static void emit_rice(pms_rice_t *rice, uint32_t field, int32_t v)
+{
+    uint32_t u = v < 0 ? ((uint32_t)-v << 1) - 1 : (uint32_t)v << 1;
+    uint32_t a = rice->a[field];
+    uint32_t n = rice->n[field];
+    uint32_t k;
+
+    for (k = 0; k < RICE_MAX_K && ((n + 1) << k) < a + 1; k++)
+        ;
+
+    uint32_t q = u >> k;
+    if (q < RICE_ESCAPE) {
+        emitbits((1 << q) - 1, q + 1);
+        emitbits(u & ((1 << k) - 1), k);
+    } else {
+        emitbits((1 << RICE_ESCAPE) - 1, RICE_ESCAPE);
+        emitbits(u & 0x3ffff, 18);
+    }
+
+    a += u;
+    n++;
+    if (n >= RICE_RESET) {
+        a >>= 1;
+        n >>= 1;
     }
-    
-    emitbits(0x1f, 5);
-        
-    /* 16 bit unsigned value:
-     *  +33 to 65568 : #x000 11111 xxxx xxxx xxxx xxxx
-     *  -33 to 65568 : #x010 11111 xxxx xxxx xxxx xxxx
-     */
-    v = v - 33;
-    emitbits(v & 0xffff, 16);
+    rice->a[field] = a;
+    rice->n[field] = n;
 }
 
 static bool pms_available = false;
@@ -159,144 +333,259 @@ bool pms_last_data(uint16_t *pm1a, uint16_t *pm25a, uint16_t *pm10a, uint16_t *p
  * The particle counter events are compressed. The prior event values are noted
  * here to support delta encoding, and initialized to zeros at the start of each
  * new data buffer so that each buffer can be decoded on its own.
+ *
+ * The values are held in the order they are encoded: pm1a, pm25ad, pm10ad,
+ * pm1b, pm25bd, pm10bd, c1d, c2d, c3d, c4d, c5d, c6, r1. The PMS3003 does not
+ * report c3d to c6 and they are not encoded in its events but are zero.
+ *
+ * There is separate state for each sensor when switching between two sensors.
  */
 
-static void pms_read_task(void *pvParameters)
-{
-    /* Delta encoding state. */
-    uint32_t last_index = 0;
-    int32_t last_pm1a = 0;
-    int32_t last_pm25ad = 0;
-    int32_t last_pm10ad = 0;
-    int32_t last_pm1b = 0;
-    int32_t last_pm25bd = 0;
-    int32_t last_pm10bd = 0;
-    int32_t last_c1d = 0;
-    int32_t last_c2d = 0;
-    int32_t last_c3d = 0;
-    int32_t last_c4d = 0;
-    int32_t last_c5d = 0;
-    int32_t last_c6 = 0;
-    int32_t last_r1 = 0;
+typedef struct {
+    uint32_t last_index;
+    int32_t last[PMS_FIELDS];
+    pms_rice_t rice;
+    /* Set once an event has been logged to this buffer, with the frame
+     * length and the low eight checksum bits of that event. */
+    bool have_last;
+    uint16_t last_length;
+    uint8_t last_checksum;
+} pms_state_t;
 
-    for (;;) {
-        /* Search for the "BM" header. */
-        uint8_t c = mygetc();
-        if (c != 'B')
-            continue;
-        
-        c = mygetc();
-        if (c != 'M')
-            continue;
+static pms_state_t pms_state[2];
 
-        /* Read the length. */
-        uint16_t msb = mygetc();
-        uint8_t lsb = mygetc();
-        uint16_t length = msb << 8 | lsb;
-        if (length != 0x14 && length != 0x1c)
-            continue;
+/* The fields of the PMS3003 events. */
+static const uint8_t pms3003_fields[] = {0, 1, 2, 3, 4, 5, 6, 7, 12};
 
-        uint16_t checksum = 143 + msb + lsb;
-
-        msb = mygetc();
-        lsb = mygetc();
-        checksum += msb + lsb;
-        int32_t pm1a = msb << 8 | lsb;
-
-        msb = mygetc();
-        lsb = mygetc();
-        checksum += msb + lsb;
-        int32_t pm25a = msb << 8 | lsb;
-        int32_t pm25ad = pm25a - pm1a;
-
-        msb = mygetc();
-        lsb = mygetc();
-        checksum += msb + lsb;
-        int32_t pm10a = msb << 8 | lsb;
-        int32_t pm10ad = pm10a - pm25a;
-
-        msb = mygetc();
-        lsb = mygetc();
-        checksum += msb + lsb;
-        int32_t pm1b = msb << 8 | lsb;
-
-        msb = mygetc();
-        lsb = mygetc();
-        checksum += msb + lsb;
-        int32_t pm25b = msb << 8 | lsb;
-        int32_t pm25bd = pm25b - pm1b;
-
-        msb = mygetc();
-        lsb = mygetc();
-        checksum += msb + lsb;
-        int32_t pm10b = msb << 8 | lsb;
-        int32_t pm10bd = pm10b - pm25b;
-
-        msb = mygetc();
-        lsb = mygetc();
-        checksum += msb + lsb;
-        int32_t c1 = msb << 8 | lsb;
-
-        msb = mygetc();
-        lsb = mygetc();
-        checksum += msb + lsb;
-        int32_t c2 = msb << 8 | lsb;
-
-        int32_t c1d = c1 - c2;
-
-        int32_t c3 = 0;
-        int32_t c4 = 0;
-        int32_t c5 = 0;
-        int32_t c6 = 0;
-
-        if (length == 0x1c) {
-            msb = mygetc();
-            lsb = mygetc();
-            checksum += msb + lsb;
-            c3 = msb << 8 | lsb;
-
-            msb = mygetc();
-            lsb = mygetc();
-            checksum += msb + lsb;
-            c4 = msb << 8 | lsb;
-
-            msb = mygetc();
-            lsb = mygetc();
-            checksum += msb + lsb;
-            c5 = msb << 8 | lsb;
-
-            msb = mygetc();
-            lsb = mygetc();
-            checksum += msb + lsb;
-            c6 = msb << 8 | lsb;
-        }
+/*
+ * In clean air the sensors often report the same values frame after frame. A
+ * frame with the same values as the last event logged to the buffer for the
+ * sensor is held as a repeat rather than logged, and a run of repeats is
+ * logged as a single DBUF_EVENT_PMS_REPEAT event when the values change, or
+ * after a bounded number of repeats, or when the buffer is sealed, see
+ * dbuf_hold_repeat().
+ */
 
-        int32_t c2d = c2 - c3;
+/*
+ * Log an event with the given values, the frame length, and the frame
+ * checksum, for the sensor number.
+ */
+static void pms_append_values(pms_state_t *state, uint32_t sensor,
+                              uint16_t length, int32_t *values,
+                              uint16_t checksum)
+{
+    uint32_t nfields = length == 0x1c ? PMS_FIELDS : sizeof(pms3003_fields);
+    bool adaptive = param_pms_coding == 1;
+    pms_rice_t rice;
 
-        int32_t c3d = 0;
-        int32_t c4d = 0;
-        int32_t c5d = 0;
-        
-        if (length == 0x1c) {
-            c3d = c3 - c4;
-            c4d = c4 - c5;
-            c5d = c5 - c6;
+    while (1) {
+        /* Variable length encoding. The adaptive models are updated in a
+         * copy that is only committed if the event is appended to the same
+         * buffer. */
+        init_outbuf();
+        if (adaptive)
+            rice = state->rice;
+        uint32_t i;
+        for (i = 0; i < nfields; i++) {
+            uint32_t field = length == 0x1c ? i : pms3003_fields[i];
+            int32_t delta = values[field] - state->last[field];
+            if (adaptive)
+                emit_rice(&rice, i, delta);
+            else
+                emit_var_int(delta);
+        }
+
+        /* Emit at least eight bits of the device supplied checksum and fill
+         * to a byte boundary with the rest so there will always be at least
+         * eight checksum bits and often more and at most 15 bits. */
+        emitbits(checksum, 15);
+        finish_outbuf();
+
+        int len = outlen;
+        int32_t code;
+        if (adaptive) {
+            if (sensor == 0)
+                code = length == 0x14 ? DBUF_EVENT_PMS3003_RICE : DBUF_EVENT_PMS5003_RICE;
+            else
+                code = length == 0x14 ? DBUF_EVENT_PMS3003_RICE_2 : DBUF_EVENT_PMS5003_RICE_2;
+        } else if (sensor == 0) {
+            code = length == 0x14 ? DBUF_EVENT_PMS3003 : DBUF_EVENT_PMS5003;
+        } else {
+            code = length == 0x14 ? DBUF_EVENT_PMS3003_2 : DBUF_EVENT_PMS5003_2;
         }
+        uint32_t new_index = dbuf_append(state->last_index, code, outbuf, len, 1, 0);
+        if (new_index == state->last_index)
+            break;
+
+        /* Moved on to a new buffer. Reset the delta encoding state and
+         * retry. */
+        memset(state, 0, sizeof(pms_state_t));
+        state->last_index = new_index;
+    };
+
+    /* Commit the values logged. Note this is the only task accessing this
+     * state so these updates are synchronized with the last event of this
+     * class append. */
+    memcpy(state->last, values, sizeof(state->last));
+    if (adaptive)
+        state->rice = rice;
+    state->have_last = true;
+    state->last_length = length;
+    state->last_checksum = checksum;
+}
 
-        msb = mygetc();
-        lsb = mygetc();
-        checksum += msb + lsb;
-        int32_t r1 = msb << 8 | lsb;
+/*
+ * When param_pms_period is set the frames are not logged individually, rather
+ * the minimum, mean, and maximum of each value over a window of that many
+ * seconds is logged as a DBUF_EVENT_PMS_AGGREGATE event. The window is ended
+ * early if the frame length changes.
+ *
+ * The event has the frame length as a byte, then the leb128 encoded number of
+ * frames and the window duration up to the event time in units of 8192 RTC
+ * ticks. Then for each of the values pm1a, pm25a, pm10a, pm1b, pm25b, pm10b,
+ * c1, c2, and for the PMS5003 also c3, c4, c5, c6, the leb128 encoded minimum,
+ * the mean less the minimum, and the maximum less the mean. The mean is
+ * rounded. These are not delta encoded between events so there is no state to
+ * reset on a new buffer.
+ */
+#define PMS_AGGREGATE_FIELDS 12
+
+typedef struct {
+    uint32_t last_index;
+    uint32_t count;
+    uint16_t length;
+    uint32_t start_time;
+    TickType_t start_tick;
+    uint16_t min[PMS_AGGREGATE_FIELDS];
+    uint16_t max[PMS_AGGREGATE_FIELDS];
+    uint32_t sum[PMS_AGGREGATE_FIELDS];
+} pms_aggregate_t;
+
+static pms_aggregate_t pms_aggregate[2];
+
+static void pms_flush_aggregate(pms_aggregate_t *aggregate, uint32_t sensor)
+{
+    if (aggregate->count == 0)
+        return;
 
-        msb = mygetc();
-        lsb = mygetc();
-        uint16_t expected_checksum = msb << 8 | lsb;
+    uint32_t nfields = aggregate->length == 0x1c ? PMS_AGGREGATE_FIELDS : 8;
+    uint32_t count = aggregate->count;
+    uint32_t time = RTC.COUNTER;
+    outbuf[0] = aggregate->length;
+    outlen = emit_leb128(outbuf, 1, count);
+    outlen = emit_leb128(outbuf, outlen, (time - aggregate->start_time) >> 13);
+    uint32_t i;
+    for (i = 0; i < nfields; i++) {
+        uint32_t mean = (aggregate->sum[i] + count / 2) / count;
+        outlen = emit_leb128(outbuf, outlen, aggregate->min[i]);
+        outlen = emit_leb128(outbuf, outlen, mean - aggregate->min[i]);
+        outlen = emit_leb128(outbuf, outlen, aggregate->max[i] - mean);
+    }
 
-        if (checksum != expected_checksum) {
-            blink_red();
-            continue;
+    int32_t code = sensor == 0 ? DBUF_EVENT_PMS_AGGREGATE : DBUF_EVENT_PMS_AGGREGATE_2;
+    while (1) {
+        uint32_t new_index = dbuf_append(aggregate->last_index, code, outbuf, outlen, 1, 0);
+        if (new_index == aggregate->last_index)
+            break;
+        aggregate->last_index = new_index;
+    }
+
+    aggregate->count = 0;
+}
+
+static void pms_aggregate_frame(uint32_t sensor, uint16_t length,
+                                uint16_t *values)
+{
+    pms_aggregate_t *aggregate = &pms_aggregate[sensor];
+
+    if (aggregate->count > 0 && length != aggregate->length)
+        pms_flush_aggregate(aggregate, sensor);
+
+    uint32_t i;
+    if (aggregate->count == 0) {
+        aggregate->length = length;
+        aggregate->start_time = RTC.COUNTER;
+        aggregate->start_tick = xTaskGetTickCount();
+        for (i = 0; i < PMS_AGGREGATE_FIELDS; i++) {
+            aggregate->min[i] = values[i];
+            aggregate->max[i] = values[i];
+            aggregate->sum[i] = 0;
         }
+    }
+
+    for (i = 0; i < PMS_AGGREGATE_FIELDS; i++) {
+        if (values[i] < aggregate->min[i])
+            aggregate->min[i] = values[i];
+        if (values[i] > aggregate->max[i])
+            aggregate->max[i] = values[i];
+        aggregate->sum[i] += values[i];
+    }
+    aggregate->count++;
+
+    if (xTaskGetTickCount() - aggregate->start_tick >=
+        param_pms_period * 1000 / portTICK_PERIOD_MS)
+        pms_flush_aggregate(aggregate, sensor);
+}
 
+/*
+ * The logging state above is accessed by the PMS reader task, and by
+ * pms_flush() before a sleep, holding the pms_sem.
+ */
+static SemaphoreHandle_t pms_sem;
+
+/*
+ * Decode and log the frame of the given size at the start of the frame
+ * buffer, for the sensor number. The checksum has already been checked.
+ */
+static void pms_log_frame(uint32_t size, uint32_t sensor)
+{
+    pms_state_t *state = &pms_state[sensor];
+    uint16_t length = frame_word(2);
+    uint16_t expected_checksum = frame_word(size - 2);
+
+    int32_t pm1a = frame_word(4);
+    int32_t pm25a = frame_word(6);
+    int32_t pm25ad = pm25a - pm1a;
+    int32_t pm10a = frame_word(8);
+    int32_t pm10ad = pm10a - pm25a;
+    int32_t pm1b = frame_word(10);
+    int32_t pm25b = frame_word(12);
+    int32_t pm25bd = pm25b - pm1b;
+    int32_t pm10b = frame_word(14);
+    int32_t pm10bd = pm10b - pm25b;
+    int32_t c1 = frame_word(16);
+    int32_t c2 = frame_word(18);
+
+    int32_t c1d = c1 - c2;
+
+    int32_t c3 = 0;
+    int32_t c4 = 0;
+    int32_t c5 = 0;
+    int32_t c6 = 0;
+
+    if (length == 0x1c) {
+        c3 = frame_word(20);
+        c4 = frame_word(22);
+        c5 = frame_word(24);
+        c6 = frame_word(26);
+    }
+
+    int32_t c2d = c2 - c3;
+
+    int32_t c3d = 0;
+    int32_t c4d = 0;
+    int32_t c5d = 0;
+
+    if (length == 0x1c) {
+        c3d = c3 - c4;
+        c4d = c4 - c5;
+        c5d = c5 - c6;
+    }
+
+    int32_t r1 = frame_word(size - 4);
+
+    /* The web interface shows the first sensor. */
+    if (sensor == 0) {
         pms_available = true;
         pms_pm1a = pm1a;
         pms_pm25a = pm25a;
@@ -311,78 +600,168 @@ static void pms_read_task(void *pvParameters)
         pms_c5 = c5;
         pms_c6 = c6;
         pms_r1 = r1;
+    }
 
-        while (1) {
-            /* Variable length encoding. */
-            init_outbuf();
-            emit_var_int(pm1a - last_pm1a);
-            emit_var_int(pm25ad - last_pm25ad);
-            emit_var_int(pm10ad - last_pm10ad);
-            emit_var_int(pm1b - last_pm1b);
-            emit_var_int(pm25bd - last_pm25bd);
-            emit_var_int(pm10bd - last_pm10bd);
-            emit_var_int(c1d - last_c1d);
-            emit_var_int(c2d - last_c2d);
-            if (length == 0x1c) {
-                emit_var_int(c3d - last_c3d);
-                emit_var_int(c4d - last_c4d);
-                emit_var_int(c5d - last_c5d);
-                emit_var_int(c6 - last_c6);
+    if (param_pms_period) {
+        uint16_t raw[PMS_AGGREGATE_FIELDS] = {pm1a, pm25a, pm10a, pm1b, pm25b,
+                                              pm10b, c1, c2, c3, c4, c5, c6};
+        pms_aggregate_frame(sensor, length, raw);
+        blink_green();
+        return;
+    }
+
+    int32_t values[PMS_FIELDS] = {pm1a, pm25ad, pm10ad, pm1b, pm25bd, pm10bd,
+                                  c1d, c2d, c3d, c4d, c5d, c6, r1};
+
+    uint16_t code = sensor == 0 ? DBUF_EVENT_PMS_REPEAT : DBUF_EVENT_PMS_REPEAT_2;
+    if (state->have_last && length == state->last_length &&
+        memcmp(values, state->last, sizeof(values)) == 0) {
+        /* Hold a repeat of the last event. */
+        uint32_t new_index = dbuf_hold_repeat(state->last_index, code,
+                                              state->last_checksum,
+                                              expected_checksum);
+        if (new_index == state->last_index) {
+            state->last_checksum = expected_checksum;
+        } else {
+            /* Moved on to a new buffer, so log it in full. */
+            memset(state, 0, sizeof(pms_state_t));
+            state->last_index = new_index;
+            pms_append_values(state, sensor, length, values, expected_checksum);
+        }
+    } else {
+        dbuf_flush_repeat(code);
+        pms_append_values(state, sensor, length, values, expected_checksum);
+    }
+
+    blink_green();
+}
+
+/*
+ * Switch the UART0 receive pin to the given sensor, 0 for GPIO3 and 1 for the
+ * swapped pins GPIO13. Bytes received from the prior sensor are discarded,
+ * those in the hardware FIFO and those the stdin_uart_interrupt handler has
+ * already moved to its ring buffer, otherwise a frame from the prior sensor
+ * could be logged for this sensor.
+ */
+static void pms_select_sensor(uint32_t sensor)
+{
+    if (sensor == 0)
+        sdk_system_uart_de_swap();
+    else
+        sdk_system_uart_swap();
+    uart_flush_rxfifo(0);
+
+    uint32_t available = uart0_num_char();
+    while (available > 0) {
+        uint32_t want = available < PMS_FRAME_MAX ? available : PMS_FRAME_MAX;
+        int n = read(0, (void *)frame, want);
+        if (n <= 0)
+            break;
+        available -= n;
+    }
+    frame_len = 0;
+}
+
+/*
+ * When there are two sensors, param_pms_uart 3, the UART0 receive pin is
+ * switched between them on frame boundaries. The sensors send a frame about
+ * every 0.8 seconds and a frame takes about 33 msec to receive at 9600 baud,
+ * so switching immediately after each complete frame typically loses only a
+ * frame in progress on the other sensor, and usually none. If no frame is
+ * received from a sensor within PMS_SWITCH_TIMEOUT then switch anyway, so a
+ * missing sensor does not stop the logging of the other.
+ */
+static void pms_read_task(void *pvParameters)
+{
+    bool dual = param_pms_uart == 3;
+    uint32_t sensor = 0;
+
+    if (dual)
+        pms_select_sensor(sensor);
+
+    for (;;) {
+        uint32_t size = pms_read_frame(dual ? PMS_SWITCH_TIMEOUT / portTICK_PERIOD_MS : 0);
+
+        if (size > 0) {
+            /* The checksum covers all the bytes before it, including the
+             * header. */
+            uint16_t checksum = 0;
+            uint32_t i;
+            for (i = 0; i < size - 2; i++)
+                checksum += frame[i];
+            uint16_t expected_checksum = frame_word(size - 2);
+
+            if (checksum != expected_checksum) {
+                /* The header might have been a false match within the data,
+                 * so resync from the next byte rather than discarding the
+                 * frame. */
+                pms_resync();
+                stat_pms_checksum_failures++;
+                blink_red();
+                continue;
             }
-            emit_var_int(r1 - last_r1);
-            
-            /* Emit at least eight bits of the device supplied checksum and fill
-             * to a byte boundary with the rest so there will always be at least
-             * eight checksum bits and often more and at most 15 bits. */
-            emitbits(expected_checksum, 15);
-
-            int len = outlen;
-            int32_t code = length == 0x14 ? DBUF_EVENT_PMS3003 : DBUF_EVENT_PMS5003;
-            uint32_t new_index = dbuf_append(last_index, code, outbuf, len, 1, 0);
-            if (new_index == last_index)
-                break;
-
-            /* Moved on to a new buffer. Reset the delta encoding state and
-             * retry. */
-            last_index = new_index;
-            last_pm1a = 0;
-            last_pm25ad = 0;
-            last_pm10ad = 0;
-            last_pm1b = 0;
-            last_pm25bd = 0;
-            last_pm10bd = 0;
-            last_c1d = 0;
-            last_c2d = 0;
-            last_c3d = 0;
-            last_c4d = 0;
-            last_c5d = 0;
-            last_c6 = 0;
-            last_r1 = 0;
-        };
 
-        blink_green();
-        
-        /* Commit the values logged. Note this is the only task accessing this
-         * state so these updates are synchronized with the last event of this
-         * class append. */
-        last_pm1a = pm1a;
-        last_pm25ad = pm25ad;
-        last_pm10ad = pm10ad;
-        last_pm1b = pm1b;
-        last_pm25bd = pm25bd;
-        last_pm10bd = pm10bd;
-        last_c1d = c1d;
-        last_c2d = c2d;
-        last_c3d = c3d;
-        last_c4d = c4d;
-        last_c5d = c5d;
-        last_c6 = c6;
-        last_r1 = r1;
+            if (pms_settling &&
+                xTaskGetTickCount() - pms_wake_time >= PMS_WAKE_SETTLE * 1000 / portTICK_PERIOD_MS)
+                pms_settling = false;
+
+            if (!pms_settling) {
+                xSemaphoreTake(pms_sem, portMAX_DELAY);
+                pms_log_frame(size, sensor);
+                xSemaphoreGive(pms_sem);
+            }
+            pms_consume_frame(size);
+        }
+
+        if (dual) {
+            sensor ^= 1;
+            pms_select_sensor(sensor);
+        }
+    }
+}
+
+/*
+ * Put the sensors to sleep, or wake them, using the SET pin if connected. The
+ * fan and laser are off while sleeping, and the sensor needs about 30 seconds
+ * after waking for the readings to be stable, so the frames are not logged for
+ * PMS_WAKE_SETTLE seconds after waking.
+ */
+void pms_set_sleep(bool sleep)
+{
+    if (param_pms_set_pin < 17) {
+        gpio_write(param_pms_set_pin, !sleep);
+        if (!sleep) {
+            pms_wake_time = xTaskGetTickCount();
+            pms_settling = true;
+        }
     }
 }
 
+/*
+ * Log the repeats and the aggregate held for each sensor, so that none are lost
+ * over a sleep. Called after the sampling is done for the wake and before
+ * flushing the buffers.
+ */
+void pms_flush()
+{
+    xSemaphoreTake(pms_sem, portMAX_DELAY);
+    uint32_t sensor;
+    for (sensor = 0; sensor < 2; sensor++) {
+        dbuf_flush_repeat(sensor == 0 ? DBUF_EVENT_PMS_REPEAT : DBUF_EVENT_PMS_REPEAT_2);
+        pms_flush_aggregate(&pms_aggregate[sensor], sensor);
+    }
+    xSemaphoreGive(pms_sem);
+}
+
 void init_pms()
 {
+    pms_sem = xSemaphoreCreateMutex();
+
+    if (param_pms_set_pin < 17) {
+        gpio_enable(param_pms_set_pin, GPIO_OUTPUT);
+        pms_set_sleep(false);
+    }
+
     if (param_pms_uart) {
         if (param_pms_uart == 2) {
             /* For the benefit of the nodemcu board allow swapping uart0 pins. */
@@ -21,6 +21,7 @@
  */
 #include "espressif/esp_common.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
@@ -39,6 +40,7 @@
 #include "flash.h"
 #include "sha3.h"
 #include "ds3231.h"
+#include "stats.h"
 
 #include "config.h"
 
@@ -47,27 +49,505 @@
 TaskHandle_t post_data_task = NULL;
 
 /*
- * A single buffer is allocated to hold the HTTP data to be sent and it is large
+ * Two buffers are allocated to hold the HTTP data to be sent and each is large
  * enough for the HTTP header plus the content including a signature suffix. The
  * content is located at a fixed position into the buffer and word aligned so
- * the flash data can be copied directly to this buffer. For the computation of
- * a MAC-SHA3 signature the key prefix is copied before the data so the prefix
- * allocation needs to be large enough for this too.
+ * the flash data can be copied directly to this buffer. While waiting for the
+ * response to the post of one buffer the next is read and signed in the other,
+ * so that a backlog is posted at the rate of the link rather than also waiting
+ * on the flash reads and the signatures.
+ *
+ * The MAC-SHA3 signature is the SHA3-224 of the key followed by the
+ * content. The sponge state after absorbing the key is computed once, in
+ * init_post(), and copied for each signature so only the content needs to be
+ * absorbed.
  */
 
 #define SIGNATURE_SIZE 28
 
-#define PREFIX_SIZE 288 /* At least key_size */
+#define PREFIX_SIZE 192 /* At least the HTTP header size */
 #define POST_BUFFER_SIZE (PREFIX_SIZE + 4 + 4 + 4 + 4 + 4096 + SIGNATURE_SIZE)
-static uint8_t post_buf[POST_BUFFER_SIZE];
+
+typedef struct {
+    uint8_t buf[POST_BUFFER_SIZE];
+    /* The buffer index, and the start and size of the content posted. */
+    uint32_t index;
+    uint32_t start;
+    uint32_t size;
+    /* The local time posted, which the server response magic includes. This
+     * is the time the request was prepared and signed, which for a prefetched
+     * request is up to a round trip before it is sent. */
+    uint32_t time;
+    /* The local time the request was sent. */
+    uint32_t send_time;
+    uint32_t header_size;
+    /* Set if re-sending a buffer requested by the server. */
+    uint32_t resend;
+    /* The position expected to be acknowledged by the server in response,
+     * which is not moved by a re-sent buffer. */
+    uint32_t posted_index;
+    uint32_t posted_size;
+} post_request_t;
+
+static post_request_t post_requests[2];
+
+static KeccakSponge key_sponge;
+static KeccakSponge post_sponge;
 
 #define MAX_HOLD_OFF_TIME 1800000 /* 30 minutes */
 
-static void post_data(void *pvParameters)
+/*
+ * The connection to the server is kept open to post multiple buffers, to avoid
+ * the cost of a DNS lookup and a TCP connection for every buffer when there is
+ * a backlog. Each post is still a separate signed request and the server
+ * acknowledges each in its response. The connection is closed when there is
+ * nothing more to post, after POST_BATCH_SIZE posts, or if the server will not
+ * keep the connection open.
+ */
+#define POST_BATCH_SIZE 64
+
+/*
+ * Read a HTTP response. The body is read into buf up to buf_size bytes and the
+ * remainder is discarded. Returns the number of body bytes stored in buf, or -1
+ * on failure. The keep_alive flag is cleared if the server will close the
+ * connection after this response.
+ *
+ * The headers are processed a line at a time, and only the start of each line
+ * is retained as only the Content-Length and Connection headers are of
+ * interest. Without a Content-Length the body extends to the close of the
+ * connection.
+ */
+static int read_response(int s, uint8_t *buf, int buf_size, int *keep_alive)
+{
+    char chunk[64];
+    char line[32];
+    int line_len = 0;
+    int status_line = 1;
+    int in_headers = 1;
+    int content_length = -1;
+    int body_size = 0;
+
+    while (in_headers || content_length < 0 || body_size < content_length) {
+        int r = read(s, chunk, sizeof(chunk));
+        if (r <= 0) {
+            if (r == 0 && !in_headers && content_length < 0) {
+                /* The body extended to the close of the connection. */
+                *keep_alive = 0;
+                break;
+            }
+            return -1;
+        }
+
+        int i;
+        for (i = 0; i < r; i++) {
+            char c = chunk[i];
+            if (!in_headers) {
+                if (body_size < buf_size)
+                    buf[body_size] = c;
+                body_size++;
+                continue;
+            }
+            if (c != '\n') {
+                if (c != '\r' && line_len < sizeof(line) - 1)
+                    line[line_len++] = c;
+                continue;
+            }
+            line[line_len] = 0;
+            if (line_len == 0) {
+                /* End of the headers. */
+                in_headers = 0;
+            } else if (status_line) {
+                /* HTTP/1.0 closes the connection by default. */
+                if (strncmp(line, "HTTP/1.0", 8) == 0)
+                    *keep_alive = 0;
+                status_line = 0;
+            } else if (strncasecmp(line, "Content-Length:", 15) == 0) {
+                content_length = strtol(line + 15, NULL, 10);
+            } else if (strncasecmp(line, "Connection:", 11) == 0) {
+                char *value = line + 11;
+                while (*value == ' ')
+                    value++;
+                if (strncasecmp(value, "close", 5) == 0)
+                    *keep_alive = 0;
+            }
+            line_len = 0;
+        }
+    }
+
+    return body_size < buf_size ? body_size : buf_size;
+}
+
+/*
+ * The resolved server address is cached to avoid a DNS lookup for every
+ * connection. The lookup does not give the record TTL, so the address is
+ * re-resolved after DNS_CACHE_TTL msec, or after a connection failure. If the
+ * server IP address is configured then this is used and DNS is not used.
+ */
+#define DNS_CACHE_TTL 3600000 /* 1 hour */
+
+static struct sockaddr_in server_addr;
+static int server_addr_valid = 0;
+static TickType_t server_addr_time;
+
+/* Set the server_addr, returning 1 on success and 0 on failure. */
+static int resolve_server()
+{
+    if (param_web_ip) {
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(strtol(param_web_port, NULL, 10));
+        if (!inet_aton(param_web_ip, &server_addr.sin_addr))
+            return 0;
+        return 1;
+    }
+
+    if (server_addr_valid &&
+        xTaskGetTickCount() - server_addr_time < DNS_CACHE_TTL / portTICK_PERIOD_MS) {
+        return 1;
+    }
+
+    const struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *res;
+
+    int err = getaddrinfo(param_web_server, param_web_port, &hints, &res);
+    if (err != 0 || res == NULL) {
+        if (res)
+            freeaddrinfo(res);
+        /* Fall back to a stale address rather than failing, as the DNS
+         * might be failing while the server is still reachable. A
+         * connection failure invalidates the address. */
+        return server_addr_valid;
+    }
+
+    memcpy(&server_addr, res->ai_addr, sizeof(server_addr));
+    server_addr_valid = 1;
+    server_addr_time = xTaskGetTickCount();
+    freeaddrinfo(res);
+    return 1;
+}
+
+static uint32_t last_index = 0;
+static uint32_t last_recv_sec = 0;
+
+/*
+ * Read and sign the next content to post into the request. The buffers the
+ * server requested be re-sent are posted first. Otherwise if prior is NULL
+ * then this is the content following the position last acknowledged by the
+ * server, otherwise the content following the prior request assuming that it
+ * will be acknowledged. Returns the size of the content, or zero if there is
+ * nothing to post.
+ */
+static uint32_t prepare_post(post_request_t *req, post_request_t *prior)
 {
-    uint32_t last_index = 0;
-    uint32_t last_recv_sec = 0;
+    uint8_t *post_buf = req->buf;
+    uint32_t start, index;
+    int j;
+
+    /*
+     * The buffer to copy the data into needs to be aligned because
+     * reading the flash copies directly into it the buffer.
+     */
+    uint32_t posted_index, posted_size;
+    if (prior) {
+        posted_index = prior->posted_index;
+        posted_size = prior->posted_size;
+    } else {
+        get_buffer_posted(&posted_index, &posted_size);
+    }
+
+    uint32_t size = get_buffer_to_resend(&index, &post_buf[PREFIX_SIZE + 16]);
+    if (size > 0) {
+        start = 0;
+        req->resend = 1;
+    } else {
+        if (prior)
+            size = get_buffer_to_post_after(posted_index, posted_size, &index,
+                                            &start, &post_buf[PREFIX_SIZE + 16]);
+        else
+            size = get_buffer_to_post(&index, &start, &post_buf[PREFIX_SIZE + 16]);
+        req->resend = 0;
+        posted_index = index;
+        posted_size = start + size;
+    }
 
+    if (size == 0)
+        return 0;
+
+    /*
+     * The sensor ID, and the index of the record, the local time, and
+     * the index at which this content starts within the record are
+     * prefixed.
+     */
+    post_buf[PREFIX_SIZE + 0] = param_sensor_id;
+    post_buf[PREFIX_SIZE + 1] = param_sensor_id >>  8;
+    post_buf[PREFIX_SIZE + 2] = param_sensor_id >> 16;
+    post_buf[PREFIX_SIZE + 3] = param_sensor_id >> 24;
+
+    uint32_t time = RTC.COUNTER;
+    post_buf[PREFIX_SIZE + 4] = time;
+    post_buf[PREFIX_SIZE + 5] = time >>  8;
+    post_buf[PREFIX_SIZE + 6] = time >> 16;
+    post_buf[PREFIX_SIZE + 7] = time >> 24;
+
+    post_buf[PREFIX_SIZE + 8] = index;
+    post_buf[PREFIX_SIZE + 9] = index >>  8;
+    post_buf[PREFIX_SIZE + 10] = index >> 16;
+    post_buf[PREFIX_SIZE + 11] = index >> 24;
+
+    post_buf[PREFIX_SIZE + 12] = start;
+    post_buf[PREFIX_SIZE + 13] = start >>  8;
+    post_buf[PREFIX_SIZE + 14] = start >> 16;
+    post_buf[PREFIX_SIZE + 15] = start >> 24;
+
+    /*
+     * Sign the content, continuing from the key_sponge.
+     */
+    memcpy(&post_sponge, &key_sponge, sizeof(post_sponge));
+    Keccak_Absorb(&post_sponge, &post_buf[PREFIX_SIZE], 16 + size);
+    FIPS202_SHA3_224_Final(&post_sponge, &post_buf[PREFIX_SIZE + 16 + size]);
+
+    /*
+     * Use the prefix area for the HTTP header. HTTP/1.1 connections are
+     * persistent by default.
+     */
+    uint32_t header_size = snprintf((char *)post_buf, PREFIX_SIZE,
+                                    "POST %s HTTP/1.1\r\n"
+                                    "Host: %s:%s\r\n"
+                                    "Content-Type: application/octet-stream\r\n"
+                                    "Content-Length: %d\r\n"
+                                    "\r\n", param_web_path, param_web_server,
+                                    param_web_port, 16 + size + SIGNATURE_SIZE);
+    if (header_size >= PREFIX_SIZE)
+        return 0;
+    /*
+     * Move the header up to meet the data.
+     */
+    for (j = 0; j < header_size; j++)
+        post_buf[PREFIX_SIZE - j - 1] = post_buf[header_size - j - 1];
+
+    req->index = index;
+    req->start = start;
+    req->size = size;
+    req->time = time;
+    req->header_size = header_size;
+    req->posted_index = posted_index;
+    req->posted_size = posted_size;
+    return size;
+}
+
+/* The time the last request was sent, for the round-trip time statistic. */
+static uint32_t post_start;
+
+/* Send a prepared request. Returns 0 on success, or -1 on failure. */
+static int send_post(int s, post_request_t *req)
+{
+    uint32_t total = req->header_size + 16 + req->size + SIGNATURE_SIZE;
+
+    post_start = sdk_system_get_time();
+    req->send_time = RTC.COUNTER;
+    if (write(s, &req->buf[PREFIX_SIZE - req->header_size], total) < 0)
+        return -1;
+    stat_post_bytes += total;
+    return 0;
+}
+
+/*
+ * Read and handle the response to the request sent. Returns 1 if the post was
+ * acknowledged, and -1 on failure in which case the connection should be
+ * closed.
+ *
+ * The response has 20 bytes: a magic number, the server time in seconds and
+ * usec, and the buffer index and size to continue posting from. This may be
+ * followed by the set of buffers the server requests be re-sent, as a base
+ * index and then a bitmap of up to BUFFER_RESEND_BITMAP_SIZE bytes, with bit
+ * n of byte m for the index base + m * 8 + n. This allows the server to
+ * recover lost buffers without rewinding the position and re-sending all the
+ * buffers after those lost. Each response replaces the set, so a response
+ * without this extension clears it. Larger responses are accepted for future
+ * extension.
+ */
+static int read_post_response(int s, post_request_t *req, int *keep_alive)
+{
+    /* There is a magic number that indicates a successful response which is
+     * checked. */
+    uint8_t recv_buf[24 + BUFFER_RESEND_BITMAP_SIZE];
+    int recv_len = read_response(s, recv_buf, sizeof(recv_buf), keep_alive);
+    if (recv_len < 20)
+        return -1;
+    /* The round-trip time, from sending to the response. */
+    stat_time_note(&stat_post, post_start, sdk_system_get_time());
+
+    uint32_t recv_magic = recv_buf[0] |
+        (recv_buf[1] << 8) |
+        (recv_buf[2] << 16) |
+        (recv_buf[3] << 24);
+    uint32_t recv_sec = recv_buf[4] |
+        (recv_buf[5] << 8) |
+        (recv_buf[6] << 16) |
+        (recv_buf[7] << 24);
+    uint32_t recv_usec = recv_buf[8] |
+        (recv_buf[9] << 8) |
+        (recv_buf[10] << 16) |
+        (recv_buf[11] << 24);
+    uint32_t recv_index = recv_buf[12] |
+        (recv_buf[13] << 8) |
+        (recv_buf[14] << 16) |
+        (recv_buf[15] << 24);
+    uint32_t recv_size = recv_buf[16] |
+        (recv_buf[17] << 8) |
+        (recv_buf[18] << 16) |
+        (recv_buf[19] << 24);
+
+    uint32_t time = req->time;
+    uint32_t magic = param_sensor_id ^ time;
+    if (recv_magic != magic)
+        return -1;
+
+    /*
+     * Update the clock using the server response time.
+     */
+    ds3231_note_time(recv_sec);
+
+    /* Log the server time in it's response. This gives time stamps to the
+     * events logged to help synchronize the RTC counter to the real
+     * time. While the server could log the times to synchronize to the RTC
+     * counter, this gives some resilience against server data loss and allows
+     * the sectors recorded to stand on their own.
+     *
+     * The event time-stamp is close enough to the received time, and includes
+     * the posted time too to allow matching with the server recorded times.
+     * The posted time is signed when the request is prepared, which for a
+     * prefetched request in a batch is while the prior response is pending,
+     * so the time the request was actually sent is also included to give the
+     * round-trip time which might help estimate the accuracy.
+     *
+     * Skip logging this event if there was another POST event logged in the
+     * last 60 seconds. This limits the storage space used when a lot of
+     * sectors are posted one after the other, and one every 60 seconds seems
+     * adequate for the purpose of synchronizing the times.
+     */
+    if (recv_sec > last_recv_sec + 60) {
+        uint32_t send_time = req->send_time;
+        uint8_t event[16];
+        event[0] = time;
+        event[1] = time >>  8;
+        event[2] = time >> 16;
+        event[3] = time >> 24;
+
+        event[4] = recv_sec;
+        event[5] = recv_sec >>  8;
+        event[6] = recv_sec >> 16;
+        event[7] = recv_sec >> 24;
+
+        event[8] = recv_usec;
+        event[9] = recv_usec >>  8;
+        event[10] = recv_usec >> 16;
+        event[11] = recv_usec >> 24;
+
+        event[12] = send_time;
+        event[13] = send_time >>  8;
+        event[14] = send_time >> 16;
+        event[15] = send_time >> 24;
+
+        while (1) {
+            uint32_t new_index = dbuf_append(last_index,
+                                             DBUF_EVENT_POST_TIME,
+                                             event, sizeof(event), 0, 1);
+            if (new_index == last_index)
+                break;
+            last_index = new_index;
+        }
+        dbuf_note_time(recv_sec);
+
+        last_recv_sec = recv_sec;
+    }
+
+    /* The server response is used to set the buffer indexes known to have been
+     * received. This allows the server to request data be re-sent, or to skip
+     * over data already received when restarted. A bad index or size is
+     * handled when searching for the next buffer to post so does not need
+     * limiting here. */
+    note_buffer_posted(recv_index, recv_size);
+
+    if (recv_len >= 24) {
+        uint32_t resend_base = recv_buf[20] |
+            (recv_buf[21] << 8) |
+            (recv_buf[22] << 16) |
+            (recv_buf[23] << 24);
+        note_buffer_resend(resend_base, &recv_buf[24], recv_len - 24);
+    } else {
+        note_buffer_resend(0, recv_buf, 0);
+    }
+
+    return 1;
+}
+
+/*
+ * Post a batch of buffers on the connected socket, up to POST_BATCH_SIZE. The
+ * next buffer is prepared while waiting for the response to the current post,
+ * assuming that the server will acknowledge all the content posted. If the
+ * server acknowledges a different position, to request content be re-sent,
+ * then the prepared buffer is discarded and prepared again from that
+ * position. Returns 1 if the buffers posted were acknowledged and there might
+ * be more to post, 0 if there is nothing more to post, and -1 on failure in
+ * which case the connection should be closed.
+ */
+static int post_batch(int s, uint32_t *hold_off_time)
+{
+    post_request_t *current = &post_requests[0];
+    post_request_t *next = &post_requests[1];
+    uint32_t posted_index, posted_size;
+    int keep_alive = 1;
+    int posts;
+
+    if (!prepare_post(current, NULL))
+        return 0;
+
+    if (send_post(s, current) < 0)
+        return -1;
+
+    for (posts = 1; ; posts++) {
+        /* Prefetch while the response is in flight. */
+        uint32_t more = 0;
+        if (posts < POST_BATCH_SIZE)
+            more = prepare_post(next, current);
+
+        if (read_post_response(s, current, &keep_alive) < 0)
+            return -1;
+        *hold_off_time = 0;
+        stat_post_hold_off = 0;
+
+        get_buffer_posted(&posted_index, &posted_size);
+        if (posted_index != current->posted_index ||
+            posted_size != current->posted_size ||
+            (more && next->resend && !claim_buffer_resend(next->index))) {
+            /* Not the assumed position, or re-sending a buffer the server no
+             * longer requests, so prepare again. */
+            more = 0;
+            if (posts < POST_BATCH_SIZE)
+                more = prepare_post(next, NULL);
+        }
+
+        if (posts >= POST_BATCH_SIZE || !keep_alive)
+            return 1;
+
+        if (!more)
+            return 0;
+
+        if (send_post(s, next) < 0)
+            return -1;
+
+        post_request_t *prepared = next;
+        next = current;
+        current = prepared;
+    }
+}
+
+static void post_data(void *pvParameters)
+{
     /*
      * A retry hold-off time in msec. Reset to zero upon a success and otherwise
      * increased on each retry. This is intended avoid loading the network and
@@ -75,14 +555,15 @@ static void post_data(void *pvParameters)
      */
     uint32_t hold_off_time = 0;
 
+    /* Check periodically for data to post in case a notification is missed,
+     * and more often when also posting the content not yet saved. */
+    uint32_t period = param_live_period ? param_live_period * 1000 : 120000;
+
     while (1) {
-        xTaskNotifyWait(0, 0, NULL, 120000 / portTICK_PERIOD_MS);
+        xTaskNotifyWait(0, 0, NULL, period / portTICK_PERIOD_MS);
 
         /* Try to flush all the pending buffers before waiting again. */
         while (1) {
-            uint32_t start, index;
-            int j;
-
             /* Lightweight check if there is anything to post. */
             if (!maybe_buffer_to_post())
                 break;
@@ -92,6 +573,7 @@ static void post_data(void *pvParameters)
                 hold_off_time = MAX_HOLD_OFF_TIME;
             vTaskDelay(hold_off_time / portTICK_PERIOD_MS);
             hold_off_time += (hold_off_time >> 2) + 1000;
+            stat_post_hold_off = hold_off_time;
 
             /*
              * Wait until connected, and try connecting to the server before
@@ -101,7 +583,7 @@ static void post_data(void *pvParameters)
              * close to the time posted as possible and it can not be patched in
              * just before sending as it is part of the signed message.
              */
-            
+
             while (1) {
                 uint8_t connect_status = sdk_wifi_station_get_connect_status();
                 if (connect_status == STATION_GOT_IP)
@@ -109,241 +591,35 @@ static void post_data(void *pvParameters)
                 vTaskDelay(1000 / portTICK_PERIOD_MS);
             }
 
-            const struct addrinfo hints = {
-                .ai_family = AF_INET,
-                .ai_socktype = SOCK_STREAM,
-            };
-            struct addrinfo *res;
-
-            int err = getaddrinfo(param_web_server, param_web_port, &hints, &res);
-            if (err != 0 || res == NULL) {
-                if (res)
-                    freeaddrinfo(res);
+            if (!resolve_server()) {
+                stat_post_failures++;
                 continue;
             }
 
-            int s = socket(res->ai_family, res->ai_socktype, 0);
+            int s = socket(AF_INET, SOCK_STREAM, 0);
             if (s < 0) {
-                freeaddrinfo(res);
+                stat_post_failures++;
                 continue;
             }
 
-            if (connect(s, res->ai_addr, res->ai_addrlen) != 0) {
+            if (connect(s, (struct sockaddr *)&server_addr, sizeof(server_addr)) != 0) {
+                /* The address might be stale, so resolve it again on
+                 * the retry. */
+                server_addr_valid = 0;
                 close(s);
-                freeaddrinfo(res);
+                stat_post_failures++;
                 continue;
             }
 
-            freeaddrinfo(res);
+            /* Post a batch of buffers on this connection. */
+            int status = post_batch(s, &hold_off_time);
+            close(s);
 
-            /*
-             * The buffer to copy the data into needs to be aligned because
-             * reading the flash copies directly into it the buffer.
-             */
-            uint32_t size = get_buffer_to_post(&index, &start, &post_buf[PREFIX_SIZE + 16]);
+            if (status < 0)
+                stat_post_failures++;
 
-            if (size == 0) {
-                close(s);
+            if (status == 0)
                 break;
-            }
-
-            /*
-             * The sensor ID, and the index of the record, the local time, and
-             * the index at which this content starts within the record are
-             * prefixed.
-             */
-            post_buf[PREFIX_SIZE + 0] = param_sensor_id;
-            post_buf[PREFIX_SIZE + 1] = param_sensor_id >>  8;
-            post_buf[PREFIX_SIZE + 2] = param_sensor_id >> 16;
-            post_buf[PREFIX_SIZE + 3] = param_sensor_id >> 24;
-
-            uint32_t time = RTC.COUNTER;
-            post_buf[PREFIX_SIZE + 4] = time;
-            post_buf[PREFIX_SIZE + 5] = time >>  8;
-            post_buf[PREFIX_SIZE + 6] = time >> 16;
-            post_buf[PREFIX_SIZE + 7] = time >> 24;
-
-            post_buf[PREFIX_SIZE + 8] = index;
-            post_buf[PREFIX_SIZE + 9] = index >>  8;
-            post_buf[PREFIX_SIZE + 10] = index >> 16;
-            post_buf[PREFIX_SIZE + 11] = index >> 24;
-
-            post_buf[PREFIX_SIZE + 12] = start;
-            post_buf[PREFIX_SIZE + 13] = start >>  8;
-            post_buf[PREFIX_SIZE + 14] = start >> 16;
-            post_buf[PREFIX_SIZE + 15] = start >> 24;
-
-            /*
-             * Firstly use the prefix area for the key to implement MAC-SHA3.
-             */
-            memcpy(&post_buf[PREFIX_SIZE - param_key_size], param_sha3_key, param_key_size);
-            FIPS202_SHA3_224(&post_buf[PREFIX_SIZE - param_key_size],
-                             param_key_size + 16 + size,
-                             &post_buf[PREFIX_SIZE + 16 + size]);
-
-            /*
-             * Next use the prefix area for the HTTP header.
-             */
-            uint32_t header_size = snprintf((char *)post_buf, PREFIX_SIZE,
-                                            "POST %s HTTP/1.1\r\n"
-                                            "Host: %s:%s\r\n"
-                                            "Connection: close\r\n"
-                                            "Content-Type: application/octet-stream\r\n"
-                                            "Content-Length: %d\r\n"
-                                            "\r\n", param_web_path, param_web_server,
-                                            param_web_port, 16 + size + SIGNATURE_SIZE);
-            /*
-             * Move the header up to meet the data.
-             */
-            for (j = 0; j < header_size; j++)
-                post_buf[PREFIX_SIZE - j - 1] = post_buf[header_size - j - 1];
-
-            /*
-             * Data ready to send.
-             */
-            if (write(s, &post_buf[PREFIX_SIZE - header_size],
-                      header_size + 16 + size + SIGNATURE_SIZE) < 0) {
-                close(s);
-                continue;
-            }
-
-            char recv_buf[128];
-            int r;
-            /* Search for the end of the response headers */
-            int end = 0;
-            int headers_end = 0;
-            int i;
-            do {
-                r = read(s, recv_buf + end, 127 - end);
-                if (r > 0) {
-                    end += r;
-                    if (end >= 4) {
-                        for (i = 0; i < end - 4; i++) {
-                            if (recv_buf[i + 0] == '\r' &&
-                                recv_buf[i + 1] == '\n' &&
-                                recv_buf[i + 2] == '\r' &&
-                                recv_buf[i + 3] == '\n') {
-                                headers_end = i + 4;
-                                break;
-                            }
-                        }
-                        if (headers_end)
-                            break;
-                        /* Keep the last three bytes as they might have
-                         * contained part of the end of the headers. */
-                        for (i = 0; i < 3; i++)
-                            recv_buf[i] = recv_buf[end - 3 + i];
-                        end = 3;
-                    }
-                }
-            } while (r > 0);
-
-            if (headers_end) {
-                /* Shift down. */
-                end -= headers_end;
-                for (i = 0; i < end; i++)
-                    recv_buf[i] = recv_buf[headers_end + i];
-                /* Keep reading the body. */
-                while (end < 20) {
-                    r = read(s, recv_buf + end, 127 - end);
-                    if (r < 0)
-                        break;
-                    end += r;
-                };
-
-                /* Accept larger responses, for future extension. There is a
-                 * magic number that indicates a successful response which is
-                 * checked. */
-                if (end >= 20) {
-                    uint32_t recv_magic = recv_buf[0] |
-                        (recv_buf[1] << 8) |
-                        (recv_buf[2] << 16) |
-                        (recv_buf[3] << 24);
-                    uint32_t recv_sec = recv_buf[4] |
-                        (recv_buf[5] << 8) |
-                        (recv_buf[6] << 16) |
-                        (recv_buf[7] << 24);
-                    uint32_t recv_usec = recv_buf[8] |
-                        (recv_buf[9] << 8) |
-                        (recv_buf[10] << 16) |
-                        (recv_buf[11] << 24);
-                    uint32_t recv_index = recv_buf[12] |
-                        (recv_buf[13] << 8) |
-                        (recv_buf[14] << 16) |
-                        (recv_buf[15] << 24);
-                    uint32_t recv_size = recv_buf[16] |
-                        (recv_buf[17] << 8) |
-                        (recv_buf[18] << 16) |
-                        (recv_buf[19] << 24);
-
-                    uint32_t magic = param_sensor_id ^ time;
-                    if (recv_magic == magic) {
-                        /*
-                         * Update the clock using the server response time.
-                         */
-                        ds3231_note_time(recv_sec);
-
-                        /* Log the server time in it's response. This gives time
-                         * stamps to the events logged to help synchronize the
-                         * RTC counter to the real time. While the server could
-                         * log the times to synchronize to the RTC counter, this
-                         * gives some resilience against server data loss and
-                         * allows the sectors recorded to stand on their own.
-                         *
-                         * The event time-stamp is close enough to the received
-                         * time, and includes the posted time too to allow
-                         * matching with the server recorded times and also to
-                         * give the round-trip time to send and receive the post
-                         * which might help estimate the accuracy. Re-use the
-                         * post_buf to build this event.
-                         *
-                         * Skip logging this event if there was another POST
-                         * event logged in the last 60 seconds. This limits the
-                         * storage space used when a lot of sectors are posted
-                         * one after the other, and one every 60 seconds seems
-                         * adequate for the purpose of synchronizing the times.
-                         */
-                        if (recv_sec > last_recv_sec + 60) {
-                            post_buf[PREFIX_SIZE + 0] = time;
-                            post_buf[PREFIX_SIZE + 1] = time >>  8;
-                            post_buf[PREFIX_SIZE + 2] = time >> 16;
-                            post_buf[PREFIX_SIZE + 3] = time >> 24;
-
-                            post_buf[PREFIX_SIZE + 4] = recv_sec;
-                            post_buf[PREFIX_SIZE + 5] = recv_sec >>  8;
-                            post_buf[PREFIX_SIZE + 6] = recv_sec >> 16;
-                            post_buf[PREFIX_SIZE + 7] = recv_sec >> 24;
-
-                            post_buf[PREFIX_SIZE + 8] = recv_usec;
-                            post_buf[PREFIX_SIZE + 9] = recv_usec >>  8;
-                            post_buf[PREFIX_SIZE + 10] = recv_usec >> 16;
-                            post_buf[PREFIX_SIZE + 11] = recv_usec >> 24;
-
-                            while (1) {
-                                uint32_t new_index = dbuf_append(last_index,
-                                                                 DBUF_EVENT_POST_TIME,
-                                                                 &post_buf[PREFIX_SIZE],
-                                                                 12, 0, 1);
-                                if (new_index == last_index)
-                                    break;
-                                last_index = new_index;
-                            }
-
-                            last_recv_sec = recv_sec;
-                        }
-
-                        /* The server response is used to set the buffer indexes
-                         * known to have been received. This allows the server
-                         * to request data be re-sent, or to skip over data
-                         * already received when restarted. A bad index or size
-                         * is handled when searching for the next buffer to post
-                         * so does not need limiting here. */
-                        note_buffer_posted(recv_index, recv_size);
-                        hold_off_time = 0;
-                    }
-                }
-            }
-            close(s);
         }
     }
 }
@@ -352,6 +628,8 @@ void init_post()
 {
     if (param_web_server && param_web_path && param_sensor_id &&
         param_key_size == 287 && param_sha3_key) {
+        FIPS202_SHA3_224_Init(&key_sponge);
+        Keccak_Absorb(&key_sponge, param_sha3_key, param_key_size);
         xTaskCreate(&post_data, "OAQ Post", 304, NULL, 1, &post_data_task);
     }
 }
@@ -32,7 +32,8 @@ The advantages of this implementation are:
     + The code does not use much RAM, as all operations are done in place.
 
 The drawbacks of this implementation are:
-    - There is no message queue. The whole message must be ready in a buffer.
+    - There is no message queue, the incremental functions Keccak_Absorb()
+        etc. absorb the input directly into the state.
     - It is not optimized for peformance.
 
 The implementation is even simpler on a little endian platform. Just define the
@@ -71,7 +72,11 @@ This file uses UTF-8 encoding, as some comments use Greek letters.
   * @param  outputByteLen   The number of output bytes desired.
   * @pre    One must have r+c=1600 and the rate a multiple of 8 bits in this implementation.
   */
+#include "sha3.h"
+
 void Keccak(unsigned int rate, unsigned int capacity, const unsigned char *input, unsigned long long int inputByteLen, unsigned char delimitedSuffix, unsigned char *output, unsigned long long int outputByteLen);
+void Keccak_Init(KeccakSponge *sponge, unsigned int rate, unsigned int capacity);
+void Keccak_Squeeze(KeccakSponge *sponge, unsigned char delimitedSuffix, unsigned char *output, unsigned long long int outputByteLen);
 
 /**
   *  Function to compute SHAKE128 on the input message with any output length.
@@ -97,6 +102,19 @@ void FIPS202_SHA3_224(const unsigned char *input, unsigned int inputByteLen, uns
     Keccak(1152, 448, input, inputByteLen, 0x06, output, 28);
 }
 
+/**
+  *  Functions to compute SHA3-224 incrementally, see Keccak_Init().
+  */
+void FIPS202_SHA3_224_Init(KeccakSponge *sponge)
+{
+    Keccak_Init(sponge, 1152, 448);
+}
+
+void FIPS202_SHA3_224_Final(KeccakSponge *sponge, unsigned char *output)
+{
+    Keccak_Squeeze(sponge, 0x06, output, 28);
+}
+
 /**
   *  Function to compute SHA3-256 on the input message. The output length is fixed to 32 bytes.
   */
@@ -131,7 +149,7 @@ typedef unsigned char UINT8;
 typedef unsigned long long int UINT64;
 typedef UINT64 tKeccakLane;
 
-#ifndef LITTLE_ENDIAN
+#if !defined(LITTLE_ENDIAN) && !defined(KECCAK_FAST)
 /** Function to load a 64-bit value using the little-endian (LE) convention.
   * On a LE platform, this could be greatly simplified using a cast.
   */
@@ -174,6 +192,93 @@ static void xor64(UINT8 *x, UINT64 u)
 }
 #endif
 
+/*
+================================================================
+A faster implementation of the Keccak-f[1600] permutation, selected by
+defining KECCAK_FAST. The lanes are accessed in place as little endian
+64-bit words, the round constants and the ρ and π step offsets are
+precomputed, and the steps within a round are unrolled so that all the
+rotations are by constants. This requires a little endian platform.
+
+On the ESP8266 the compiler splits each 64-bit operation into a pair of
+32-bit operations, and a rotation by a constant is a couple of funnel
+shifts, so this keeps the lanes as 64-bit words rather than bit
+interleaving them.
+================================================================
+*/
+
+#ifdef KECCAK_FAST
+
+#define ROL64(a, offset) ((((UINT64)a) << offset) ^ (((UINT64)a) >> (64-offset)))
+
+static const tKeccakLane KeccakF_RoundConstants[24] = {
+    0x0000000000000001ULL, 0x0000000000008082ULL, 0x800000000000808aULL,
+    0x8000000080008000ULL, 0x000000000000808bULL, 0x0000000080000001ULL,
+    0x8000000080008081ULL, 0x8000000000008009ULL, 0x000000000000008aULL,
+    0x0000000000000088ULL, 0x0000000080008009ULL, 0x000000008000000aULL,
+    0x000000008000808bULL, 0x800000000000008bULL, 0x8000000000008089ULL,
+    0x8000000000008003ULL, 0x8000000000008002ULL, 0x8000000000000080ULL,
+    0x000000000000800aULL, 0x800000008000000aULL, 0x8000000080008081ULL,
+    0x8000000000008080ULL, 0x0000000080000001ULL, 0x8000000080008008ULL
+};
+
+/* θ step for one column x, given the column parities C. */
+#define THETA(x) \
+    D = C[((x)+4)%5] ^ ROL64(C[((x)+1)%5], 1); \
+    A[(x)] ^= D; A[(x)+5] ^= D; A[(x)+10] ^= D; A[(x)+15] ^= D; A[(x)+20] ^= D;
+
+/* ρ and π steps for one lane, following the chain of lanes from (1 0). The
+ * lane index is the π destination and r the ρ rotation offset. */
+#define RHO_PI(lane, r) \
+    T = A[lane]; A[lane] = ROL64(current, r); current = T;
+
+/* χ step for one plane y. */
+#define CHI(y) \
+    C[0] = A[(y)+0]; C[1] = A[(y)+1]; C[2] = A[(y)+2]; C[3] = A[(y)+3]; C[4] = A[(y)+4]; \
+    A[(y)+0] = C[0] ^ ((~C[1]) & C[2]); \
+    A[(y)+1] = C[1] ^ ((~C[2]) & C[3]); \
+    A[(y)+2] = C[2] ^ ((~C[3]) & C[4]); \
+    A[(y)+3] = C[3] ^ ((~C[4]) & C[0]); \
+    A[(y)+4] = C[4] ^ ((~C[0]) & C[1]);
+
+/**
+ * Function that computes the Keccak-f[1600] permutation on the given state,
+ * which must be word aligned.
+ */
+void KeccakF1600_StatePermute(void *state)
+{
+    tKeccakLane *A = (tKeccakLane *)state;
+    tKeccakLane C[5], D, T, current;
+    unsigned int round;
+
+    for(round=0; round<24; round++) {
+        /* === θ step === */
+        C[0] = A[0] ^ A[5] ^ A[10] ^ A[15] ^ A[20];
+        C[1] = A[1] ^ A[6] ^ A[11] ^ A[16] ^ A[21];
+        C[2] = A[2] ^ A[7] ^ A[12] ^ A[17] ^ A[22];
+        C[3] = A[3] ^ A[8] ^ A[13] ^ A[18] ^ A[23];
+        C[4] = A[4] ^ A[9] ^ A[14] ^ A[19] ^ A[24];
+        THETA(0) THETA(1) THETA(2) THETA(3) THETA(4)
+
+        /* === ρ and π steps === */
+        current = A[1];
+        RHO_PI(10,  1) RHO_PI( 7,  3) RHO_PI(11,  6) RHO_PI(17, 10)
+        RHO_PI(18, 15) RHO_PI( 3, 21) RHO_PI( 5, 28) RHO_PI(16, 36)
+        RHO_PI( 8, 45) RHO_PI(21, 55) RHO_PI(24,  2) RHO_PI( 4, 14)
+        RHO_PI(15, 27) RHO_PI(23, 41) RHO_PI(19, 56) RHO_PI(13,  8)
+        RHO_PI(12, 25) RHO_PI( 2, 43) RHO_PI(20, 62) RHO_PI(14, 18)
+        RHO_PI(22, 39) RHO_PI( 9, 61) RHO_PI( 6, 20) RHO_PI( 1, 44)
+
+        /* === χ step === */
+        CHI(0) CHI(5) CHI(10) CHI(15) CHI(20)
+
+        /* === ι step === */
+        A[0] ^= KeccakF_RoundConstants[round];
+    }
+}
+
+#else
+
 /*
 ================================================================
 A readable and compact implementation of the Keccak-f[1600] permutation.
@@ -272,6 +377,8 @@ void KeccakF1600_StatePermute(void *state)
     }
 }
 
+#endif /* KECCAK_FAST */
+
 /*
 ================================================================
 A readable and compact implementation of the Keccak sponge functions
@@ -282,26 +389,35 @@ that use the Keccak-f[1600] permutation.
 #include <string.h>
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
-void Keccak(unsigned int rate, unsigned int capacity, const unsigned char *input, unsigned long long int inputByteLen, unsigned char delimitedSuffix, unsigned char *output, unsigned long long int outputByteLen)
+/**
+  * Functions to compute the Keccak[r, c] sponge function incrementally. The
+  * input may be absorbed in any number of pieces, and a sponge that has
+  * absorbed a common prefix, such as a key, may be copied and reused to absorb
+  * different messages.
+  */
+void Keccak_Init(KeccakSponge *sponge, unsigned int rate, unsigned int capacity)
 {
-    UINT8 state[200];
-    unsigned int rateInBytes = rate/8;
-    unsigned int blockSize = 0;
-    unsigned int i;
-
-    if (((rate + capacity) != 1600) || ((rate % 8) != 0))
-        return;
-
     /* === Initialize the state === */
-    memset(state, 0, sizeof(state));
+    memset(sponge->state, 0, sizeof(sponge->state));
+    sponge->rateInBytes = rate/8;
+    sponge->blockSize = 0;
+}
+
+void Keccak_Absorb(KeccakSponge *sponge, const unsigned char *input, unsigned long long int inputByteLen)
+{
+    UINT8 *state = sponge->state;
+    unsigned int rateInBytes = sponge->rateInBytes;
+    unsigned int blockSize = sponge->blockSize;
+    unsigned int i;
 
     /* === Absorb all the input blocks === */
     while(inputByteLen > 0) {
-        blockSize = MIN(inputByteLen, rateInBytes);
-        for(i=0; i<blockSize; i++)
-            state[i] ^= input[i];
-        input += blockSize;
-        inputByteLen -= blockSize;
+        unsigned int size = MIN(inputByteLen, rateInBytes - blockSize);
+        for(i=0; i<size; i++)
+            state[blockSize + i] ^= input[i];
+        input += size;
+        inputByteLen -= size;
+        blockSize += size;
 
         if (blockSize == rateInBytes) {
             KeccakF1600_StatePermute(state);
@@ -309,6 +425,15 @@ void Keccak(unsigned int rate, unsigned int capacity, const unsigned char *input
         }
     }
 
+    sponge->blockSize = blockSize;
+}
+
+void Keccak_Squeeze(KeccakSponge *sponge, unsigned char delimitedSuffix, unsigned char *output, unsigned long long int outputByteLen)
+{
+    UINT8 *state = sponge->state;
+    unsigned int rateInBytes = sponge->rateInBytes;
+    unsigned int blockSize = sponge->blockSize;
+
     /* === Do the padding and switch to the squeezing phase === */
     /* Absorb the last few bits and add the first bit of padding (which coincides with the delimiter in delimitedSuffix) */
     state[blockSize] ^= delimitedSuffix;
@@ -331,3 +456,15 @@ void Keccak(unsigned int rate, unsigned int capacity, const unsigned char *input
             KeccakF1600_StatePermute(state);
     }
 }
+
+void Keccak(unsigned int rate, unsigned int capacity, const unsigned char *input, unsigned long long int inputByteLen, unsigned char delimitedSuffix, unsigned char *output, unsigned long long int outputByteLen)
+{
+    KeccakSponge sponge;
+
+    if (((rate + capacity) != 1600) || ((rate % 8) != 0))
+        return;
+
+    Keccak_Init(&sponge, rate, capacity);
+    Keccak_Absorb(&sponge, input, inputByteLen);
+    Keccak_Squeeze(&sponge, delimitedSuffix, output, outputByteLen);
+}
@@ -1 +1,17 @@
 extern void FIPS202_SHA3_224(const unsigned char *input, unsigned int inputByteLen, unsigned char *output);
+
+/*
+ * The state of an incremental Keccak sponge computation. A sponge that has
+ * absorbed a prefix may be copied to absorb different messages with that
+ * prefix. The state is aligned for the lane access of the KECCAK_FAST
+ * permutation.
+ */
+typedef struct {
+    unsigned char state[200] __attribute__ ((aligned (8)));
+    unsigned int rateInBytes;
+    unsigned int blockSize;
+} KeccakSponge;
+
+extern void FIPS202_SHA3_224_Init(KeccakSponge *sponge);
+extern void Keccak_Absorb(KeccakSponge *sponge, const unsigned char *input, unsigned long long int inputByteLen);
+extern void FIPS202_SHA3_224_Final(KeccakSponge *sponge, unsigned char *output);
@@ -35,6 +35,7 @@
 
 #include "buffer.h"
 #include "i2c.h"
+#include "config.h"
 #include "leds.h"
 
 
@@ -191,38 +192,48 @@ static bool sht2x_get_serial_number(uint8_t *serial_number)
 }
 
 /*
- * Measure the temperature if temp_rh is 0 and the relative humidity
- * if temp_rh is 1. Return 0 on success and 1 if there is an error.
+ * Trigger a measurement of the temperature if temp_rh is 0 and the relative
+ * humidity if temp_rh is 1, in the no-hold-master mode so that the bus is free
+ * during the conversion. Return true on success.
  */
-static uint8_t sht2x_measure_poll(int temp_rh, uint8_t data[], uint8_t *crc)
+static bool sht2x_trigger(int temp_rh)
 {
     i2c_start();
-    if (!i2c_write(I2C_ADR_W) ||
-        !i2c_write(temp_rh ? TRIG_RH_MEASUREMENT_POLL : TRIG_T_MEASUREMENT_POLL)) {
+    bool result = i2c_write(I2C_ADR_W) &&
+        i2c_write(temp_rh ? TRIG_RH_MEASUREMENT_POLL : TRIG_T_MEASUREMENT_POLL);
+    i2c_stop();
+    return result;
+}
+
+/*
+ * Read a triggered measurement. Returns 1 on success, 0 if the conversion is
+ * not yet complete in which case the sensor does not acknowledge the read, and
+ * -1 on a CRC error.
+ */
+static int sht2x_read_measurement(uint8_t data[], uint8_t *crc)
+{
+    i2c_start();
+    if (!i2c_write(I2C_ADR_R)) {
         i2c_stop();
-        return 1;
+        return 0;
     }
 
-    int i = 0;
-    int res;
-    do {
-        i2c_start();
-        sdk_os_delay_us(10000);
-        res = i2c_write(I2C_ADR_R);
-        if (i++ >= 20) {
-            i2c_stop();
-            return 1;
-        }
-    } while (res == 0);
-
     data[0] = i2c_read(0);
     data[1] = i2c_read(0);
     *crc = i2c_read(1);
     i2c_stop();
-    return sht2x_check_crc(data, 2, *crc);
+    return sht2x_check_crc(data, 2, *crc) ? 1 : -1;
 }
 
-
+/*
+ * The maximum conversion times in msec, for the 14 bit temperature and 12 bit
+ * relative humidity resolution, and the poll interval and limit if not yet
+ * complete.
+ */
+#define SHT2X_TEMP_TIME 85
+#define SHT2X_RH_TIME 29
+#define SHT2X_POLL_TIME 10
+#define SHT2X_POLL_LIMIT 20
 
 static bool sht2x_available = false;
 static uint8_t sht2x_serial_number[8];
@@ -242,15 +253,20 @@ bool sht2x_temp_rh(float *temp, float *rh)
     return true;
 }
 
-static void sht2x_read_task(void *pvParameters)
-{
-    /* Delta encoding state. */
-    uint32_t last_index = 0;
-    uint16_t last_temp = 0;
-    uint16_t last_rh = 0;
+/* Delta encoding state. */
+static uint32_t last_index = 0;
+static uint16_t last_temp = 0;
+static uint16_t last_rh = 0;
 
-    xSemaphoreTake(i2c_sem, portMAX_DELAY);
+/* The sample in progress. */
+static uint8_t sht2x_data[4];
+static uint8_t sht2x_temp_crc;
+static uint8_t sht2x_rh_crc;
+static uint8_t sht2x_phase;
+static uint8_t sht2x_polls;
 
+static bool sht2x_init()
+{
     /*
      * Reset the sensor and try reading the serial number to try
      * detecting the sensor.
@@ -268,80 +284,98 @@ static void sht2x_read_task(void *pvParameters)
         available = false;
     }
 
-    xSemaphoreGive(i2c_sem);
-
-    if (!available)
-        vTaskDelete(NULL);
-
-    for (;;) {
-        vTaskDelay(10000 / portTICK_PERIOD_MS);
+    return available;
+}
 
-        xSemaphoreTake(i2c_sem, portMAX_DELAY);
+/*
+ * Trigger the temperature conversion, then read it and trigger the relative
+ * humidity conversion, then read that.
+ */
+static int32_t sht2x_sample(bool start)
+{
+    if (start) {
+        sht2x_phase = 0;
+        sht2x_polls = 0;
+        if (!sht2x_trigger(0))
+            return -1;
+        return SHT2X_TEMP_TIME;
+    }
 
-        uint8_t data[4];
-        uint8_t temp_crc;
-        if (!sht2x_measure_poll(0, data, &temp_crc)) {
-            xSemaphoreGive(i2c_sem);
-            blink_red();
-            continue;
-        }
+    if (sht2x_phase == 0) {
+        int res = sht2x_read_measurement(&sht2x_data[0], &sht2x_temp_crc);
+        if (res < 0)
+            return -1;
+        if (res == 0)
+            return ++sht2x_polls > SHT2X_POLL_LIMIT ? -1 : SHT2X_POLL_TIME;
+        sht2x_phase = 1;
+        sht2x_polls = 0;
+        if (!sht2x_trigger(1))
+            return -1;
+        return SHT2X_RH_TIME;
+    }
 
-        uint16_t temp = ((uint16_t) data[0]) << 8 | data[1];
-        temp >>= 2; /* Strip the two low status bits */
+    int res = sht2x_read_measurement(&sht2x_data[2], &sht2x_rh_crc);
+    if (res < 0)
+        return -1;
+    if (res == 0)
+        return ++sht2x_polls > SHT2X_POLL_LIMIT ? -1 : SHT2X_POLL_TIME;
+
+    uint16_t temp = ((uint16_t) sht2x_data[0]) << 8 | sht2x_data[1];
+    temp >>= 2; /* Strip the two low status bits */
+    uint16_t rh = ((uint16_t) sht2x_data[2]) << 8 | sht2x_data[3];
+    rh >>= 2; /* Strip the two low status bits */
+
+    sht2x_available = true;
+    sht2x_temperature = temp;
+    sht2x_rh = rh;
+    return 0;
+}
 
-        uint8_t rh_crc;
-        if (!sht2x_measure_poll(1, &data[2], &rh_crc)) {
-            xSemaphoreGive(i2c_sem);
-            blink_red();
-            continue;
-        }
+static void sht2x_log()
+{
+    uint16_t temp = sht2x_temperature;
+    uint16_t rh = sht2x_rh;
+
+    while (1) {
+        uint8_t outbuf[8];
+        /* Delta encoding */
+        int32_t temp_delta = (int32_t)temp - (int32_t)last_temp;
+        uint32_t len = emit_leb128_signed(outbuf, 0, temp_delta);
+        int32_t rh_delta = (int32_t)rh - (int32_t)last_rh;
+        len = emit_leb128_signed(outbuf, len, rh_delta);
+        /* Include the xor of both crcs */
+        outbuf[len++] = sht2x_temp_crc ^ sht2x_rh_crc;
+        int32_t code = DBUF_EVENT_SHT2X_TEMP_HUM;
+        uint32_t new_index = dbuf_append(last_index, code, outbuf, len, 1, 0);
+        if (new_index == last_index)
+            break;
+
+        /* Moved on to a new buffer. Reset the delta encoding
+         * state and retry. */
+        last_index = new_index;
+        last_temp = 0;
+        last_rh = 0;
+    };
 
-        uint16_t rh = ((uint16_t) data[2]) << 8 | data[3];
-        rh >>= 2; /* Strip the two low status bits */
-
-        sht2x_available = true;
-        sht2x_temperature = temp;
-        sht2x_rh = rh;
-
-        xSemaphoreGive(i2c_sem);
-
-        while (1) {
-            uint8_t outbuf[8];
-            /* Delta encoding */
-            int32_t temp_delta = (int32_t)temp - (int32_t)last_temp;
-            uint32_t len = emit_leb128_signed(outbuf, 0, temp_delta);
-            int32_t rh_delta = (int32_t)rh - (int32_t)last_rh;
-            len = emit_leb128_signed(outbuf, len, rh_delta);
-            /* Include the xor of both crcs */
-            outbuf[len++] = temp_crc ^ rh_crc;
-            int32_t code = DBUF_EVENT_SHT2X_TEMP_HUM;
-            uint32_t new_index = dbuf_append(last_index, code, outbuf, len, 1, 0);
-            if (new_index == last_index)
-                break;
-
-            /* Moved on to a new buffer. Reset the delta encoding
-             * state and retry. */
-            last_index = new_index;
-            last_temp = 0;
-            last_rh = 0;
-        };
-
-        blink_green();
-
-        /*
-         * Commit the values logged. Note this is the only task
-         * accessing this state so these updates are synchronized with
-         * the last event of this class append.
-         */
-        last_temp = temp;
-        last_rh = rh;
-    }
+    /*
+     * Commit the values logged. Note this is the only task
+     * accessing this state so these updates are synchronized with
+     * the last event of this class append.
+     */
+    last_temp = temp;
+    last_rh = rh;
 }
 
-
-
+static i2c_sensor_t sht2x_sensor = {
+    .init = sht2x_init,
+    .sample = sht2x_sample,
+    .log = sht2x_log,
+};
 
 void init_sht2x()
 {
-    xTaskCreate(&sht2x_read_task, "sht2x_read_task", 256, NULL, 2, NULL);
+    if (param_sht2x_period) {
+        sht2x_sensor.period = param_sht2x_period * 1000;
+        add_i2c_sensor(&sht2x_sensor);
+    }
 }
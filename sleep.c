@@ -0,0 +1,180 @@
+/*
+ * Duty-cycled low-power mode, deep sleeping between bursts of sampling.
+ *
+ * Copyright (C) 2016 OurAirQuality.org
+ *
+ * Licensed under the Apache License, Version 2.0, January 2004 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *      http://www.apache.org/licenses/
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE CONTRIBUTORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS WITH THE SOFTWARE.
+ *
+ *
+ * For solar and battery powered sites the node can deep sleep between bursts
+ * of sampling. Each wake is a restart, so the state needed to continue is
+ * staged in the RTC user memory which is retained during the deep sleep. The
+ * RTC memory is only 512 bytes so can not hold a buffer, rather the head
+ * buffer is saved to flash before sleeping, as a partial save of a ones-filled
+ * buffer, and on the wake the head buffer is read back from flash and appended
+ * to, see flash_resume(). The RTC memory holds the head buffer size and the
+ * prior-event state of the time-stamp delta encoding, and the server
+ * acknowledged post position. The sensor modules restart with their delta
+ * encoding state reset, so the DBUF_EVENT_ESP8266_STARTUP event logged on the
+ * wake marks this reset partway through the resumed buffer, see buffer.h.
+ *
+ * The Wifi is only brought up on a wake if the backlog of buffers to post was
+ * at least param_sleep_backlog before sleeping, and the radio is otherwise
+ * disabled for the wake. It is always brought up after a power on or a
+ * reset, to allow configuration.
+ */
+
+#include "espressif/esp_common.h"
+#include "espressif/esp_system.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "buffer.h"
+#include "flash.h"
+#include "config.h"
+#include "pms.h"
+#include "sleep.h"
+
+/* The staged state, at the start of the RTC user memory. */
+#define SLEEP_RTC_ADDR 64
+#define SLEEP_MAGIC 0x534c4f41
+
+/* The deep sleep time is limited to 2^32 usec. */
+#define SLEEP_MAX_PERIOD 4200
+
+/* Seconds to wait for the backlog to be posted on a wake with the Wifi. */
+#define SLEEP_POST_TIMEOUT 120
+
+/* Msec to wait for the buffers to be saved before sleeping. */
+#define SLEEP_FLUSH_TIMEOUT 10000
+
+typedef struct {
+    uint32_t magic;
+    dbuf_resume_t dbuf;
+    uint32_t posted_index;
+    uint32_t posted_size;
+    uint32_t wifi;
+    uint32_t check;
+} sleep_stage_t;
+
+static sleep_stage_t stage;
+static bool stage_valid;
+
+static uint32_t sleep_stage_check(sleep_stage_t *s)
+{
+    uint32_t *words = (uint32_t *)s;
+    uint32_t check = 0;
+    uint32_t i;
+    for (i = 0; i < offsetof(sleep_stage_t, check) / 4; i++)
+        check = ((check << 5) | (check >> 27)) ^ words[i];
+    return check;
+}
+
+/*
+ * Called early at start-up to read the state staged before a deep sleep. Only
+ * used on a wake from a deep sleep in the low-power mode. Returns true and
+ * fills the head buffer resume state if valid.
+ */
+bool init_sleep_wake(dbuf_resume_t *resume)
+{
+    stage_valid = false;
+
+    if (!param_sleep_period)
+        return false;
+
+    struct sdk_rst_info *reset_info = sdk_system_get_rst_info();
+    if (reset_info->reason != DEEP_SLEEP_AWAKE)
+        return false;
+
+    if (!sdk_system_rtc_mem_read(SLEEP_RTC_ADDR, &stage, sizeof(stage)))
+        return false;
+
+    if (stage.magic != SLEEP_MAGIC || stage.check != sleep_stage_check(&stage))
+        return false;
+
+    /* The RTC counter runs during the deep sleep. Protect against it having
+     * been reset, which would look like wrapping in the time-stamps. */
+    if ((int32_t)(RTC.COUNTER - stage.dbuf.last_time) < 0)
+        return false;
+
+    stage_valid = true;
+    *resume = stage.dbuf;
+    return true;
+}
+
+/* Return true if the Wifi is to be brought up on this wake. */
+bool sleep_wifi_wanted()
+{
+    return !stage_valid || stage.wifi;
+}
+
+static void sleep_task(void *pvParameters)
+{
+    bool wifi = sleep_wifi_wanted();
+
+    vTaskDelay(param_sleep_burst * 1000 / portTICK_PERIOD_MS);
+
+    /* Sampling is done for this wake. */
+    pms_set_sleep(true);
+    pms_flush();
+
+    dbuf_resume_t resume;
+    bool saved = dbuf_flush(SLEEP_FLUSH_TIMEOUT, &resume);
+
+    if (wifi) {
+        uint32_t waited;
+        for (waited = 0; waited < SLEEP_POST_TIMEOUT && maybe_buffer_to_post(); waited++)
+            vTaskDelay(1000 / portTICK_PERIOD_MS);
+        /* Save the post events logged. */
+        saved = dbuf_flush(SLEEP_FLUSH_TIMEOUT, &resume);
+    }
+
+    memset(&stage, 0, sizeof(stage));
+    if (saved) {
+        stage.magic = SLEEP_MAGIC;
+        stage.dbuf = resume;
+        get_buffer_posted(&stage.posted_index, &stage.posted_size);
+        stage.wifi = buffers_to_post() >= param_sleep_backlog;
+        stage.check = sleep_stage_check(&stage);
+    }
+    sdk_system_rtc_mem_write(SLEEP_RTC_ADDR, &stage, sizeof(stage));
+
+    /* Option 1 calibrates the radio on the wake, option 4 disables it. */
+    sdk_system_deep_sleep_set_option(!saved || stage.wifi ? 1 : 4);
+
+    uint32_t period = param_sleep_period;
+    if (period > SLEEP_MAX_PERIOD)
+        period = SLEEP_MAX_PERIOD;
+    sdk_system_deep_sleep(period * 1000000);
+
+    for (;;)
+        vTaskDelay(1000 / portTICK_PERIOD_MS);
+}
+
+void init_sleep()
+{
+    if (!param_sleep_period)
+        return;
+
+    /* Restore the server acknowledged position from before the sleep. */
+    if (stage_valid)
+        note_buffer_posted(stage.posted_index, stage.posted_size);
+
+    xTaskCreate(&sleep_task, "OAQ Sleep", 208, NULL, 1, NULL);
+}
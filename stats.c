@@ -0,0 +1,151 @@
+/*
+ * Performance statistics, for finding stalls on a node in operation.
+ *
+ * Copyright (C) 2016 OurAirQuality.org
+ *
+ * Licensed under the Apache License, Version 2.0, January 2004 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *      http://www.apache.org/licenses/
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE CONTRIBUTORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS WITH THE SOFTWARE.
+ *
+ */
+
+#include "espressif/esp_common.h"
+
+#include <stdint.h>
+#include <string.h>
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include "buffer.h"
+#include "flash.h"
+#include "config.h"
+#include "stats.h"
+
+stat_time_t stat_dbufs_sem_wait;
+stat_time_t stat_dbufs_sem_hold;
+stat_time_t stat_flash_sem_wait;
+stat_time_t stat_flash_sem_hold;
+stat_time_t stat_dbuf_append;
+stat_time_t stat_flash_erase;
+stat_time_t stat_flash_write;
+stat_time_t stat_flash_verify;
+stat_time_t stat_post;
+
+/* The total bytes posted to the server, including the HTTP headers. */
+uint32_t stat_post_bytes;
+/* The number of failed attempts to post, and the current retry hold-off time
+ * in msec. */
+uint32_t stat_post_failures;
+uint32_t stat_post_hold_off;
+/* The number of PMS frames dropped for a bad checksum. */
+uint32_t stat_pms_checksum_failures;
+
+/*
+ * Note a duration from start to end. Some statistics are noted by more than one
+ * task, so the update is made in a critical section, which is short.
+ */
+void stat_time_note(stat_time_t *stat, uint32_t start, uint32_t end)
+{
+    uint32_t usec = end - start;
+    taskENTER_CRITICAL();
+    stat->count++;
+    stat->total += usec;
+    if (usec > stat->max)
+        stat->max = usec;
+    if (usec > stat->window_max)
+        stat->window_max = usec;
+    taskEXIT_CRITICAL();
+}
+
+/* Return the maximum duration since the last call, and start a new window. */
+uint32_t stat_time_take_window_max(stat_time_t *stat)
+{
+    taskENTER_CRITICAL();
+    uint32_t max = stat->window_max;
+    stat->window_max = 0;
+    taskEXIT_CRITICAL();
+    return max;
+}
+
+/*
+ * The telemetry fields, in the order encoded. See stats_task().
+ */
+#define STATS_FIELDS 9
+
+static void stats_sample(int32_t *values)
+{
+    values[0] = flash_write_failures;
+    values[1] = flash_index_invalidate_failures;
+    values[2] = stat_post_failures;
+    values[3] = stat_post_hold_off;
+    values[4] = dbufs_dropped;
+    values[5] = stat_time_take_window_max(&stat_dbuf_append);
+    values[6] = xPortGetFreeHeapSize();
+    values[7] = sdk_wifi_station_get_rssi();
+    values[8] = dbuf_events_dropped;
+}
+
+/*
+ * Log some of the statistics every param_telemetry_period minutes, so that
+ * the server can correlate gaps in the data with stalls on the node. Each
+ * value is delta encoded against the prior event in the same buffer as a
+ * signed leb128 value, so the counters that rarely change cost a byte each:
+ *
+ *   flash write failures, flash index invalidate failures, post failures,
+ *   post hold-off time in msec, dropped buffers, maximum dbuf_append()
+ *   latency in usec over the period, free heap bytes, Wifi RSSI in dBm,
+ *   events dropped while the tail buffer was stalled writing to flash.
+ *
+ * Fields are only added at the end, so a decoder accepts the older events
+ * with fewer fields.
+ */
+static void stats_task(void *pvParameters)
+{
+    /* Delta encoding state. */
+    uint32_t last_index = 0;
+    int32_t last[STATS_FIELDS] = {0};
+
+    for (;;) {
+        vTaskDelay(param_telemetry_period * 60000 / portTICK_PERIOD_MS);
+
+        int32_t values[STATS_FIELDS];
+        stats_sample(values);
+
+        while (1) {
+            uint8_t outbuf[STATS_FIELDS * 5];
+            uint32_t len = 0;
+            uint32_t i;
+            for (i = 0; i < STATS_FIELDS; i++)
+                len = emit_leb128_signed(outbuf, len, (int64_t)values[i] - last[i]);
+            uint32_t new_index = dbuf_append(last_index, DBUF_EVENT_TELEMETRY,
+                                             outbuf, len, 1, 0);
+            if (new_index == last_index)
+                break;
+
+            /* Moved on to a new buffer. Reset the delta encoding state and
+             * retry. */
+            last_index = new_index;
+            memset(last, 0, sizeof(last));
+        }
+
+        /* Commit the values logged. This is the only task accessing this
+         * state. */
+        memcpy(last, values, sizeof(last));
+    }
+}
+
+void init_stats()
+{
+    if (param_telemetry_period)
+        xTaskCreate(&stats_task, "OAQ Stats", 208, NULL, 1, NULL);
+}
@@ -0,0 +1,53 @@
+/*
+ * Performance statistics, for finding stalls on a node in operation.
+ *
+ * Copyright (C) 2016 OurAirQuality.org
+ *
+ * Licensed under the Apache License, Version 2.0, January 2004 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *      http://www.apache.org/licenses/
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE CONTRIBUTORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS WITH THE SOFTWARE.
+ *
+ */
+
+/*
+ * A duration statistic, in usec as read by sdk_system_get_time(). The total
+ * wraps, but with the count it still gives a mean over a window when sampled
+ * twice. The window_max is the maximum since last taken by
+ * stat_time_take_window_max(), for the telemetry event.
+ */
+typedef struct {
+    uint32_t count;
+    uint32_t total;
+    uint32_t max;
+    uint32_t window_max;
+} stat_time_t;
+
+void stat_time_note(stat_time_t *stat, uint32_t start, uint32_t end);
+uint32_t stat_time_take_window_max(stat_time_t *stat);
+
+extern stat_time_t stat_dbufs_sem_wait;
+extern stat_time_t stat_dbufs_sem_hold;
+extern stat_time_t stat_flash_sem_wait;
+extern stat_time_t stat_flash_sem_hold;
+extern stat_time_t stat_dbuf_append;
+extern stat_time_t stat_flash_erase;
+extern stat_time_t stat_flash_write;
+extern stat_time_t stat_flash_verify;
+extern stat_time_t stat_post;
+
+extern uint32_t stat_post_bytes;
+extern uint32_t stat_post_failures;
+extern uint32_t stat_post_hold_off;
+extern uint32_t stat_pms_checksum_failures;
+
+void init_stats();
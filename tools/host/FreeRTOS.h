@@ -0,0 +1,24 @@
+/*
+ * Host stub of the FreeRTOS header, for building the encoders on the host, see
+ * tools/Makefile. Only what buffer.c and pms.c use is declared.
+ */
+
+#ifndef HOST_FREERTOS_H
+#define HOST_FREERTOS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef uint32_t TickType_t;
+typedef int32_t BaseType_t;
+typedef uint32_t UBaseType_t;
+
+#define portMAX_DELAY 0xffffffff
+#define portTICK_PERIOD_MS 10
+#define pdTRUE 1
+#define pdFALSE 0
+
+size_t xPortGetFreeHeapSize(void);
+
+#endif
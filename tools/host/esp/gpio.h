@@ -0,0 +1,17 @@
+/*
+ * Host stub of the esp-open-rtos GPIO header, for building the encoders on the host, see
+ * tools/Makefile. Only what buffer.c and pms.c use is declared.
+ */
+
+#ifndef HOST_GPIO_H
+#define HOST_GPIO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum { GPIO_INPUT, GPIO_OUTPUT } gpio_direction_t;
+
+void gpio_enable(uint8_t pin, gpio_direction_t direction);
+void gpio_write(uint8_t pin, bool value);
+
+#endif
@@ -0,0 +1,18 @@
+/*
+ * Host stub of the esp-open-rtos RTC registers header, for building the encoders on the host, see
+ * tools/Makefile. Only what buffer.c and pms.c use is declared.
+ */
+
+#ifndef HOST_RTC_REGS_H
+#define HOST_RTC_REGS_H
+
+#include <stdint.h>
+
+/* The RTC counter, advanced by the host program to simulate the time. */
+struct RTC_REGS {
+    volatile uint32_t COUNTER;
+};
+
+extern struct RTC_REGS RTC;
+
+#endif
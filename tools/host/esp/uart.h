@@ -0,0 +1,16 @@
+/*
+ * Host stub of the esp-open-rtos UART header, for building the encoders on the host, see
+ * tools/Makefile. Only what buffer.c and pms.c use is declared.
+ */
+
+#ifndef HOST_UART_H
+#define HOST_UART_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+void uart_set_baud(int uart, int baud);
+int uart_getc_nowait(int uart);
+void uart_flush_rxfifo(int uart);
+
+#endif
@@ -0,0 +1,15 @@
+/*
+ * Host stub of the ESP8266 SDK common header, for building the encoders on the host, see
+ * tools/Makefile. Only what buffer.c and pms.c use is declared.
+ */
+
+#ifndef HOST_ESP_COMMON_H
+#define HOST_ESP_COMMON_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "espressif/esp_system.h"
+#include "espressif/esp_wifi.h"
+#include "esp/rtc_regs.h"
+
+#endif
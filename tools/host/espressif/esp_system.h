@@ -0,0 +1,28 @@
+/*
+ * Host stub of the ESP8266 SDK system header, for building the encoders on the host, see
+ * tools/Makefile. Only what buffer.c and pms.c use is declared.
+ */
+
+#ifndef HOST_ESP_SYSTEM_H
+#define HOST_ESP_SYSTEM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct sdk_rst_info {
+    uint32_t reason, exccause, epc1, epc2, epc3, excvaddr, depc, rtn_addr;
+};
+
+enum sdk_rst_reason {
+    DEFAULT_RST = 0, WDT_RST = 1, EXCEPTION_RST = 2, SOFT_WDT_RST = 3,
+    SOFT_RESTART = 4, DEEP_SLEEP_AWAKE = 5, EXT_RST = 6
+};
+
+struct sdk_rst_info *sdk_system_get_rst_info(void);
+uint32_t sdk_system_rtc_clock_cali_proc(void);
+uint32_t sdk_system_get_time(void);
+void sdk_system_restart(void);
+void sdk_system_uart_swap(void);
+void sdk_system_uart_de_swap(void);
+
+#endif
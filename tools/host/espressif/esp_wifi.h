@@ -0,0 +1,16 @@
+/*
+ * Host stub of the ESP8266 SDK wifi header, for building the encoders on the host, see
+ * tools/Makefile. Only what buffer.c and pms.c use is declared.
+ */
+
+#ifndef HOST_ESP_WIFI_H
+#define HOST_ESP_WIFI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum sdk_wifi_mode { NULL_MODE = 0, STATION_MODE, SOFTAP_MODE, STATIONAP_MODE };
+
+bool sdk_wifi_set_opmode_current(uint8_t mode);
+
+#endif
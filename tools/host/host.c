@@ -0,0 +1,261 @@
+/*
+ * Host stubs for building the firmware encoders on the host.
+ *
+ * Copyright (C) 2016 OurAirQuality.org
+ *
+ * Licensed under the Apache License, Version 2.0, January 2004 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *      http://www.apache.org/licenses/
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE CONTRIBUTORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS WITH THE SOFTWARE.
+ *
+ */
+
+/*
+ * The real buffer.c and pms.c are built against the stub headers in this
+ * directory and linked with these definitions, which stand in for the SDK,
+ * FreeRTOS, and the other firmware modules. The host program is single
+ * threaded: no tasks are created, the semaphores do nothing, and the time is
+ * the RTC counter which the host program advances. Buffers are saved by the
+ * host program calling host_save_buffers(), and a wake from a deep sleep can be
+ * staged in host_resume before calling user_init().
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+#include "espressif/esp_common.h"
+#include "esp/uart.h"
+#include "esp/gpio.h"
+#include "stdin_uart_interrupt/stdin_uart_interrupt.h"
+
+#include "buffer.h"
+#include "config.h"
+#include "leds.h"
+#include "flash.h"
+#include "web.h"
+#include "post.h"
+#include "i2c.h"
+#include "sht21.h"
+#include "bmp180.h"
+#include "bme280.h"
+#include "ds3231.h"
+#include "stats.h"
+#include "sleep.h"
+#include "host.h"
+
+/* The nominal RTC period is 6.25 usec, 25600 in the 12 bit fixed point
+ * calibration units. */
+#define HOST_RTC_CALI 25600
+
+struct RTC_REGS RTC;
+
+/* The firmware defaults, see init_params(). */
+uint8_t param_pms_uart = 1;
+uint8_t param_pms_coding = 0;
+uint32_t param_pms_period = 0;
+uint8_t param_dbufs = 2;
+uint8_t param_pms_set_pin = 0xff;
+
+TaskHandle_t flash_data_task;
+
+stat_time_t stat_dbuf_append;
+stat_time_t stat_dbufs_sem_hold;
+stat_time_t stat_dbufs_sem_wait;
+uint32_t stat_pms_checksum_failures;
+
+size_t xPortGetFreeHeapSize(void)
+{
+    return 1 << 20;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name, uint16_t stack,
+                       void *params, UBaseType_t priority, TaskHandle_t *handle)
+{
+    if (handle)
+        *handle = NULL;
+    return pdTRUE;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    RTC.COUNTER += ticks * portTICK_PERIOD_MS * 160;
+}
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action)
+{
+    return pdTRUE;
+}
+
+BaseType_t xTaskNotifyWait(uint32_t clear_entry, uint32_t clear_exit,
+                           uint32_t *value, TickType_t ticks)
+{
+    return pdFALSE;
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return RTC.COUNTER / (portTICK_PERIOD_MS * 160);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return NULL;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return (SemaphoreHandle_t)1;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    return pdTRUE;
+}
+
+struct sdk_rst_info *sdk_system_get_rst_info(void)
+{
+    static struct sdk_rst_info info;
+    return &info;
+}
+
+uint32_t sdk_system_rtc_clock_cali_proc(void)
+{
+    return HOST_RTC_CALI;
+}
+
+uint32_t sdk_system_get_time(void)
+{
+    return (uint64_t)RTC.COUNTER * HOST_RTC_CALI >> 12;
+}
+
+void sdk_system_restart(void)
+{
+    abort();
+}
+
+void sdk_system_uart_swap(void) {}
+void sdk_system_uart_de_swap(void) {}
+
+bool sdk_wifi_set_opmode_current(uint8_t mode)
+{
+    return true;
+}
+
+void uart_set_baud(int uart, int baud) {}
+
+int uart_getc_nowait(int uart)
+{
+    return -1;
+}
+
+void uart_flush_rxfifo(int uart) {}
+
+uint32_t uart0_num_char(void)
+{
+    return 0;
+}
+
+void gpio_enable(uint8_t pin, gpio_direction_t direction) {}
+void gpio_write(uint8_t pin, bool value) {}
+
+bool host_resuming;
+dbuf_resume_t host_resume;
+uint8_t host_resume_data[4096];
+
+static uint8_t host_copy[4096];
+
+/*
+ * Write the buffers ready to save to the file as 4096 byte sectors, as the
+ * flash_data task would. The head buffer is only written when save_head is
+ * set, so each sector is written once. Returns the number of sectors written.
+ */
+uint32_t host_save_buffers(FILE *file, bool save_head)
+{
+    uint32_t sectors = 0;
+
+    while (1) {
+        uint8_t *data;
+        uint32_t start;
+        uint32_t size = get_buffer_to_write(host_copy, &data, &start);
+        if (size == 0 || (data == host_copy && !save_head))
+            break;
+        fwrite(data, 1, sizeof(host_copy), file);
+        uint32_t index = data[0] | data[1] << 8 | data[2] << 16 |
+            (uint32_t)data[3] << 24;
+        note_buffer_written(index, size);
+        sectors++;
+        if (data == host_copy)
+            break;
+    }
+
+    return sectors;
+}
+
+void init_params() {}
+
+bool init_sleep_wake(dbuf_resume_t *resume)
+{
+    if (!host_resuming)
+        return false;
+    *resume = host_resume;
+    return true;
+}
+
+bool sleep_wifi_wanted()
+{
+    return false;
+}
+
+void init_sleep() {}
+
+/* Start at the first index, as on a blank flash. */
+uint32_t init_flash()
+{
+    return 0;
+}
+
+bool flash_resume(uint32_t index, uint8_t *buf, uint32_t size)
+{
+    if (!host_resuming || index != host_resume.index)
+        return false;
+    memcpy(buf, host_resume_data, sizeof(host_resume_data));
+    return true;
+}
+
+void flash_data(void *pvParameters) {}
+
+void init_web() {}
+void init_post() {}
+void init_i2c() {}
+void init_sht2x() {}
+void init_bmp180() {}
+void init_bme280() {}
+void init_ds3231() {}
+void start_i2c_sensors() {}
+void init_stats() {}
+
+void stat_time_note(stat_time_t *stat, uint32_t start, uint32_t end) {}
+
+void init_blink() {}
+void blink_red() {}
+void blink_green() {}
+void blink_blue() {}
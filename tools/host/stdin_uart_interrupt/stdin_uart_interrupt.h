@@ -0,0 +1,13 @@
+/*
+ * Host stub of the stdin_uart_interrupt header, for building the encoders on the host, see
+ * tools/Makefile. Only what buffer.c and pms.c use is declared.
+ */
+
+#ifndef HOST_STDIN_UART_INTERRUPT_H
+#define HOST_STDIN_UART_INTERRUPT_H
+
+#include <stdint.h>
+
+uint32_t uart0_num_char(void);
+
+#endif
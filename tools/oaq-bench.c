@@ -0,0 +1,241 @@
+/*
+ * Host benchmark of the PMS event encoding.
+ *
+ * Copyright (C) 2016 OurAirQuality.org
+ *
+ * Licensed under the Apache License, Version 2.0, January 2004 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *      http://www.apache.org/licenses/
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE CONTRIBUTORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS WITH THE SOFTWARE.
+ *
+ */
+
+/*
+ * Replays a recorded PMS stream through the firmware encoder, the real pms.c
+ * and buffer.c built against the stubs in tools/host, and writes the sectors
+ * logged for decoding by oaq-decode. See tools/Makefile, which builds this and
+ * runs both with:
+ *
+ *   make -C tools bench STREAM=capture.bin
+ *
+ * Usage: oaq-bench [-c coding] [-p period] stream sectors
+ *        oaq-bench -g frames > stream
+ *
+ * The stream holds the raw bytes from the sensor serial line, for example as
+ * captured at 9600 baud from a PMS3003 or PMS5003, and the frames with a valid
+ * checksum are logged as if received for the first sensor every 0.8 seconds.
+ * The -c and -p options set param_pms_coding and param_pms_period. The encode
+ * time per frame and the bytes per sample are reported. The time is that on
+ * the host, which is only useful for comparing encoder changes.
+ *
+ * The -g option writes a stream of the given number of PMS5003 frames
+ * generated from a fixed seed, a slow random walk with runs of equal values,
+ * for when there is no recording at hand.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "../pms.c"
+#include "host.h"
+
+void user_init(void);
+
+/* A frame every 0.8 seconds, in RTC ticks of 6.25 usec. */
+#define FRAME_TICKS 128000
+
+/* Longer than DBUF_SAVE_DELAY so the head buffer is saved. */
+#define SAVE_TICKS 0x2000000
+
+static uint16_t stream_word(const uint8_t *data)
+{
+    return data[0] << 8 | data[1];
+}
+
+/* Write one frame with the given values, and the checksum. */
+static void put_frame(uint16_t length, const uint16_t *values)
+{
+    uint8_t out[4 + 0x1c];
+    uint32_t size = length + 4;
+    uint32_t i;
+
+    out[0] = 0x42;
+    out[1] = 0x4d;
+    out[2] = length >> 8;
+    out[3] = length;
+    for (i = 0; i < (size - 6) / 2; i++) {
+        out[4 + 2 * i] = values[i] >> 8;
+        out[5 + 2 * i] = values[i];
+    }
+    uint16_t checksum = 0;
+    for (i = 0; i < size - 2; i++)
+        checksum += out[i];
+    out[size - 2] = checksum >> 8;
+    out[size - 1] = checksum;
+    fwrite(out, 1, size, stdout);
+}
+
+static void generate(uint32_t frames)
+{
+    uint16_t values[13] = {0};
+    uint32_t level = 8;
+    uint32_t i;
+
+    srand(1);
+    for (i = 0; i < frames; i++) {
+        /* The sensor averages over a few seconds, so the values often stay
+         * the same from frame to frame in clean air. */
+        if (rand() % 4 == 0) {
+            if (rand() % 2 && level > 1)
+                level--;
+            else if (level < 200)
+                level++;
+            uint32_t pm1 = level + rand() % 3;
+            uint32_t pm25 = pm1 + level / 3 + rand() % 2;
+            uint32_t pm10 = pm25 + level / 8;
+            values[0] = pm1;
+            values[1] = pm25;
+            values[2] = pm10;
+            values[3] = pm1;
+            values[4] = pm25;
+            values[5] = pm10;
+            uint32_t count = level * 120 + rand() % 60;
+            uint32_t j;
+            for (j = 6; j < 12; j++) {
+                values[j] = count;
+                count = count / 3 + rand() % 4;
+            }
+            values[12] = 0x91 + rand() % 2;
+        }
+        put_frame(0x1c, values);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    if (argc == 3 && strcmp(argv[1], "-g") == 0) {
+        generate(strtoul(argv[2], NULL, 0));
+        return 0;
+    }
+
+    for (i = 1; i < argc - 2; i++) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc - 2) {
+            param_pms_coding = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc - 2) {
+            param_pms_period = strtoul(argv[++i], NULL, 0);
+        } else {
+            break;
+        }
+    }
+    if (i != argc - 2) {
+        fprintf(stderr, "Usage: %s [-c coding] [-p period] stream sectors\n"
+                "       %s -g frames > stream\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(argv[i], "rb");
+    if (file == NULL) {
+        perror(argv[i]);
+        return 1;
+    }
+    uint8_t *stream = NULL;
+    uint32_t size = 0;
+    uint32_t capacity = 0;
+    while (1) {
+        if (size == capacity) {
+            capacity = capacity ? capacity * 2 : 1 << 16;
+            stream = realloc(stream, capacity);
+            if (stream == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+            }
+        }
+        size_t n = fread(stream + size, 1, capacity - size, file);
+        if (n == 0)
+            break;
+        size += n;
+    }
+    fclose(file);
+
+    FILE *out = fopen(argv[i + 1], "wb");
+    if (out == NULL) {
+        perror(argv[i + 1]);
+        return 1;
+    }
+
+    RTC.COUNTER = 0x10000;
+    user_init();
+
+    uint32_t frames = 0;
+    uint32_t skipped = 0;
+    uint32_t sectors = 0;
+    uint64_t nsec = 0;
+    uint32_t pos = 0;
+
+    while (pos + 4 <= size) {
+        uint16_t length = stream_word(stream + pos + 2);
+        if (stream[pos] != 0x42 || stream[pos + 1] != 0x4d ||
+            (length != 0x14 && length != 0x1c) || pos + length + 4 > size) {
+            pos++;
+            skipped++;
+            continue;
+        }
+        uint32_t frame_size = length + 4;
+        uint16_t checksum = 0;
+        uint32_t j;
+        for (j = 0; j < frame_size - 2; j++)
+            checksum += stream[pos + j];
+        if (checksum != stream_word(stream + pos + frame_size - 2)) {
+            pos++;
+            skipped++;
+            continue;
+        }
+
+        RTC.COUNTER += FRAME_TICKS;
+        memcpy(frame, stream + pos, frame_size);
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pms_log_frame(frame_size, 0);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        nsec += (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+        frames++;
+        pos += frame_size;
+
+        sectors += host_save_buffers(out, false);
+    }
+
+    pms_flush();
+    RTC.COUNTER += SAVE_TICKS;
+    sectors += host_save_buffers(out, true);
+    fclose(out);
+    free(stream);
+
+    if (frames == 0) {
+        fprintf(stderr, "No valid frames\n");
+        return 1;
+    }
+
+    /* The sector bytes include the index, the startup event, and the unused
+     * space at the end of each sector, so the decoder gives the bytes of the
+     * PMS events alone. */
+    printf("Encoded %u frames, %u bytes skipped, %.0f ns per frame\n", frames,
+           skipped, (double)nsec / frames);
+    printf("%u sectors, %.2f sector bytes per sample\n", sectors,
+           (double)sectors * 4096 / frames);
+    return 0;
+}
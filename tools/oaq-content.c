@@ -0,0 +1,72 @@
+/*
+ * Host tool for pre-compressing the static web content.
+ *
+ * Copyright (C) 2016 OurAirQuality.org
+ *
+ * Licensed under the Apache License, Version 2.0, January 2004 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *      http://www.apache.org/licenses/
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE CONTRIBUTORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS WITH THE SOFTWARE.
+ *
+ */
+
+/*
+ * The html files in the content directory are C string literals included by
+ * web.c. The pages that have no dynamic values are served gzip compressed,
+ * from a C byte array generated from the same html file so there is only one
+ * copy to edit. This is a portable C99 program for the host, built for each
+ * page with the page included:
+ *
+ *   cc -O2 -I. -DCONTENT='"content/bufsize.html"' -o oaq-content tools/oaq-content.c
+ *   ./oaq-content | gzip -9 -n | ./oaq-content -c > content/bufsize.html.gz.h
+ *
+ * Without options the page is written to stdout. The -c option instead reads
+ * binary data from stdin and writes it as a C array initializer, for including
+ * within the braces of a uint8_t array. The Makefile has a 'content' target
+ * that does this for the pages served compressed.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef CONTENT
+static const char *content[] = {
+#include CONTENT
+};
+#endif
+
+int main(int argc, char *argv[])
+{
+    if (argc == 2 && strcmp(argv[1], "-c") == 0) {
+        int c;
+        unsigned long count = 0;
+        while ((c = getchar()) != EOF) {
+            printf("%s0x%02x,", count % 12 == 0 ? (count ? "\n" : "") : " ", c);
+            count++;
+        }
+        if (count)
+            printf("\n");
+        return ferror(stdin) ? 1 : 0;
+    }
+
+#ifdef CONTENT
+    if (argc == 1) {
+        size_t i;
+        for (i = 0; i < sizeof(content) / sizeof(content[0]); i++)
+            fputs(content[i], stdout);
+        return 0;
+    }
+#endif
+
+    fprintf(stderr, "Usage: oaq-content [-c]\n");
+    return 1;
+}
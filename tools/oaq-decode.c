@@ -0,0 +1,753 @@
+/*
+ * Host decoder for the data sectors.
+ *
+ * Copyright (C) 2016 OurAirQuality.org
+ *
+ * Licensed under the Apache License, Version 2.0, January 2004 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *      http://www.apache.org/licenses/
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE CONTRIBUTORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS WITH THE SOFTWARE.
+ *
+ */
+
+/*
+ * Decodes the sectors as written by dbuf_append(), for example as read from
+ * the flash by the ESP flash tools or downloaded from the /getbuffer web
+ * handler, and prints the events and a summary of the space used by each
+ * event class. This is a portable C99 program for the host, built with:
+ *
+ *   cc -O2 -o oaq-decode tools/oaq-decode.c
+ *
+ * or with 'make -C tools', which also builds the oaq-bench encoder benchmark.
+ *
+ * Usage: oaq-decode [-q] [-b repeat] file
+ *
+ * The file holds one or more 4096 byte sectors, and the last may be short. The
+ * -q option suppresses the events and prints only the summary. The -b option
+ * decodes the file the given number of times, without printing the events,
+ * and reports the decode throughput.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "../buffer.h"
+
+#define SECTOR_SIZE 4096
+
+/* The adaptive Golomb-Rice code parameters, see emit_rice() in pms.c. */
+#define PMS_FIELDS 13
+#define RICE_ESCAPE 16
+#define RICE_MAX_K 15
+#define RICE_RESET 32
+
+#define MAX_CODE 64
+
+static bool verbose = true;
+
+/* The summary. */
+static uint32_t code_events[MAX_CODE];
+static uint32_t code_bytes[MAX_CODE];
+static uint32_t pms_samples;
+static uint32_t pms_bytes;
+static uint32_t pms_frame_bytes;
+static uint32_t pms_checksum_errors;
+static uint32_t sectors;
+static uint32_t errors;
+
+/*
+ * The bit reader for the PMS events, reading the least significant bits of
+ * each byte first. Reading past the end returns zero bits and sets the
+ * overrun flag.
+ */
+typedef struct {
+    const uint8_t *data;
+    uint32_t size;
+    uint32_t pos;
+    bool overrun;
+} bits_t;
+
+static uint32_t getbits(bits_t *b, uint32_t nbits)
+{
+    uint32_t v = 0;
+    uint32_t i;
+    for (i = 0; i < nbits; i++) {
+        uint32_t byte = b->pos >> 3;
+        if (byte >= b->size) {
+            b->overrun = true;
+            return v;
+        }
+        v |= ((b->data[byte] >> (b->pos & 7)) & 1) << i;
+        b->pos++;
+    }
+    return v;
+}
+
+static uint32_t bits_left(bits_t *b)
+{
+    return b->size * 8 - b->pos;
+}
+
+/* Decode a value emitted by emit_var_int(). */
+static int32_t get_var_int(bits_t *b)
+{
+    if (getbits(b, 1))
+        return 0;
+    uint32_t sign = getbits(b, 1);
+    int32_t v;
+    if (getbits(b, 1)) {
+        v = 1;
+    } else {
+        v = getbits(b, 5);
+        if (v == 31)
+            v = getbits(b, 16) + 33;
+        else
+            v += 2;
+    }
+    return sign ? -v : v;
+}
+
+typedef struct {
+    uint32_t a[PMS_FIELDS];
+    uint8_t n[PMS_FIELDS];
+} pms_rice_t;
+
+/* Decode a value emitted by emit_rice(). */
+static int32_t get_rice(bits_t *b, pms_rice_t *rice, uint32_t field)
+{
+    uint32_t a = rice->a[field];
+    uint32_t n = rice->n[field];
+    uint32_t k;
+
+    for (k = 0; k < RICE_MAX_K && ((n + 1) << k) < a + 1; k++)
+        ;
+
+    uint32_t q = 0;
+    while (q < RICE_ESCAPE && getbits(b, 1))
+        q++;
+    uint32_t u;
+    if (q == RICE_ESCAPE)
+        u = getbits(b, 18);
+    else
+        u = q << k | getbits(b, k);
+
+    a += u;
+    n++;
+    if (n >= RICE_RESET) {
+        a >>= 1;
+        n >>= 1;
+    }
+    rice->a[field] = a;
+    rice->n[field] = n;
+
+    return u & 1 ? -(int32_t)((u + 1) >> 1) : (int32_t)(u >> 1);
+}
+
+/*
+ * The leb128 readers. These return false if the value extends past the end.
+ */
+static bool get_leb128(const uint8_t *data, uint32_t size, uint32_t *pos,
+                       uint64_t *v)
+{
+    uint64_t value = 0;
+    uint32_t shift = 0;
+    while (*pos < size && shift < 64) {
+        uint8_t byte = data[(*pos)++];
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        shift += 7;
+        if ((byte & 0x80) == 0) {
+            *v = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool get_leb128_signed(const uint8_t *data, uint32_t size,
+                              uint32_t *pos, int64_t *v)
+{
+    int64_t value = 0;
+    uint32_t shift = 0;
+    while (*pos < size && shift < 64) {
+        uint8_t byte = data[(*pos)++];
+        value |= (int64_t)(byte & 0x7f) << shift;
+        shift += 7;
+        if ((byte & 0x80) == 0) {
+            if (shift < 64 && (byte & 0x40))
+                value |= -((int64_t)1 << shift);
+            *v = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint32_t get_word(const uint8_t *data)
+{
+    return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+/*
+ * The delta decoding state, reset at the start of each sector.
+ */
+typedef struct {
+    bool have_last;
+    uint16_t last_length;
+    uint8_t last_checksum;
+    int32_t last[PMS_FIELDS];
+    pms_rice_t rice;
+} pms_state_t;
+
+static pms_state_t pms_state[2];
+static int64_t last_sht2x_temp, last_sht2x_rh;
+static int64_t last_bmp180_temp, last_bmp180_pressure;
+static int64_t last_bme280_temp, last_bme280_pressure, last_bme280_humidity;
+static uint32_t last_ds3231_time;
+static int64_t last_ds3231_temp;
+static int64_t last_client_utime;
+/* The telemetry fields, the first eight always present, see stats.c. */
+#define TELEMETRY_FIELDS 9
+#define TELEMETRY_MIN_FIELDS 8
+static int64_t last_telemetry[TELEMETRY_FIELDS];
+
+static void reset_state()
+{
+    memset(pms_state, 0, sizeof(pms_state));
+    last_sht2x_temp = last_sht2x_rh = 0;
+    last_bmp180_temp = last_bmp180_pressure = 0;
+    last_bme280_temp = last_bme280_pressure = last_bme280_humidity = 0;
+    last_ds3231_time = 0;
+    last_ds3231_temp = 0;
+    last_client_utime = 0;
+    memset(last_telemetry, 0, sizeof(last_telemetry));
+}
+
+/* The fields of the PMS3003 events. */
+static const uint8_t pms3003_fields[] = {0, 1, 2, 3, 4, 5, 6, 7, 12};
+
+/*
+ * Print the frame values from the decoded state, and return the frame
+ * checksum that these values give.
+ */
+static uint16_t pms_print_values(pms_state_t *state, const char *label,
+                                 uint32_t time)
+{
+    int32_t *l = state->last;
+    int32_t v[13];
+
+    v[0] = l[0];
+    v[1] = v[0] + l[1];
+    v[2] = v[1] + l[2];
+    v[3] = l[3];
+    v[4] = v[3] + l[4];
+    v[5] = v[4] + l[5];
+    v[11] = l[11];
+    v[10] = v[11] + l[10];
+    v[9] = v[10] + l[9];
+    v[8] = v[9] + l[8];
+    v[7] = v[8] + l[7];
+    v[6] = v[7] + l[6];
+    v[12] = l[12];
+
+    uint16_t length = state->last_length;
+    uint16_t checksum = 'B' + 'M' + (length >> 8) + (length & 0xff);
+    uint32_t i;
+    uint32_t nfields = length == 0x1c ? PMS_FIELDS : sizeof(pms3003_fields);
+    for (i = 0; i < nfields; i++) {
+        uint32_t field = length == 0x1c ? i : pms3003_fields[i];
+        checksum += ((v[field] >> 8) & 0xff) + (v[field] & 0xff);
+    }
+
+    if (verbose) {
+        printf("%10u %s pm %d %d %d %d %d %d counts %d %d", time, label,
+               v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7]);
+        if (length == 0x1c)
+            printf(" %d %d %d %d", v[8], v[9], v[10], v[11]);
+        printf(" r %d\n", v[12]);
+    }
+
+    return checksum;
+}
+
+static bool decode_pms(const uint8_t *data, uint32_t size, uint32_t time,
+                       uint32_t sensor, uint16_t length, bool adaptive,
+                       const char *label)
+{
+    pms_state_t *state = &pms_state[sensor];
+    bits_t b = {data, size, 0, false};
+    uint32_t nfields = length == 0x1c ? PMS_FIELDS : sizeof(pms3003_fields);
+    pms_rice_t rice = state->rice;
+    uint32_t i;
+
+    for (i = 0; i < nfields; i++) {
+        uint32_t field = length == 0x1c ? i : pms3003_fields[i];
+        int32_t delta = adaptive ? get_rice(&b, &rice, i) : get_var_int(&b);
+        state->last[field] += delta;
+    }
+    if (length == 0x14) {
+        for (i = 8; i < 12; i++)
+            state->last[i] = 0;
+    }
+    if (adaptive)
+        state->rice = rice;
+
+    /* The checksum fills the remaining bits, at least eight. */
+    uint32_t nbits = bits_left(&b);
+    if (b.overrun || nbits < 8 || nbits > 15)
+        return false;
+    uint16_t checksum = getbits(&b, nbits);
+
+    state->have_last = true;
+    state->last_length = length;
+    state->last_checksum = checksum;
+
+    uint16_t expected = pms_print_values(state, label, time);
+    if ((expected & ((1 << nbits) - 1)) != checksum) {
+        pms_checksum_errors++;
+        if (verbose)
+            printf("%10u %s checksum mismatch\n", time, label);
+    }
+
+    pms_samples++;
+    pms_frame_bytes += 4 + length;
+    return true;
+}
+
+static bool decode_pms_repeat(const uint8_t *data, uint32_t size,
+                              uint32_t time, uint32_t sensor)
+{
+    pms_state_t *state = &pms_state[sensor];
+    uint32_t pos = 0;
+    uint64_t count, first, last;
+
+    if (!state->have_last)
+        return false;
+    if (!get_leb128(data, size, &pos, &count) ||
+        !get_leb128(data, size, &pos, &first) ||
+        !get_leb128(data, size, &pos, &last))
+        return false;
+
+    bits_t b = {data + pos, size - pos, 0, false};
+    uint16_t expected = pms_print_values(state, "repeat", time);
+    uint8_t checksum = state->last_checksum;
+    uint64_t i;
+    for (i = 0; i < count; i++) {
+        if (!getbits(&b, 1))
+            checksum = getbits(&b, 8);
+        if (checksum != (expected & 0xff))
+            pms_checksum_errors++;
+    }
+    if (b.overrun)
+        return false;
+    state->last_checksum = checksum;
+
+    if (verbose) {
+        printf("%10u repeat %u samples from %u to %u\n", time,
+               (uint32_t)count, time - (uint32_t)(first << 13),
+               time - (uint32_t)(last << 13));
+    }
+
+    pms_samples += count;
+    pms_frame_bytes += count * (4 + state->last_length);
+    return true;
+}
+
+/*
+ * Decode one event, returning false if it is not valid.
+ */
+static bool decode_event(uint16_t code, const uint8_t *data, uint32_t size,
+                         uint32_t time)
+{
+    uint32_t pos = 0;
+
+    switch (code) {
+    case DBUF_EVENT_PMS3003:
+        return decode_pms(data, size, time, 0, 0x14, false, "pms3003");
+    case DBUF_EVENT_PMS5003:
+        return decode_pms(data, size, time, 0, 0x1c, false, "pms5003");
+    case DBUF_EVENT_PMS3003_2:
+        return decode_pms(data, size, time, 1, 0x14, false, "pms3003_2");
+    case DBUF_EVENT_PMS5003_2:
+        return decode_pms(data, size, time, 1, 0x1c, false, "pms5003_2");
+    case DBUF_EVENT_PMS3003_RICE:
+        return decode_pms(data, size, time, 0, 0x14, true, "pms3003");
+    case DBUF_EVENT_PMS5003_RICE:
+        return decode_pms(data, size, time, 0, 0x1c, true, "pms5003");
+    case DBUF_EVENT_PMS3003_RICE_2:
+        return decode_pms(data, size, time, 1, 0x14, true, "pms3003_2");
+    case DBUF_EVENT_PMS5003_RICE_2:
+        return decode_pms(data, size, time, 1, 0x1c, true, "pms5003_2");
+    case DBUF_EVENT_PMS_REPEAT:
+        return decode_pms_repeat(data, size, time, 0);
+    case DBUF_EVENT_PMS_REPEAT_2:
+        return decode_pms_repeat(data, size, time, 1);
+
+    case DBUF_EVENT_POST_TIME:
+        /* Earlier firmware did not include the time sent. */
+        if (size != 12 && size != 16)
+            return false;
+        if (verbose) {
+            printf("%10u post time %u server %u.%06u", time,
+                   get_word(data), get_word(data + 4), get_word(data + 8));
+            if (size == 16)
+                printf(" sent %u", get_word(data + 12));
+            printf("\n");
+        }
+        return true;
+
+    case DBUF_EVENT_ESP8266_STARTUP:
+        if (size != 40)
+            return false;
+        /* The delta encoding state is reset on a restart, which might be
+         * partway through a buffer resumed after a deep sleep. */
+        reset_state();
+        if (verbose)
+            printf("%10u startup reason %u exccause %u epc1 0x%08x "
+                   "rtc cali %u recovery %u\n", time, get_word(data),
+                   get_word(data + 4), get_word(data + 8),
+                   get_word(data + 32), get_word(data + 36));
+        return true;
+
+    case DBUF_EVENT_SHT2X_TEMP_HUM: {
+        int64_t temp, rh;
+        if (!get_leb128_signed(data, size, &pos, &temp) ||
+            !get_leb128_signed(data, size, &pos, &rh) || pos + 1 != size)
+            return false;
+        last_sht2x_temp += temp;
+        last_sht2x_rh += rh;
+        if (verbose)
+            printf("%10u sht2x temp %d rh %d crc 0x%02x\n", time,
+                   (int)last_sht2x_temp, (int)last_sht2x_rh, data[pos]);
+        return true;
+    }
+
+    case DBUF_EVENT_BMP180_TEMP_PRESSURE: {
+        int64_t temp, pressure;
+        if (!get_leb128_signed(data, size, &pos, &temp) ||
+            !get_leb128_signed(data, size, &pos, &pressure) || pos != size)
+            return false;
+        last_bmp180_temp += temp;
+        last_bmp180_pressure += pressure;
+        if (verbose)
+            printf("%10u bmp180 temp %d pressure %d\n", time,
+                   (int)last_bmp180_temp, (int)last_bmp180_pressure);
+        return true;
+    }
+
+    case DBUF_EVENT_DS3231_TIME_TEMP: {
+        uint64_t clock;
+        int64_t temp;
+        if (!get_leb128(data, size, &pos, &clock) ||
+            !get_leb128_signed(data, size, &pos, &temp) || pos != size)
+            return false;
+        last_ds3231_time += (uint32_t)clock;
+        last_ds3231_temp += temp;
+        if (verbose)
+            printf("%10u ds3231 time %u temp %.2f\n", time, last_ds3231_time,
+                   last_ds3231_temp * 0.25);
+        return true;
+    }
+
+    case DBUF_EVENT_DS3231_TIME_STEP:
+        if (size != 8)
+            return false;
+        if (verbose)
+            printf("%10u ds3231 step from %u to %u\n", time, get_word(data),
+                   get_word(data + 4));
+        return true;
+
+    case DBUF_EVENT_BMP280_TEMP_PRESSURE:
+    case DBUF_EVENT_BME280_TEMP_PRESSURE_RH: {
+        int64_t temp, pressure, humidity = 0;
+        if (!get_leb128_signed(data, size, &pos, &temp) ||
+            !get_leb128_signed(data, size, &pos, &pressure))
+            return false;
+        if (code == DBUF_EVENT_BME280_TEMP_PRESSURE_RH &&
+            !get_leb128_signed(data, size, &pos, &humidity))
+            return false;
+        if (pos != size)
+            return false;
+        last_bme280_temp += temp;
+        last_bme280_pressure += pressure;
+        last_bme280_humidity += humidity;
+        if (verbose) {
+            printf("%10u bmx280 temp %d pressure %d", time,
+                   (int)last_bme280_temp, (int)last_bme280_pressure);
+            if (code == DBUF_EVENT_BME280_TEMP_PRESSURE_RH)
+                printf(" humidity %d", (int)last_bme280_humidity);
+            printf("\n");
+        }
+        return true;
+    }
+
+    case DBUF_EVENT_CLIENT_UTIME: {
+        int64_t utime;
+        if (!get_leb128_signed(data, size, &pos, &utime) || pos != size)
+            return false;
+        last_client_utime += utime;
+        if (verbose)
+            printf("%10u client utime %lld\n", time,
+                   (long long)last_client_utime);
+        return true;
+    }
+
+    case DBUF_EVENT_DBUF_DROPPED:
+        if (size != 8)
+            return false;
+        if (verbose)
+            printf("%10u dropped %u buffers, index %u\n", time,
+                   get_word(data), get_word(data + 4));
+        return true;
+
+    case DBUF_EVENT_PMS_AGGREGATE:
+    case DBUF_EVENT_PMS_AGGREGATE_2: {
+        static const char *names[12] = {"pm1a", "pm25a", "pm10a", "pm1b",
+                                        "pm25b", "pm10b", "c1", "c2", "c3",
+                                        "c4", "c5", "c6"};
+        if (size < 1)
+            return false;
+        uint32_t length = data[0];
+        uint32_t nfields = length == 0x1c ? 12 : 8;
+        uint64_t count, duration;
+        pos = 1;
+        if (!get_leb128(data, size, &pos, &count) ||
+            !get_leb128(data, size, &pos, &duration) || count == 0)
+            return false;
+        if (verbose)
+            printf("%10u pms%s aggregate %u frames over %u", time,
+                   code == DBUF_EVENT_PMS_AGGREGATE ? "" : "_2",
+                   (uint32_t)count, (uint32_t)duration << 13);
+        uint32_t i;
+        for (i = 0; i < nfields; i++) {
+            uint64_t min, mean, max;
+            if (!get_leb128(data, size, &pos, &min) ||
+                !get_leb128(data, size, &pos, &mean) ||
+                !get_leb128(data, size, &pos, &max))
+                return false;
+            mean += min;
+            max += mean;
+            if (verbose)
+                printf(" %s %u/%u/%u", names[i], (uint32_t)min,
+                       (uint32_t)mean, (uint32_t)max);
+        }
+        if (verbose)
+            printf("\n");
+        if (pos != size)
+            return false;
+        pms_samples += count;
+        pms_frame_bytes += count * (4 + length);
+        return true;
+    }
+
+    case DBUF_EVENT_TELEMETRY: {
+        int64_t values[TELEMETRY_FIELDS] = {0};
+        uint32_t i;
+        for (i = 0; i < TELEMETRY_FIELDS && pos < size; i++) {
+            int64_t delta;
+            if (!get_leb128_signed(data, size, &pos, &delta))
+                return false;
+            values[i] = last_telemetry[i] + delta;
+        }
+        if (i < TELEMETRY_MIN_FIELDS || pos != size)
+            return false;
+        memcpy(last_telemetry, values, sizeof(values));
+        if (verbose)
+            printf("%10u telemetry flash failures %d invalidate failures %d "
+                   "post failures %d hold-off %d dropped %d append max %d "
+                   "heap %d rssi %d events dropped %d\n", time,
+                   (int)values[0], (int)values[1], (int)values[2],
+                   (int)values[3], (int)values[4], (int)values[5],
+                   (int)values[6], (int)values[7], (int)values[8]);
+        return true;
+    }
+
+    default:
+        if (verbose)
+            printf("%10u unknown event %u size %u\n", time, code, size);
+        return true;
+    }
+}
+
+/*
+ * Decode a sector, see dbuf_append_locked() in buffer.c for the event header.
+ */
+static void decode_sector(const uint8_t *data, uint32_t size)
+{
+    if (size < 8)
+        return;
+
+    uint32_t index = get_word(data);
+    if (index == 0xffffffff)
+        return;
+    if ((index ^ 0xffffffff) != get_word(data + 4)) {
+        errors++;
+        if (verbose)
+            printf("Bad index at sector %u\n", sectors);
+        return;
+    }
+
+    sectors++;
+    if (verbose)
+        printf("Sector %u\n", index);
+
+    reset_state();
+
+    uint32_t pos = 8;
+    uint32_t time = 0;
+    uint64_t code = 0;
+    uint64_t event_size = 0;
+
+    while (pos < size && data[pos] != 0xff) {
+        uint32_t start = pos;
+        uint64_t v, delta;
+        if (!get_leb128(data, size, &pos, &v))
+            break;
+        if (v & 1) {
+            code = v >> 2;
+            if (!get_leb128(data, size, &pos, &event_size) ||
+                !get_leb128(data, size, &pos, &delta))
+                break;
+            if (v & 2)
+                delta <<= 13;
+        } else {
+            if (code == 0)
+                break;
+            delta = v & 2 ? (v >> 2) << 13 : v >> 2;
+        }
+        time += (uint32_t)delta;
+
+        if (event_size > size - pos)
+            break;
+
+        if (!decode_event(code, data + pos, event_size, time)) {
+            errors++;
+            if (verbose)
+                printf("%10u bad event %u size %u\n", time, (uint32_t)code,
+                       (uint32_t)event_size);
+        }
+
+        pos += event_size;
+
+        uint32_t total = pos - start;
+        if (code < MAX_CODE) {
+            code_events[code]++;
+            code_bytes[code] += total;
+        }
+        if ((code >= DBUF_EVENT_PMS3003 && code <= DBUF_EVENT_PMS5003) ||
+            (code >= DBUF_EVENT_PMS3003_2 && code <= DBUF_EVENT_PMS_REPEAT_2) ||
+            code == DBUF_EVENT_PMS_AGGREGATE || code == DBUF_EVENT_PMS_AGGREGATE_2)
+            pms_bytes += total;
+    }
+
+    if (pos < size && data[pos] != 0xff) {
+        errors++;
+        if (verbose)
+            printf("Bad event header at offset %u\n", pos);
+    }
+}
+
+static void decode_file(const uint8_t *data, uint32_t size)
+{
+    uint32_t pos;
+    for (pos = 0; pos < size; pos += SECTOR_SIZE) {
+        uint32_t sector_size = size - pos;
+        if (sector_size > SECTOR_SIZE)
+            sector_size = SECTOR_SIZE;
+        decode_sector(data + pos, sector_size);
+    }
+}
+
+static void print_summary()
+{
+    uint32_t code;
+    printf("%u sectors, %u errors\n", sectors, errors);
+    for (code = 0; code < MAX_CODE; code++) {
+        if (code_events[code] == 0)
+            continue;
+        printf("event %2u: %8u events %9u bytes %6.2f bytes per event\n",
+               code, code_events[code], code_bytes[code],
+               (double)code_bytes[code] / code_events[code]);
+    }
+    if (pms_samples > 0) {
+        printf("PMS: %u samples, %.2f bytes per sample, %.1f%% of the frame "
+               "size, %u checksum errors\n", pms_samples,
+               (double)pms_bytes / pms_samples,
+               100.0 * pms_bytes / pms_frame_bytes, pms_checksum_errors);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t repeat = 0;
+    int i;
+
+    for (i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], "-q") == 0) {
+            verbose = false;
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc - 1) {
+            repeat = strtoul(argv[++i], NULL, 0);
+            verbose = false;
+        } else {
+            break;
+        }
+    }
+    if (i != argc - 1) {
+        fprintf(stderr, "Usage: %s [-q] [-b repeat] file\n", argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(argv[i], "rb");
+    if (file == NULL) {
+        perror(argv[i]);
+        return 1;
+    }
+    uint8_t *data = NULL;
+    uint32_t size = 0;
+    uint32_t capacity = 0;
+    while (1) {
+        if (size == capacity) {
+            capacity = capacity ? capacity * 2 : 1 << 16;
+            data = realloc(data, capacity);
+            if (data == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+            }
+        }
+        size_t n = fread(data + size, 1, capacity - size, file);
+        if (n == 0)
+            break;
+        size += n;
+    }
+    fclose(file);
+
+    decode_file(data, size);
+    print_summary();
+
+    if (repeat > 0) {
+        clock_t start = clock();
+        uint32_t r;
+        for (r = 0; r < repeat; r++)
+            decode_file(data, size);
+        double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+        if (seconds > 0) {
+            printf("Decoded %u times in %.3f seconds, %.2f MB/s\n", repeat,
+                   seconds, (double)size * repeat / seconds / 1e6);
+        }
+    }
+
+    free(data);
+    return 0;
+}
@@ -0,0 +1,278 @@
+/*
+ * Host test of the PMS variable length encoder.
+ *
+ * Copyright (C) 2016 OurAirQuality.org
+ *
+ * Licensed under the Apache License, Version 2.0, January 2004 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *      http://www.apache.org/licenses/
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE CONTRIBUTORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS WITH THE SOFTWARE.
+ *
+ */
+
+/*
+ * Checks that the table driven emit_var_int() in pms.c is bit identical to the
+ * prior encoder, the chain of emitbits() calls kept here as the reference. It
+ * is built with the host build of pms.c and buffer.c, see tools/Makefile, and
+ * run with:
+ *
+ *   make -C tools test [STREAM=capture.bin]
+ *
+ * Usage: oaq-encode-test stream
+ *
+ * Every value from -32 to +32, the range of the table, and the 24 bit escape
+ * for the larger magnitudes are encoded by both at every starting bit offset
+ * of the accumulator. Then the stream, the raw bytes from the sensor serial
+ * line as for oaq-bench, is replayed through pms_log_frame() and each PMS
+ * event logged is encoded again with the reference from the same deltas.
+ * Exits non-zero on the first difference.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "../pms.c"
+
+void user_init(void);
+
+/* A frame every 0.8 seconds, in RTC ticks of 6.25 usec. */
+#define FRAME_TICKS 128000
+
+/* The encoder before the var_int_codes table, unchanged. */
+static void emit_var_int_reference(int32_t v)
+{
+    if (v == 0) {
+        /* 0 -> '1' */
+        emitbits(1, 1);
+        return;
+    }
+
+    emitbits(0, 1);
+
+    /* The sign bit. */
+    if (v < 0) {
+        emitbits(1, 1);
+        v = -v;
+    } else {
+        emitbits(0, 1);
+    }
+
+    if (v == 1) {
+        /* +1 -> '001'
+         * -1 -> '011'
+         */
+        emitbits(1, 1);
+        return;
+    }
+
+    emitbits(0, 1);
+
+    if (v < 33) {
+        /* +2 to +32 -> '000 xxxxx'
+         * -2 to -32 -> '010 xxxxx'
+         */
+        emitbits(v - 2, 5);
+        return;
+    }
+
+    emitbits(0x1f, 5);
+
+    /* 16 bit unsigned value:
+     *  +33 to 65568 : #x000 11111 xxxx xxxx xxxx xxxx
+     *  -33 to 65568 : #x010 11111 xxxx xxxx xxxx xxxx
+     */
+    v = v - 33;
+    emitbits(v & 0xffff, 16);
+}
+
+static uint8_t expected[sizeof(outbuf)];
+static int expected_len;
+
+/* Save the output, flushing the bits, and compare it with the saved output. */
+static void save_outbuf()
+{
+    emitbits(0, 7);
+    finish_outbuf();
+    memcpy(expected, outbuf, outlen);
+    expected_len = outlen;
+}
+
+static bool same_outbuf()
+{
+    emitbits(0, 7);
+    finish_outbuf();
+    return outlen == expected_len && memcmp(outbuf, expected, outlen) == 0;
+}
+
+/* Encode the value with both after the given number of zero bits. */
+static bool check_value(int32_t v, uint32_t offset)
+{
+    init_outbuf();
+    emitbits(0, offset);
+    emit_var_int_reference(v);
+    save_outbuf();
+
+    init_outbuf();
+    emitbits(0, offset);
+    emit_var_int(v);
+    if (same_outbuf())
+        return true;
+
+    fprintf(stderr, "Value %d at bit offset %u differs\n", v, offset);
+    return false;
+}
+
+static bool check_values()
+{
+    uint32_t offset;
+    int32_t v;
+
+    for (offset = 0; offset < 32; offset++) {
+        /* The table. */
+        for (v = -32; v <= 32; v++) {
+            if (!check_value(v, offset))
+                return false;
+        }
+        /* The escape, over the 16 bit range and beyond where it wraps. */
+        for (v = 33; v <= 0x10000 + 33 + 1000; v++) {
+            if (!check_value(v, offset) || !check_value(-v, offset))
+                return false;
+        }
+    }
+
+    printf("Values -%u to %u at each bit offset match\n", 0x10000 + 33 + 1000,
+           0x10000 + 33 + 1000);
+    return true;
+}
+
+static uint16_t stream_word(const uint8_t *data)
+{
+    return data[0] << 8 | data[1];
+}
+
+/*
+ * Replay the stream through pms_log_frame(), for each param_pms_coding 0
+ * event logged, which leaves the encoded event in the outbuf, encode the same
+ * deltas from the prior state with the reference.
+ */
+static bool check_stream(const uint8_t *stream, uint32_t size)
+{
+    pms_state_t *state = &pms_state[0];
+    uint32_t frames = 0;
+    uint32_t events = 0;
+    uint32_t pos = 0;
+
+    param_pms_coding = 0;
+    param_pms_period = 0;
+
+    while (pos + 4 <= size) {
+        uint16_t length = stream_word(stream + pos + 2);
+        if (stream[pos] != 0x42 || stream[pos + 1] != 0x4d ||
+            (length != 0x14 && length != 0x1c) || pos + length + 4 > size) {
+            pos++;
+            continue;
+        }
+        uint32_t frame_size = length + 4;
+        uint16_t checksum = 0;
+        uint32_t i;
+        for (i = 0; i < frame_size - 2; i++)
+            checksum += stream[pos + i];
+        if (checksum != stream_word(stream + pos + frame_size - 2)) {
+            pos++;
+            continue;
+        }
+
+        pms_state_t prior = *state;
+        RTC.COUNTER += FRAME_TICKS;
+        memcpy(frame, stream + pos, frame_size);
+        pms_log_frame(frame_size, 0);
+        frames++;
+        pos += frame_size;
+
+        /* An event is logged unless the frame was held as a repeat, and the
+         * delta state is reset on a new buffer. */
+        bool new_buffer = state->last_index != prior.last_index;
+        if (!new_buffer && prior.have_last && state->last_length == prior.last_length &&
+            memcmp(state->last, prior.last, sizeof(state->last)) == 0)
+            continue;
+        if (new_buffer)
+            memset(prior.last, 0, sizeof(prior.last));
+
+        finish_outbuf();
+        memcpy(expected, outbuf, outlen);
+        expected_len = outlen;
+
+        init_outbuf();
+        uint32_t nfields = length == 0x1c ? PMS_FIELDS : sizeof(pms3003_fields);
+        for (i = 0; i < nfields; i++) {
+            uint32_t field = length == 0x1c ? i : pms3003_fields[i];
+            emit_var_int_reference(state->last[field] - prior.last[field]);
+        }
+        emitbits(checksum, 15);
+        finish_outbuf();
+        if (outlen != expected_len || memcmp(outbuf, expected, outlen) != 0) {
+            fprintf(stderr, "Frame %u differs\n", frames);
+            return false;
+        }
+        events++;
+    }
+
+    if (events == 0) {
+        fprintf(stderr, "No events logged from the stream\n");
+        return false;
+    }
+
+    printf("Stream of %u frames, %u events match\n", frames, events);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s stream\n", argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    uint8_t *stream = NULL;
+    uint32_t size = 0;
+    uint32_t capacity = 0;
+    while (1) {
+        if (size == capacity) {
+            capacity = capacity ? capacity * 2 : 1 << 16;
+            stream = realloc(stream, capacity);
+            if (stream == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+            }
+        }
+        size_t n = fread(stream + size, 1, capacity - size, file);
+        if (n == 0)
+            break;
+        size += n;
+    }
+    fclose(file);
+
+    RTC.COUNTER = 0x10000;
+    user_init();
+
+    bool pass = check_values() && check_stream(stream, size);
+    free(stream);
+    return pass ? 0 : 1;
+}
@@ -0,0 +1,243 @@
+/*
+ * Host test of resuming the head buffer after a deep sleep.
+ *
+ * Copyright (C) 2016 OurAirQuality.org
+ *
+ * Licensed under the Apache License, Version 2.0, January 2004 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at
+ *      http://www.apache.org/licenses/
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE CONTRIBUTORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS WITH THE SOFTWARE.
+ *
+ */
+
+/*
+ * Logs PMS frames, sleeps, and on the wake resumes appending to the head
+ * buffer partway through, then decodes the sectors with oaq-decode and checks
+ * that every sample decodes with a matching checksum. It is built with the
+ * host build of pms.c and buffer.c, see tools/Makefile, and run with:
+ *
+ *   make -C tools test
+ *
+ * Usage: oaq-resume-test oaq-decode sectors
+ *
+ * Each wake is a restart, so the firmware before the sleep runs in a child
+ * process and the wake in the parent, with the static state as after a
+ * restart. The child passes the head buffer as saved to flash and the resume
+ * state, as staged in the RTC memory, back to the parent.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "../pms.c"
+#include "host.h"
+
+void user_init(void);
+
+/* A frame every 0.8 seconds, in RTC ticks of 6.25 usec. */
+#define FRAME_TICKS 128000
+
+/* Longer than DBUF_SAVE_DELAY so the head buffer is saved. */
+#define SAVE_TICKS 0x2000000
+
+/* A five minute sleep. */
+#define SLEEP_TICKS 48000000
+
+/* The frames logged before and after the sleep, enough to fill a few
+ * buffers and leave the head buffer partly filled. */
+#define FRAMES_BEFORE 1000
+#define FRAMES_AFTER 1000
+
+/* Log a PMS5003 frame with values that change every few frames. */
+static void log_frame(uint32_t n)
+{
+    uint16_t length = 0x1c;
+    uint32_t size = length + 4;
+    uint32_t level = n / 3;
+    uint32_t i;
+
+    frame[0] = 0x42;
+    frame[1] = 0x4d;
+    frame[2] = length >> 8;
+    frame[3] = length;
+    for (i = 0; i < 13; i++) {
+        uint16_t value = i == 12 ? 0x91 : 10 + (level * (i + 3)) % 97 * (13 - i);
+        frame[4 + 2 * i] = value >> 8;
+        frame[5 + 2 * i] = value;
+    }
+    uint16_t checksum = 0;
+    for (i = 0; i < size - 2; i++)
+        checksum += frame[i];
+    frame[size - 2] = checksum >> 8;
+    frame[size - 1] = checksum;
+
+    RTC.COUNTER += FRAME_TICKS;
+    pms_log_frame(size, 0);
+}
+
+/* Before the sleep, write the head buffer and resume state to the pipe. */
+static void before_sleep(FILE *out, int fd)
+{
+    uint32_t n;
+
+    RTC.COUNTER = 0x10000;
+    user_init();
+    for (n = 0; n < FRAMES_BEFORE; n++) {
+        log_frame(n);
+        host_save_buffers(out, false);
+    }
+
+    /* As sleep_task() does. */
+    pms_flush();
+    RTC.COUNTER += SAVE_TICKS;
+    host_save_buffers(out, false);
+    fflush(out);
+
+    FILE *pipe = fdopen(fd, "wb");
+    if (host_save_buffers(pipe, true) != 1) {
+        fprintf(stderr, "No head buffer to resume\n");
+        exit(1);
+    }
+    dbuf_resume_t resume;
+    if (!dbuf_flush(0, &resume)) {
+        fprintf(stderr, "Flush failed\n");
+        exit(1);
+    }
+    uint32_t time = RTC.COUNTER;
+    fwrite(&resume, sizeof(resume), 1, pipe);
+    fwrite(&time, sizeof(time), 1, pipe);
+    fclose(pipe);
+}
+
+/* On the wake, resume appending to the head buffer. */
+static bool after_sleep(FILE *out, int fd)
+{
+    FILE *pipe = fdopen(fd, "rb");
+    uint32_t time;
+    if (fread(host_resume_data, sizeof(host_resume_data), 1, pipe) != 1 ||
+        fread(&host_resume, sizeof(host_resume), 1, pipe) != 1 ||
+        fread(&time, sizeof(time), 1, pipe) != 1) {
+        fprintf(stderr, "No resume state\n");
+        return false;
+    }
+    fclose(pipe);
+
+    if (host_resume.size <= 8 || host_resume.size >= 4096) {
+        fprintf(stderr, "Head buffer size %u is not partway\n", host_resume.size);
+        return false;
+    }
+
+    host_resuming = true;
+    RTC.COUNTER = time + SLEEP_TICKS;
+    user_init();
+    uint32_t n;
+    for (n = 0; n < FRAMES_AFTER; n++) {
+        log_frame(FRAMES_BEFORE + n);
+        host_save_buffers(out, false);
+    }
+    pms_flush();
+    RTC.COUNTER += SAVE_TICKS;
+    host_save_buffers(out, true);
+
+    printf("Resumed buffer %u at size %u\n", host_resume.index, host_resume.size);
+    return true;
+}
+
+/* Decode the sectors and check the summary. */
+static bool check_decode(const char *decoder, const char *sectors)
+{
+    char command[1024];
+    snprintf(command, sizeof(command), "%s -q %s", decoder, sectors);
+    FILE *pipe = popen(command, "r");
+    if (pipe == NULL) {
+        perror(decoder);
+        return false;
+    }
+
+    char line[256];
+    uint32_t nsectors = 0;
+    uint32_t errors = 1;
+    uint32_t samples = 0;
+    uint32_t checksum_errors = 1;
+    while (fgets(line, sizeof(line), pipe)) {
+        fputs(line, stdout);
+        if (sscanf(line, "%u sectors, %u errors", &nsectors, &errors) == 2)
+            continue;
+        char *p = strstr(line, "checksum errors");
+        if (strncmp(line, "PMS: ", 5) == 0 && p) {
+            samples = strtoul(line + 5, NULL, 10);
+            while (p > line && p[-1] == ' ')
+                p--;
+            while (p > line && p[-1] >= '0' && p[-1] <= '9')
+                p--;
+            checksum_errors = strtoul(p, NULL, 10);
+        }
+    }
+    if (pclose(pipe) != 0)
+        return false;
+
+    if (errors != 0 || checksum_errors != 0 ||
+        samples != FRAMES_BEFORE + FRAMES_AFTER) {
+        fprintf(stderr, "Expected %u samples without errors\n",
+                FRAMES_BEFORE + FRAMES_AFTER);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s oaq-decode sectors\n", argv[0]);
+        return 1;
+    }
+
+    FILE *out = fopen(argv[2], "wb");
+    if (out == NULL) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return 1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        before_sleep(out, fds[1]);
+        fclose(out);
+        exit(0);
+    }
+    close(fds[1]);
+
+    /* The child's sectors are written before the parent's. */
+    int status;
+    bool resumed = after_sleep(out, fds[0]);
+    waitpid(pid, &status, 0);
+    fclose(out);
+    if (!resumed || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return 1;
+
+    return check_decode(argv[1], argv[2]) ? 0 : 1;
+}
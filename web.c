@@ -22,6 +22,8 @@
 #include "espressif/esp_common.h"
 
 #include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
 #include <time.h>
 #include <ctype.h>
 
@@ -46,6 +48,7 @@
 #include "sht21.h"
 #include "bme280.h"
 #include "i2c.h"
+#include "stats.h"
 
 #include "config.h"
 #include "wificfg/wificfg.h"
@@ -57,6 +60,124 @@ static const char http_success_header[] = "HTTP/1.0 200 \r\n"
     "Cache-Control: no-store\r\n"
     "\r\n";
 
+/*
+ * Response builder. The pages are emitted as many small fragments and each
+ * write() is a separate lwIP send, so the fragments are coalesced here and
+ * written a full TCP segment at a time. The wificfg server task handles one
+ * request at a time so a single buffer is shared by the handlers. A write
+ * error is latched and returned by the later calls, so the handlers can
+ * return on the first error as before. The handlers call web_begin() before
+ * the response and web_flush() at the end.
+ */
+#define WEB_WRITE_SIZE TCP_MSS
+
+static struct {
+    int s;
+    int error;
+    size_t len;
+    char buf[WEB_WRITE_SIZE];
+} web_out;
+
+static void web_begin(int s)
+{
+    web_out.s = s;
+    web_out.error = 0;
+    web_out.len = 0;
+}
+
+static int web_send(const char *data, size_t size)
+{
+    while (size > 0) {
+        int count = write(web_out.s, data, size);
+        if (count <= 0) {
+            web_out.error = 1;
+            return -1;
+        }
+        data += count;
+        size -= count;
+    }
+    return 0;
+}
+
+static int web_flush(void)
+{
+    if (web_out.error)
+        return -1;
+    size_t len = web_out.len;
+    web_out.len = 0;
+    return web_send(web_out.buf, len);
+}
+
+static int web_write(const void *data, size_t size)
+{
+    const char *p = data;
+
+    if (web_out.error)
+        return -1;
+
+    while (size > 0) {
+        /* Send whole segments directly rather than copying them. */
+        if (web_out.len == 0 && size >= WEB_WRITE_SIZE) {
+            size_t len = size - size % WEB_WRITE_SIZE;
+            if (web_send(p, len) < 0)
+                return -1;
+            p += len;
+            size -= len;
+            continue;
+        }
+        size_t len = WEB_WRITE_SIZE - web_out.len;
+        if (len > size)
+            len = size;
+        memcpy(&web_out.buf[web_out.len], p, len);
+        web_out.len += len;
+        p += len;
+        size -= len;
+        if (web_out.len == WEB_WRITE_SIZE && web_flush() < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int web_write_string(const char *str)
+{
+    return web_write(str, strlen(str));
+}
+
+/*
+ * Formatted output is written directly into the buffer, flushing first if it
+ * does not fit. Output longer than the buffer is truncated, as for the
+ * snprintf() into the handler buffer that this replaces.
+ */
+static int web_printf(const char *format, ...)
+{
+    va_list ap;
+
+    if (web_out.error)
+        return -1;
+
+    size_t space = WEB_WRITE_SIZE - web_out.len;
+    va_start(ap, format);
+    int len = vsnprintf(&web_out.buf[web_out.len], space, format, ap);
+    va_end(ap);
+    if (len < 0)
+        return -1;
+
+    if (len >= space && web_out.len > 0) {
+        if (web_flush() < 0)
+            return -1;
+        space = WEB_WRITE_SIZE;
+        va_start(ap, format);
+        len = vsnprintf(web_out.buf, space, format, ap);
+        va_end(ap);
+        if (len < 0)
+            return -1;
+    }
+
+    web_out.len += len < space ? len : space - 1;
+    return 0;
+}
+
 static const char *http_index_content[] = {
 #include "content/index.html"
 };
@@ -66,12 +187,13 @@ static void handle_index(int s, wificfg_method method,
                          wificfg_content_type content_type,
                          char *buf, size_t len)
 {
-    if (wificfg_write_string(s, http_success_header) < 0) return;
+    web_begin(s);
+    if (web_write_string(http_success_header) < 0) return;
     
     if (method != HTTP_METHOD_HEAD) {
-        if (wificfg_write_string(s, http_index_content[0]) < 0) return;
-        if (wificfg_write_string(s, "<center><h2>Last logged data</h2></center>") < 0) return;
-        if (wificfg_write_string(s, "<dl class=\"dlh\">") < 0) return;
+        if (web_write_string(http_index_content[0]) < 0) return;
+        if (web_write_string("<center><h2>Last logged data</h2></center>") < 0) return;
+        if (web_write_string("<dl class=\"dlh\">") < 0) return;
 
         {
             struct tm time;
@@ -85,32 +207,27 @@ static void handle_index(int s, wificfg_method method,
                 clock_time -= tz * 60 * 60;
                 gmtime_r(&clock_time, &time);
 
-                if (wificfg_write_string(s, "<dt>DS3231</dt>") < 0) return;
+                if (web_write_string("<dt>DS3231</dt>") < 0) return;
                 const char *wday[7] = {"Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun"};
-                snprintf(buf, len, "<dd>%02u:%02u:%02u %s %u/%u/%u", time.tm_hour, time.tm_min, time.tm_sec, wday[time.tm_wday], time.tm_mday, time.tm_mon + 1, time.tm_year + 1900);
-                if (wificfg_write_string(s, buf) < 0) return;
-                snprintf(buf, len, ", %.1f Deg&nbsp;C</dd>", temp);
-                if (wificfg_write_string(s, buf) < 0) return;
+                if (web_printf("<dd>%02u:%02u:%02u %s %u/%u/%u", time.tm_hour, time.tm_min, time.tm_sec, wday[time.tm_wday], time.tm_mday, time.tm_mon + 1, time.tm_year + 1900) < 0) return;
+                if (web_printf(", %.1f Deg&nbsp;C</dd>", temp) < 0) return;
             }
         }
 
         {
             float temp, rh;
             if (sht2x_temp_rh(&temp, &rh)) {
-                if (wificfg_write_string(s, "<dt>SHT2x</dt>") < 0) return;
-                snprintf(buf, len, "<dd>%.1f Deg&nbsp;C, %.1f&nbsp;%% RH</dd>", temp, rh);
-                if (wificfg_write_string(s, buf) < 0) return;
+                if (web_write_string("<dt>SHT2x</dt>") < 0) return;
+                if (web_printf("<dd>%.1f Deg&nbsp;C, %.1f&nbsp;%% RH</dd>", temp, rh) < 0) return;
             }
         }
 
         {
             float temp, press, rh;
             if (bme280_temp_press_rh(&temp, &press, &rh)) {
-                if (wificfg_write_string(s, "<dt>BME280</dt>") < 0) return;
-                snprintf(buf, len, "<dd>%.1f Deg&nbsp;C, %.0f Pa", temp, press);
-                if (wificfg_write_string(s, buf) < 0) return;
-                snprintf(buf, len, ", %.1f&nbsp;%% RH</dd>", rh);
-                if (wificfg_write_string(s, buf) < 0) return;
+                if (web_write_string("<dt>BME280</dt>") < 0) return;
+                if (web_printf("<dd>%.1f Deg&nbsp;C, %.0f Pa", temp, press) < 0) return;
+                if (web_printf(", %.1f&nbsp;%% RH</dd>", rh) < 0) return;
             }
         }
 
@@ -130,48 +247,39 @@ static void handle_index(int s, wificfg_method method,
             uint16_t r1 = 0;
 
             if (pms_last_data(&pm1a, &pm25a, &pm10a, &pm1b, &pm25b, &pm10b, &c1, &c2, &c3, &c4, &c5, &c6, &r1)) {
-                if (wificfg_write_string(s, "<dt>PM1.0</dt>") < 0) return;
-                snprintf(buf, len, "<dd>%u / %u</dd>", pm1a, pm1b);
-                if (wificfg_write_string(s, buf) < 0) return;
-                if (wificfg_write_string(s, "<dt>PM2.5</dt>") < 0) return;
-                snprintf(buf, len, "<dd>%u / %u</dd>", pm25a, pm25b);
-                if (wificfg_write_string(s, buf) < 0) return;
-                if (wificfg_write_string(s, "<dt>PM10</dt>") < 0) return;
-                snprintf(buf, len, "<dd>%u / %u</dd>", pm10a, pm10b);
-                if (wificfg_write_string(s, buf) < 0) return;
-
-                if (wificfg_write_string(s, "<dt>0.3&#x00b5;m</dt>") < 0) return;
-                snprintf(buf, len, "<dd>%u</dd>", c1);
-                if (wificfg_write_string(s, buf) < 0) return;
-                if (wificfg_write_string(s, "<dt>0.5&#x00b5;m</dt>") < 0) return;
-                snprintf(buf, len, "<dd>%u</dd>", c2);
-                if (wificfg_write_string(s, buf) < 0) return;
-                if (wificfg_write_string(s, "<dt>1.0&#x00b5;m</dt>") < 0) return;
-                snprintf(buf, len, "<dd>%u</dd>", c3);
-                if (wificfg_write_string(s, buf) < 0) return;
-                if (wificfg_write_string(s, "<dt>2.5&#x00b5;m</dt>") < 0) return;
-                snprintf(buf, len, "<dd>%u</dd>", c4);
-                if (wificfg_write_string(s, buf) < 0) return;
-                if (wificfg_write_string(s, "<dt>5.0&#x00b5;m</dt>") < 0) return;
-                snprintf(buf, len, "<dd>%u</dd>", c5);
-                if (wificfg_write_string(s, buf) < 0) return;
-                if (wificfg_write_string(s, "<dt>10&#x00b5;m</dt>") < 0) return;
-                snprintf(buf, len, "<dd>%u</dd>", c6);
-                if (wificfg_write_string(s, buf) < 0) return;
-
-                if (wificfg_write_string(s, "<dt>Version</dt>") < 0) return;
-                snprintf(buf, len, "<dd>%u</dd>", r1 >> 8);
-                if (wificfg_write_string(s, buf) < 0) return;
-                if (wificfg_write_string(s, "<dt>Error code</dt>") < 0) return;
-                snprintf(buf, len, "<dd>%u</dd>", r1 & 0xff);
-                if (wificfg_write_string(s, buf) < 0) return;
+                if (web_write_string("<dt>PM1.0</dt>") < 0) return;
+                if (web_printf("<dd>%u / %u</dd>", pm1a, pm1b) < 0) return;
+                if (web_write_string("<dt>PM2.5</dt>") < 0) return;
+                if (web_printf("<dd>%u / %u</dd>", pm25a, pm25b) < 0) return;
+                if (web_write_string("<dt>PM10</dt>") < 0) return;
+                if (web_printf("<dd>%u / %u</dd>", pm10a, pm10b) < 0) return;
+
+                if (web_write_string("<dt>0.3&#x00b5;m</dt>") < 0) return;
+                if (web_printf("<dd>%u</dd>", c1) < 0) return;
+                if (web_write_string("<dt>0.5&#x00b5;m</dt>") < 0) return;
+                if (web_printf("<dd>%u</dd>", c2) < 0) return;
+                if (web_write_string("<dt>1.0&#x00b5;m</dt>") < 0) return;
+                if (web_printf("<dd>%u</dd>", c3) < 0) return;
+                if (web_write_string("<dt>2.5&#x00b5;m</dt>") < 0) return;
+                if (web_printf("<dd>%u</dd>", c4) < 0) return;
+                if (web_write_string("<dt>5.0&#x00b5;m</dt>") < 0) return;
+                if (web_printf("<dd>%u</dd>", c5) < 0) return;
+                if (web_write_string("<dt>10&#x00b5;m</dt>") < 0) return;
+                if (web_printf("<dd>%u</dd>", c6) < 0) return;
+
+                if (web_write_string("<dt>Version</dt>") < 0) return;
+                if (web_printf("<dd>%u</dd>", r1 >> 8) < 0) return;
+                if (web_write_string("<dt>Error code</dt>") < 0) return;
+                if (web_printf("<dd>%u</dd>", r1 & 0xff) < 0) return;
             }
         }
 
-        if (wificfg_write_string(s, "</dl>") < 0) return;
+        if (web_write_string("</dl>") < 0) return;
 
-        if (wificfg_write_string(s, http_index_content[1]) < 0) return;
+        if (web_write_string(http_index_content[1]) < 0) return;
     }
+
+    web_flush();
 }
 
 
@@ -181,7 +289,7 @@ static const char *http_config_content[] = {
 
 static char base64codes[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/=";
 
-static int write_base64(int s, uint8_t *in, size_t len)
+static int write_base64(uint8_t *in, size_t len)
 {
     int i;
     for (i = 0; i < len; i += 3)  {
@@ -206,9 +314,8 @@ static int write_base64(int s, uint8_t *in, size_t len)
             buf[2] = '=';
             buf[3] = '=';
         }
-        int count = write(s, buf, 4);
-        if (count < 4)
-            return count;
+        if (web_write(buf, 4) < 0)
+            return -1;
     }
     return len;
 }
@@ -218,64 +325,73 @@ static void handle_config(int s, wificfg_method method,
                            wificfg_content_type content_type,
                            char *buf, size_t len)
 {
-    if (wificfg_write_string(s, http_success_header) < 0) return;
+    web_begin(s);
+    if (web_write_string(http_success_header) < 0) return;
 
     if (method != HTTP_METHOD_HEAD) {
-        if (wificfg_write_string(s, http_config_content[0]) < 0) return;
+        if (web_write_string(http_config_content[0]) < 0) return;
 
         int8_t board = 0; /* Nodemcu */
         sysparam_get_int8("oaq_board", &board);
-        if (board == 0 && wificfg_write_string(s, " selected") < 0) return;
-        if (wificfg_write_string(s, http_config_content[1]) < 0) return;
-        if (board == 1 && wificfg_write_string(s, " selected") < 0) return;
-        if (wificfg_write_string(s, http_config_content[2]) < 0) return;
+        if (board == 0 && web_write_string(" selected") < 0) return;
+        if (web_write_string(http_config_content[1]) < 0) return;
+        if (board == 1 && web_write_string(" selected") < 0) return;
+        if (web_write_string(http_config_content[2]) < 0) return;
 
         int8_t pms_uart = 1; /* Enabled, RX */
         sysparam_get_int8("oaq_pms_uart", &pms_uart);
-        if (pms_uart == 0 && wificfg_write_string(s, " selected") < 0) return;
-        if (wificfg_write_string(s, http_config_content[3]) < 0) return;
-        if (pms_uart == 1 && wificfg_write_string(s, " selected") < 0) return;
-        if (wificfg_write_string(s, http_config_content[4]) < 0) return;
-        if (pms_uart == 2 && wificfg_write_string(s, " selected") < 0) return;
-        if (wificfg_write_string(s, http_config_content[5]) < 0) return;
+        if (pms_uart == 0 && web_write_string(" selected") < 0) return;
+        if (web_write_string(http_config_content[3]) < 0) return;
+        if (pms_uart == 1 && web_write_string(" selected") < 0) return;
+        if (web_write_string(http_config_content[4]) < 0) return;
+        if (pms_uart == 2 && web_write_string(" selected") < 0) return;
+        if (web_write_string(http_config_content[5]) < 0) return;
+        if (pms_uart == 3 && web_write_string(" selected") < 0) return;
+        if (web_write_string(http_config_content[6]) < 0) return;
 
         int8_t i2c_scl = 0;
         sysparam_get_int8("oaq_i2c_scl", &i2c_scl);
-        snprintf(buf, len, "%d", i2c_scl);
-        if (wificfg_write_string(s, buf) < 0) return;
+        if (web_printf("%d", i2c_scl) < 0) return;
 
-        if (wificfg_write_string(s, http_config_content[6]) < 0) return;
+        if (web_write_string(http_config_content[7]) < 0) return;
 
         int8_t i2c_sda = 2;
         sysparam_get_int8("oaq_i2c_sda", &i2c_sda);
-        snprintf(buf, len, "%d", i2c_sda);
-        if (wificfg_write_string(s, buf) < 0) return;
+        if (web_printf("%d", i2c_sda) < 0) return;
 
-        if (wificfg_write_string(s, http_config_content[7]) < 0) return;
+        if (web_write_string(http_config_content[8]) < 0) return;
 
         int8_t tz = 0;
         sysparam_get_int8("oaq_tz", &tz);
-        snprintf(buf, len, "%d", tz);
-        if (wificfg_write_string(s, buf) < 0) return;
+        if (web_printf("%d", tz) < 0) return;
 
-        if (wificfg_write_string(s, http_config_content[8]) < 0) return;
+        if (web_write_string(http_config_content[9]) < 0) return;
 
         char *web_server = NULL;
         sysparam_get_string("oaq_web_server", &web_server);
         if (web_server) {
             wificfg_html_escape(web_server, buf, len);
             free(web_server);
-            if (wificfg_write_string(s, buf) < 0) return;
+            if (web_write_string(buf) < 0) return;
         }
 
-        if (wificfg_write_string(s, http_config_content[9]) < 0) return;
+        if (web_write_string(http_config_content[10]) < 0) return;
+
+        char *web_ip = NULL;
+        sysparam_get_string("oaq_web_ip", &web_ip);
+        if (web_ip) {
+            wificfg_html_escape(web_ip, buf, len);
+            free(web_ip);
+            if (web_write_string(buf) < 0) return;
+        }
+
+        if (web_write_string(http_config_content[11]) < 0) return;
 
         int32_t web_port = 80;
         sysparam_get_int32("oaq_web_port", &web_port);
-        snprintf(buf, len, "%d", web_port);
-        if (wificfg_write_string(s, buf) < 0) return;
+        if (web_printf("%d", web_port) < 0) return;
 
-        if (wificfg_write_string(s, http_config_content[10]) < 0) return;
+        if (web_write_string(http_config_content[12]) < 0) return;
 
         char *web_path = NULL;
         sysparam_get_string("oaq_web_path", &web_path);
@@ -285,28 +401,28 @@ static void handle_config(int s, wificfg_method method,
         } else {
             wificfg_html_escape("/cgi-bin/recv", buf, len);
         }
-        if (wificfg_write_string(s, buf) < 0) return;
+        if (web_write_string(buf) < 0) return;
 
-        if (wificfg_write_string(s, http_config_content[11]) < 0) return;
+        if (web_write_string(http_config_content[13]) < 0) return;
 
         int32_t sensor_id = 0;
         if (sysparam_get_int32("oaq_sensor_id", &sensor_id) == SYSPARAM_OK) {
-            snprintf(buf, len, "%u", sensor_id);
-            if (wificfg_write_string(s, buf) < 0) return;
+            if (web_printf("%u", sensor_id) < 0) return;
         }
 
-        if (wificfg_write_string(s, http_config_content[12]) < 0) return;
+        if (web_write_string(http_config_content[14]) < 0) return;
 
         uint8_t *sha3_key = NULL;
         size_t actual_length;
         if (sysparam_get_data("oaq_sha3_key", &sha3_key, &actual_length, NULL) == SYSPARAM_OK) {
             if (sha3_key) {
-                if (write_base64(s, sha3_key, actual_length) < actual_length) return;
+                int count = write_base64(sha3_key, actual_length);
                 free(sha3_key);
+                if (count < 0) return;
             }
         }
 
-        if (wificfg_write_string(s, http_config_content[13]) < 0) return;
+        if (web_write_string(http_config_content[15]) < 0) return;
 
         struct tm time;
         xSemaphoreTake(i2c_sem, portMAX_DELAY);
@@ -319,46 +435,41 @@ static void handle_config(int s, wificfg_method method,
             clock_time -= tz * 60 * 60;
             gmtime_r(&clock_time, &time);
 
-            if (wificfg_write_string(s, http_config_content[14]) < 0) return;
+            if (web_write_string(http_config_content[16]) < 0) return;
 
-            snprintf(buf, len, "%d", time.tm_year + 1900);
-            if (wificfg_write_string(s, buf) < 0) return;
+            if (web_printf("%d", time.tm_year + 1900) < 0) return;
 
-            if (wificfg_write_string(s, http_config_content[15]) < 0) return;
+            if (web_write_string(http_config_content[17]) < 0) return;
 
-            snprintf(buf, len, "%d", time.tm_mon + 1);
-            if (wificfg_write_string(s, buf) < 0) return;
+            if (web_printf("%d", time.tm_mon + 1) < 0) return;
 
-            if (wificfg_write_string(s, http_config_content[16]) < 0) return;
+            if (web_write_string(http_config_content[18]) < 0) return;
 
-            snprintf(buf, len, "%d", time.tm_mday);
-            if (wificfg_write_string(s, buf) < 0) return;
+            if (web_printf("%d", time.tm_mday) < 0) return;
 
-            if (wificfg_write_string(s, http_config_content[17]) < 0) return;
+            if (web_write_string(http_config_content[19]) < 0) return;
 
-            snprintf(buf, len, "%d", time.tm_wday + 1);
-            if (wificfg_write_string(s, buf) < 0) return;
+            if (web_printf("%d", time.tm_wday + 1) < 0) return;
 
-            if (wificfg_write_string(s, http_config_content[18]) < 0) return;
+            if (web_write_string(http_config_content[20]) < 0) return;
 
-            snprintf(buf, len, "%d", time.tm_hour);
-            if (wificfg_write_string(s, buf) < 0) return;
+            if (web_printf("%d", time.tm_hour) < 0) return;
 
-            if (wificfg_write_string(s, http_config_content[19]) < 0) return;
+            if (web_write_string(http_config_content[21]) < 0) return;
 
-            snprintf(buf, len, "%d", time.tm_min);
-            if (wificfg_write_string(s, buf) < 0) return;
+            if (web_printf("%d", time.tm_min) < 0) return;
 
-            if (wificfg_write_string(s, http_config_content[20]) < 0) return;
+            if (web_write_string(http_config_content[22]) < 0) return;
 
-            snprintf(buf, len, "%d", time.tm_sec);
-            if (wificfg_write_string(s, buf) < 0) return;
+            if (web_printf("%d", time.tm_sec) < 0) return;
 
-            if (wificfg_write_string(s, http_config_content[21]) < 0) return;
+            if (web_write_string(http_config_content[23]) < 0) return;
         }
 
-        if (wificfg_write_string(s, http_config_content[22]) < 0) return;
+        if (web_write_string(http_config_content[24]) < 0) return;
     }
+
+    web_flush();
 }
 
 typedef enum {
@@ -368,6 +479,7 @@ typedef enum {
     FORM_NAME_I2C_SDA,
     FORM_NAME_TZ,
     FORM_NAME_WEB_SERVER,
+    FORM_NAME_WEB_IP,
     FORM_NAME_WEB_PORT,
     FORM_NAME_WEB_PATH,
     FORM_NAME_SENSOR_ID,
@@ -384,6 +496,10 @@ typedef enum {
     FORM_NAME_INDEX,
     FORM_NAME_START,
     FORM_NAME_END,
+    FORM_NAME_FROM,
+    FORM_NAME_TO,
+    FORM_NAME_SIZE,
+    FORM_NAME_TIMEOUT,
     FORM_NAME_NONE
 } form_name;
 
@@ -397,6 +513,7 @@ static const struct {
     {"oaq_i2c_sda", FORM_NAME_I2C_SDA},
     {"oaq_tz", FORM_NAME_TZ},
     {"oaq_web_server", FORM_NAME_WEB_SERVER},
+    {"oaq_web_ip", FORM_NAME_WEB_IP},
     {"oaq_web_port", FORM_NAME_WEB_PORT},
     {"oaq_web_path", FORM_NAME_WEB_PATH},
     {"oaq_sensor_id", FORM_NAME_SENSOR_ID},
@@ -413,6 +530,10 @@ static const struct {
     {"oaq_index", FORM_NAME_INDEX},
     {"oaq_start", FORM_NAME_START},
     {"oaq_end", FORM_NAME_END},
+    {"oaq_from", FORM_NAME_FROM},
+    {"oaq_to", FORM_NAME_TO},
+    {"oaq_size", FORM_NAME_SIZE},
+    {"oaq_timeout", FORM_NAME_TIMEOUT},
 };
 
 static form_name intern_form_name(char *str)
@@ -566,7 +687,7 @@ static void handle_config_post(int s, wificfg_method method,
                 }
                 case FORM_NAME_PMS_UART: {
                     int8_t uart = strtol(buf, NULL, 10);
-                    if (uart >= 0 && uart <= 2)
+                    if (uart >= 0 && uart <= 3)
                         sysparam_set_int8("oaq_pms_uart", uart);
                     break;
                 }
@@ -592,6 +713,10 @@ static void handle_config_post(int s, wificfg_method method,
                     sysparam_set_string("oaq_web_server", buf);
                     break;
                 }
+                case FORM_NAME_WEB_IP: {
+                    sysparam_set_string("oaq_web_ip", buf);
+                    break;
+                }
                 case FORM_NAME_WEB_PORT: {
                     int32_t port = strtol(buf, NULL, 10);
                     if (port >= 0 && port <= 65535)
@@ -719,8 +844,20 @@ static void handle_time_post(int s, wificfg_method method,
 }
 
 
-static const char *http_buffer_size_content[] = {
-#include "content/bufsize.html"
+/*
+ * This page is static so it is served pre-compressed, generated from
+ * content/bufsize.html by 'make content', see tools/oaq-content.c. Browsers
+ * all accept gzip so the request Accept-Encoding is not checked, and the
+ * wificfg server does not pass it to the handlers.
+ */
+static const char http_success_gzip_header[] = "HTTP/1.0 200 \r\n"
+    "Content-Type: text/html; charset=utf-8\r\n"
+    "Content-Encoding: gzip\r\n"
+    "Cache-Control: no-store\r\n"
+    "\r\n";
+
+static const uint8_t http_buffer_size_content_gz[] = {
+#include "content/bufsize.html.gz.h"
 };
 
 static void handle_buffer_size(int s, wificfg_method method,
@@ -728,11 +865,15 @@ static void handle_buffer_size(int s, wificfg_method method,
                                wificfg_content_type content_type,
                                char *buf, size_t len)
 {
-    if (wificfg_write_string(s, http_success_header) < 0) return;
+    web_begin(s);
+    if (web_write_string(http_success_gzip_header) < 0) return;
 
     if (method != HTTP_METHOD_HEAD) {
-        if (wificfg_write_string(s, http_buffer_size_content[0]) < 0) return;
+        if (web_write(http_buffer_size_content_gz,
+                      sizeof(http_buffer_size_content_gz)) < 0) return;
     }
+
+    web_flush();
 }
 
 static uint64_t last_client_utime = 0;
@@ -771,6 +912,7 @@ void log_client_utime(uint32_t utimeh, uint32_t utimel)
                 last_client_utime_index = new_index;
                 last_logged_client_utime = 0;
             }
+            dbuf_note_time(utime / 1000);
             /*
              * Commit the values logged. Note this is the only task
              * accessing this state so these updates are synchronized
@@ -849,6 +991,205 @@ static void handle_buffer_size_post(int s, wificfg_method method,
     if (wificfg_write_string(s, buf) < 0) return;
 }
 
+/*
+ * Wait for new data, as an alternative to polling /bufsize. The response is
+ * held until the head buffer moves past the given oaq_index and oaq_size, or
+ * until oaq_timeout msec, and then the head buffer index and size are returned
+ * as for /bufsize. The head buffer is in memory, so this responds to new events
+ * as they are logged, before they are saved to flash. The web server handles
+ * one request at a time, so the timeout is limited to BUFWAIT_MAX_TIMEOUT.
+ */
+#define BUFWAIT_MAX_TIMEOUT 30000
+
+static void handle_buffer_wait_post(int s, wificfg_method method,
+                                    uint32_t content_length,
+                                    wificfg_content_type content_type,
+                                    char *buf, size_t len)
+{
+    if (content_type != HTTP_CONTENT_TYPE_WWW_FORM_URLENCODED) {
+        wificfg_write_string(s, "HTTP/1.0 400 \r\nContent-Type: text/html\r\n\r\n");
+        return;
+    }
+
+    size_t rem = content_length;
+    bool valp = false;
+    uint32_t utimeh = 0;
+    uint32_t utimel = 0;
+    uint32_t requested_index = 0;
+    uint32_t requested_size = 0;
+    uint32_t timeout = BUFWAIT_MAX_TIMEOUT;
+
+    while (rem > 0) {
+        int r = wificfg_form_name_value(s, &valp, &rem, buf, len);
+
+        if (r < 0)
+            break;
+
+        wificfg_form_url_decode(buf);
+
+        form_name name = intern_form_name(buf);
+
+        if (valp) {
+            int r = wificfg_form_name_value(s, NULL, &rem, buf, len);
+            if (r < 0)
+                break;
+
+            wificfg_form_url_decode(buf);
+
+            switch (name) {
+            case FORM_NAME_UTIMEH: {
+                utimeh = strtol(buf, NULL, 10);
+                break;
+            }
+            case FORM_NAME_UTIMEL: {
+                utimel = strtol(buf, NULL, 10);
+                break;
+            }
+            case FORM_NAME_INDEX: {
+                requested_index = strtol(buf, NULL, 10);
+                break;
+            }
+            case FORM_NAME_SIZE: {
+                requested_size = strtol(buf, NULL, 10);
+                break;
+            }
+            case FORM_NAME_TIMEOUT: {
+                timeout = strtol(buf, NULL, 10);
+                break;
+            }
+            default:
+                break;
+            }
+        }
+    }
+
+    log_client_utime(utimeh, utimel);
+
+    if (timeout > BUFWAIT_MAX_TIMEOUT)
+        timeout = BUFWAIT_MAX_TIMEOUT;
+
+    uint32_t index = 0;
+    uint32_t size = dbuf_wait(requested_index, requested_size, timeout, &index);
+    if (wificfg_write_string(s, http_success_json_header) < 0) return;
+    snprintf(buf, len, "{\"index\":%d,\"size\":%d}", index, size);
+    if (wificfg_write_string(s, buf) < 0) return;
+}
+
+/*
+ * Benchmark the MAC-SHA3 signature computation, reporting the time to hash
+ * SHA3_BENCH_SIZE bytes and the CPU cycles per byte. This is the cost of
+ * signing a full sector when posting it.
+ */
+#define SHA3_BENCH_SIZE 4096
+
+static void handle_sha3_bench(int s, wificfg_method method,
+                              uint32_t content_length,
+                              wificfg_content_type content_type,
+                              char *buf, size_t len)
+{
+    static KeccakSponge sponge;
+    uint8_t digest[28];
+    uint32_t total = 0;
+
+    memset(buf, 0x5a, len);
+    uint32_t start = sdk_system_get_time();
+    FIPS202_SHA3_224_Init(&sponge);
+    while (total < SHA3_BENCH_SIZE) {
+        uint32_t size = SHA3_BENCH_SIZE - total;
+        if (size > len)
+            size = len;
+        Keccak_Absorb(&sponge, (uint8_t *)buf, size);
+        total += size;
+    }
+    FIPS202_SHA3_224_Final(&sponge, digest);
+    uint32_t usec = sdk_system_get_time() - start;
+    uint32_t cycles = usec * sdk_system_get_cpu_freq();
+
+    if (wificfg_write_string(s, http_success_json_header) < 0) return;
+    snprintf(buf, len, "{\"bytes\":%u,\"usec\":%u,\"cycles_per_byte\":%u}",
+             total, usec, cycles / total);
+    if (wificfg_write_string(s, buf) < 0) return;
+}
+
+/*
+ * Write a duration statistic as a JSON member. It is copied in a critical
+ * section so that the members are consistent.
+ */
+static int write_stat_time(const char *name, stat_time_t *stat)
+{
+    stat_time_t copy;
+    taskENTER_CRITICAL();
+    copy = *stat;
+    taskEXIT_CRITICAL();
+    return web_printf(",\"%s\":{\"count\":%u,\"total_usec\":%u,\"max_usec\":%u}",
+                      name, copy.count, copy.total, copy.max);
+}
+
+/*
+ * Run-time statistics, for finding stalls on a node in operation. The task
+ * run times are in RTC counter units, see FreeRTOSConfig.h, and the cpu share
+ * is in tenths of a percent of the total since start-up. The stack high-water
+ * marks are the minimum free stack of each task, in words. The durations are
+ * counts, wrapping totals, and the maximums in usec since start-up.
+ */
+static void handle_stats(int s, wificfg_method method,
+                         uint32_t content_length,
+                         wificfg_content_type content_type,
+                         char *buf, size_t len)
+{
+    web_begin(s);
+    if (web_write_string(http_success_json_header) < 0) return;
+
+    if (method == HTTP_METHOD_HEAD) {
+        web_flush();
+        return;
+    }
+
+    if (web_printf("{\"free_heap\":%u,\"tasks\":[", xPortGetFreeHeapSize()) < 0) return;
+
+    /* Allow for a few tasks being created meanwhile. */
+    UBaseType_t num_tasks = uxTaskGetNumberOfTasks() + 2;
+    TaskStatus_t *tasks = malloc(num_tasks * sizeof(TaskStatus_t));
+    if (tasks) {
+        uint32_t total_runtime;
+        num_tasks = uxTaskGetSystemState(tasks, num_tasks, &total_runtime);
+        /* Avoid overflow and division by zero computing the share. */
+        uint32_t total = total_runtime / 1000 + 1;
+        UBaseType_t i;
+        for (i = 0; i < num_tasks; i++) {
+            if (web_printf("%s{\"name\":\"%s\",\"priority\":%u,\"runtime\":%u,\"cpu\":%u,\"stack_free\":%u}",
+                           i > 0 ? "," : "", tasks[i].pcTaskName,
+                           tasks[i].uxCurrentPriority, tasks[i].ulRunTimeCounter,
+                           tasks[i].ulRunTimeCounter / total,
+                           tasks[i].usStackHighWaterMark) < 0) {
+                free(tasks);
+                return;
+            }
+        }
+        free(tasks);
+    }
+    if (web_write_string("]") < 0) return;
+
+    if (write_stat_time("dbufs_sem_wait", &stat_dbufs_sem_wait) < 0) return;
+    if (write_stat_time("dbufs_sem_hold", &stat_dbufs_sem_hold) < 0) return;
+    if (write_stat_time("flash_sem_wait", &stat_flash_sem_wait) < 0) return;
+    if (write_stat_time("flash_sem_hold", &stat_flash_sem_hold) < 0) return;
+    if (write_stat_time("dbuf_append", &stat_dbuf_append) < 0) return;
+    if (write_stat_time("flash_erase", &stat_flash_erase) < 0) return;
+    if (write_stat_time("flash_write", &stat_flash_write) < 0) return;
+    if (write_stat_time("flash_verify", &stat_flash_verify) < 0) return;
+    if (write_stat_time("post", &stat_post) < 0) return;
+
+    if (web_printf(",\"post_bytes\":%u,\"post_failures\":%u,\"post_hold_off\":%u",
+                   stat_post_bytes, stat_post_failures, stat_post_hold_off) < 0) return;
+    if (web_printf(",\"pms_checksum_failures\":%u,\"dbufs_dropped\":%u,\"dbuf_events_dropped\":%u",
+                   stat_pms_checksum_failures, dbufs_dropped,
+                   dbuf_events_dropped) < 0) return;
+    if (web_printf(",\"flash_erases\":%u,\"flash_write_failures\":%u,\"flash_index_invalidate_failures\":%u}",
+                         flash_erases, flash_write_failures, flash_index_invalidate_failures) < 0) return;
+    web_flush();
+}
+
 static const char http_success_binary_header[] = "HTTP/1.0 200 \r\n"
     "Content-Type: application/octet-stream\r\n"
     "Access-Control-Allow-Origin: *\r\n"
@@ -925,22 +1266,13 @@ static void handle_get_buffer_post(int s, wificfg_method method,
      * removed during the request then the response is truncated, and
      * the client is expected to notice such an error.
      */
-    uint32_t index = 0;
-    uint32_t size = get_buffer_size(requested_index, &index);
-
-    if (index != requested_index) {
+    buffer_cursor_t cursor;
+    if (!open_buffer_cursor(&cursor, requested_index, start, end)) {
         wificfg_write_string(s, "HTTP/1.0 404 \r\nContent-Type: text/html\r\nAccess-Control-Allow-Origin: *\r\n\r\n");
         return;
     }
 
-    if (start >= size)
-        start = size;
-    if (end >= size)
-        end = size;
-    if (end < start)
-        end = start;
-
-    uint32_t length = end - start;
+    uint32_t length = cursor.end - cursor.offset;
     if (wificfg_write_string(s, http_success_binary_header) < 0) return;
     snprintf(buf, len, "Content-Length: %d\r\n\r\n", length);
     if (wificfg_write_string(s, buf) < 0) return;
@@ -958,21 +1290,226 @@ static void handle_get_buffer_post(int s, wificfg_method method,
 
     if (length > 0) {
         uint32_t chunk = 4 + length > len ? len - 4 : length;
-        if (!get_buffer_range(index, start, start + chunk, 4 + (uint8_t *)buf)) return;
+        if (read_buffer_cursor(&cursor, 4 + (uint8_t *)buf, chunk) != chunk) return;
         if (write(s, buf, 4 + chunk) < 0) return;
-        start += chunk;
         length -= chunk;
     }
 
     while (length > 0) {
         uint32_t chunk = length > len ? len : length;
-        if (!get_buffer_range(index, start, start + chunk, (uint8_t *)buf)) return;
+        if (read_buffer_cursor(&cursor, (uint8_t *)buf, chunk) != chunk) return;
         if (write(s, buf, chunk) < 0) return;
-        start += chunk;
         length -= chunk;
     }
 }
 
+/*
+ * Bulk export of the buffers with indexes from oaq_from to oaq_to inclusive,
+ * limited to those saved to flash, in a single response for downloading the
+ * data in the field. Each buffer is sent as its index and its size, as 32 bit
+ * little endian words, followed by the buffer content to that size which
+ * excludes the trailing 0xff fill. A buffer no longer available when reached
+ * is skipped. If a buffer is removed while being sent then the response is
+ * truncated, and the client is expected to notice such an error.
+ */
+static void handle_get_buffers_post(int s, wificfg_method method,
+                                    uint32_t content_length,
+                                    wificfg_content_type content_type,
+                                    char *buf, size_t len)
+{
+    if (content_type != HTTP_CONTENT_TYPE_WWW_FORM_URLENCODED) {
+        wificfg_write_string(s, "HTTP/1.0 400 \r\nContent-Type: text/html\r\n\r\n");
+        return;
+    }
+
+    size_t rem = content_length;
+    bool valp = false;
+    uint32_t utimeh = 0;
+    uint32_t utimel = 0;
+    uint32_t from = 0;
+    uint32_t to = 0xffffffff;
+
+    while (rem > 0) {
+        int r = wificfg_form_name_value(s, &valp, &rem, buf, len);
+
+        if (r < 0)
+            break;
+
+        wificfg_form_url_decode(buf);
+
+        form_name name = intern_form_name(buf);
+
+        if (valp) {
+            int r = wificfg_form_name_value(s, NULL, &rem, buf, len);
+            if (r < 0)
+                break;
+
+            wificfg_form_url_decode(buf);
+
+            switch (name) {
+            case FORM_NAME_UTIMEH: {
+                utimeh = strtol(buf, NULL, 10);
+                break;
+            }
+            case FORM_NAME_UTIMEL: {
+                utimel = strtol(buf, NULL, 10);
+                break;
+            }
+            case FORM_NAME_FROM: {
+                from = strtoul(buf, NULL, 10);
+                break;
+            }
+            case FORM_NAME_TO: {
+                to = strtoul(buf, NULL, 10);
+                break;
+            }
+            default:
+                break;
+            }
+        }
+    }
+
+    log_client_utime(utimeh, utimel);
+
+    uint32_t oldest, newest;
+    if (!get_buffer_index_range(&oldest, &newest)) {
+        oldest = 1;
+        newest = 0;
+    }
+    if (from < oldest)
+        from = oldest;
+    if (to > newest)
+        to = newest;
+
+    /* The length is not known in advance, so the response extends to the
+     * close of the connection. */
+    if (wificfg_write_string(s, http_success_binary_header) < 0) return;
+    if (wificfg_write_string(s, "\r\n") < 0) return;
+
+    uint32_t index;
+    for (index = from; index <= to && index >= from; index++) {
+        buffer_cursor_t cursor;
+        if (!open_buffer_cursor(&cursor, index, 0, 4096))
+            continue;
+
+        uint32_t length = cursor.end;
+        buf[0] = index;
+        buf[1] = index >>  8;
+        buf[2] = index >> 16;
+        buf[3] = index >> 24;
+        buf[4] = length;
+        buf[5] = length >>  8;
+        buf[6] = length >> 16;
+        buf[7] = length >> 24;
+
+        uint32_t chunk = 8 + length > len ? len - 8 : length;
+        if (read_buffer_cursor(&cursor, 8 + (uint8_t *)buf, chunk) != chunk) return;
+        if (write(s, buf, 8 + chunk) < 0) return;
+        length -= chunk;
+
+        while (length > 0) {
+            uint32_t chunk = length > len ? len : length;
+            if (read_buffer_cursor(&cursor, (uint8_t *)buf, chunk) != chunk) return;
+            if (write(s, buf, chunk) < 0) return;
+            length -= chunk;
+        }
+    }
+}
+
+/*
+ * Find the buffers covering a range of real time, from oaq_from to oaq_to
+ * inclusive in seconds since the epoch, for downloading only these with
+ * /getbuffers. The real times are estimated from the time summary kept for the
+ * buffers sealed since startup, see dbuf_time_range(), and the response gives
+ * the oldest and newest indexes covered by the summary so that a client can
+ * fall back to decoding older buffers. Buffers of unknown time, before the
+ * first anchor, only fall within the range found if between buffers that do
+ * match. The range found is limited to the buffers still stored, and is empty,
+ * with from greater than to, if none match.
+ */
+static void handle_query_post(int s, wificfg_method method,
+                              uint32_t content_length,
+                              wificfg_content_type content_type,
+                              char *buf, size_t len)
+{
+    if (content_type != HTTP_CONTENT_TYPE_WWW_FORM_URLENCODED) {
+        wificfg_write_string(s, "HTTP/1.0 400 \r\nContent-Type: text/html\r\n\r\n");
+        return;
+    }
+
+    size_t rem = content_length;
+    bool valp = false;
+    uint32_t utimeh = 0;
+    uint32_t utimel = 0;
+    uint32_t from = 0;
+    uint32_t to = 0xffffffff;
+
+    while (rem > 0) {
+        int r = wificfg_form_name_value(s, &valp, &rem, buf, len);
+
+        if (r < 0)
+            break;
+
+        wificfg_form_url_decode(buf);
+
+        form_name name = intern_form_name(buf);
+
+        if (valp) {
+            int r = wificfg_form_name_value(s, NULL, &rem, buf, len);
+            if (r < 0)
+                break;
+
+            wificfg_form_url_decode(buf);
+
+            switch (name) {
+            case FORM_NAME_UTIMEH: {
+                utimeh = strtol(buf, NULL, 10);
+                break;
+            }
+            case FORM_NAME_UTIMEL: {
+                utimel = strtol(buf, NULL, 10);
+                break;
+            }
+            case FORM_NAME_FROM: {
+                from = strtoul(buf, NULL, 10);
+                break;
+            }
+            case FORM_NAME_TO: {
+                to = strtoul(buf, NULL, 10);
+                break;
+            }
+            default:
+                break;
+            }
+        }
+    }
+
+    log_client_utime(utimeh, utimel);
+
+    uint32_t oldest, newest, first, last;
+    bool found = dbuf_time_range(from, to, &oldest, &newest, &first, &last);
+
+    uint32_t stored_oldest, stored_newest;
+    if (found && get_buffer_index_range(&stored_oldest, &stored_newest)) {
+        if (first < stored_oldest)
+            first = stored_oldest;
+        if (last > stored_newest)
+            last = stored_newest;
+        found = first <= last;
+    } else {
+        found = false;
+    }
+    if (!found) {
+        first = 1;
+        last = 0;
+    }
+
+    if (wificfg_write_string(s, http_success_json_header) < 0) return;
+    snprintf(buf, len, "{\"oldest\":%u,\"newest\":%u,\"from\":%u,\"to\":%u}",
+             oldest, newest, first, last);
+    if (wificfg_write_string(s, buf) < 0) return;
+}
+
 static const wificfg_dispatch dispatch_list[] = {
     {"/", HTTP_METHOD_GET, handle_index, false},
     {"/index.html", HTTP_METHOD_GET, handle_index, false},
@@ -986,8 +1523,13 @@ static const wificfg_dispatch dispatch_list[] = {
     {"/bufsize.html", HTTP_METHOD_GET, handle_buffer_size, false},
     {"/bufsize", HTTP_METHOD_POST, handle_buffer_size_post, false},
     {"/bufsize.html", HTTP_METHOD_POST, handle_buffer_size_post, false},
+    {"/bufwait", HTTP_METHOD_POST, handle_buffer_wait_post, false},
     {"/getbuffer", HTTP_METHOD_POST, handle_get_buffer_post, false},
     {"/getbuffer.html", HTTP_METHOD_POST, handle_get_buffer_post, false},
+    {"/getbuffers", HTTP_METHOD_POST, handle_get_buffers_post, false},
+    {"/query", HTTP_METHOD_POST, handle_query_post, false},
+    {"/sha3bench", HTTP_METHOD_GET, handle_sha3_bench, false},
+    {"/stats", HTTP_METHOD_GET, handle_stats, false},
     {NULL, HTTP_METHOD_ANY, NULL}
 };
 